@@ -1,26 +1,56 @@
 bits 16
 org 0x7E00
 
+KERNEL_LBA equ 12
+KERNEL_SECTORS equ 384
+
 start:
     mov [boot_drive], dl
     mov si, msg_loading
     call print_string
 
+    mov ah, 0x08
+    mov dl, [boot_drive]
+    xor di, di
+    mov es, di
+    int 0x13
+    jc disk_error
+    and cx, 0x3F
+    mov [sectors_per_track], cx
+    movzx dx, dh
+    inc dx
+    mov [heads], dx
+
     mov ax, 0x1000
     mov es, ax
-    xor bx, bx
-
-    mov ah, 0x02
-    mov al, 128
-    mov ch, 0
-    mov cl, 12
-    mov dh, 0
+    mov word [lba], KERNEL_LBA
+    mov cx, KERNEL_SECTORS
+
+.read_sector:
+    push cx
+    mov ax, [lba]
+    xor dx, dx
+    div word [sectors_per_track]
+    mov cl, dl
+    inc cl
+    xor dx, dx
+    div word [heads]
+    mov ch, al
+    shl ah, 6
+    or cl, ah
+    mov dh, dl
     mov dl, [boot_drive]
+    xor bx, bx
+    mov ax, 0x0201
     int 0x13
     jc disk_error
 
-    cmp al, 128
-    jne disk_error
+    mov ax, es
+    add ax, 0x20
+    mov es, ax
+    inc word [lba]
+    pop cx
+    loop .read_sector
 
     mov si, msg_success
     call print_string
@@ -116,6 +146,9 @@ msg_loading db 'Loading EH-DSB...', 0
 msg_success db ' OK', 0x0D, 0x0A, 0
 msg_error db ' Error!', 0
 boot_drive db 0
+sectors_per_track dw 0
+heads dw 0
+lba dw 0
 
 ascii_art db 0x0D, 0x0A
           db '__________  ______________', 0x0D, 0x0A
@@ -1,20 +1,123 @@
 typedef unsigned char uint8_t;
 typedef signed char int8_t;
 typedef unsigned short uint16_t;
+typedef signed short int16_t;
 typedef unsigned int uint32_t;
 typedef signed int int32_t;
+typedef unsigned long long uint64_t;
+typedef signed long long int64_t;
+extern "C" uint64_t __udivmoddi4(uint64_t num, uint64_t den, uint64_t* rem);
 #define VGA_WIDTH 80
 #define VGA_HEIGHT 25
 #define VGA_BUFFER 0xB8000
-#define MAX_FILES 64
+#define MAX_FILES 1024
 #define MAX_FILE_SIZE 8192
-#define FS_METADATA_SIZE 4096
-#define FS_START 0x20000
+#define MAX_PATH 64
+#define FS_METADATA_SIZE 0x8000
+#define FS_START 0x340000
 #define FS_DATA_START (FS_START + FS_METADATA_SIZE)
-#define FS_TOTAL_SIZE 0x20000
+#define FS_TOTAL_SIZE 0x40000
+#define FS_INDEX (FS_START + FS_TOTAL_SIZE)
+#define FS_INDEX_NODES 128
+#define FS_FREE_LIST (FS_INDEX + 0x20000)
+#define FS_GENERATIONS (FS_FREE_LIST + 0x4000)
+#define FS_SERIALS (FS_GENERATIONS + MAX_FILES * 4)
+#define FS_ROOT 0xFFFF
+#define DIR_ORDER 32
+#define DIR_MAX_DEPTH 8
+#define FS_ALLOC_UNIT 16
+#define FS_NO_SPACE 0xFFFFFFFF
+#define FS_COMPACT_MS 250
+#define FS_VERSION 5
+#define FS_JOURNAL_OFFSET 0x7200
+#define FS_JOURNAL_SECTORS 7
+#define FS_JOURNAL_PER_SECTOR 12
+#define FS_JOURNAL_RECORDS (FS_JOURNAL_SECTORS * FS_JOURNAL_PER_SECTOR)
+#define FS_CHECKPOINT_MS 10000
+#define FILE_WINDOW 256
+#define FS_BENCH_FILES 10000
+#define FS_BENCH_INDEX_SIZE 16384
+#define FS_BENCH_NODES 1024
 #define MAX_INPUT_LEN 512
 #define MAX_COMMAND_HISTORY 50
 #define FS_MAGIC 0xE4F5D3B2
+#define FS_DISK_LBA 1024
+#define ATA_PRIMARY 0x1F0
+#define ATA_CONTROL 0x3F6
+#define ATA_TIMEOUT_MS 1000
+#define ATA_MAX_MULTIPLE 16
+#define ATA_BENCH_LBA 1536
+#define ATA_PRD_TABLE 0x290000
+#define ATA_DMA_MAX_SECTORS 256
+#define FDC_BASE 0x3F0
+#define FDC_DMA_BUFFER 0x2A0000
+#define FDC_CACHE_BASE 0x2B0000
+#define FDC_CACHE_TRACKS 8
+#define FDC_SECTORS 18
+#define FDC_TRACKS 160
+#define FDC_TRACK_SIZE (FDC_SECTORS * 512)
+#define FDC_TIMEOUT_MS 2000
+#define FDC_MOTOR_SPINUP_MS 300
+#define FDC_MOTOR_OFF_MS 2000
+#define FDC_RETRIES 3
+#define BCACHE_BASE 0x2D0000
+#define BCACHE_BLOCKS 512
+#define BCACHE_META (BCACHE_BASE + BCACHE_BLOCKS * 512)
+#define BCACHE_HASH 1024
+#define BCACHE_READ_BUFFER 0x320000
+#define BCACHE_WRITE_BUFFER 0x330000
+#define BCACHE_MAX_RUN 128
+#define BCACHE_READAHEAD_MIN 8
+#define BCACHE_READAHEAD_MAX 64
+#define BCACHE_WRITEBACK_MS 2000
+#define PIT_HZ 1193182
+#define CALIBRATE_MS 50
+#define MAX_PROFILE_ZONES 32
+#define MAX_LOCKS 32
+#define TIMER_HZ 1000
+#define IRQ_BASE 32
+#define MAX_SYMBOLS 1024
+#define SAMPLE_SHIFT 4
+#define SAMPLE_BUCKETS 8192
+#define SAMPLE_BUFFER 0x280000
+#define SCREEN_BACKUP 0x60000
+#define COM1_PORT 0x3F8
+#define SERIAL_TX_SIZE 4096
+#define MAX_CPUS 8
+#define TRACE_BUFFER 0x100000
+#define TRACE_EVENTS 4096
+#define BENCH_BUFFER 0x68000
+#define BENCH_MAX_SIZE 16384
+#define EVENT_QUEUE_SIZE 256
+#define INPUT_QUEUE_SIZE 128
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS 64
+#define TIMER_WHEEL_LEVELS 4
+#define AUTOSAVE_MS 30000
+#define CURSOR_BLINK_MS 500
+#define STATUS_MS 1500
+#define MOUSE_TIMEOUT_MS 100
+#define LATENCY_BUCKETS 16
+#define ISR_COUNT 64
+#define YIELD_VECTOR 48
+#define LAPIC_TIMER_VECTOR 49
+#define SPURIOUS_VECTOR 63
+#define LAPIC_TIMER_HZ 100
+#define AP_TRAMPOLINE 0x8000
+#define AP_STACKS 0x240000
+#define AP_STACK_SIZE 0x4000
+#define WAKE_VECTOR 50
+#define JOB_DEQUES 0x260000
+#define JOB_DEQUE_SIZE 256
+#define JOB_POOL_SIZE 512
+#define JOB_BENCH_BASE 0x400000
+#define JOB_BENCH_SIZE 0x400000
+#define GDT_ENTRIES 4
+#define TSS_SELECTOR 0x18
+#define MAX_THREADS 8
+#define THREAD_STACKS 0x1C0000
+#define THREAD_STACK_SIZE 0x10000
+#define SCHED_QUANTUM_MS 10
 static uint16_t* vga_buffer = (uint16_t*)VGA_BUFFER;
 static void outb(uint16_t port, uint8_t value) {
 asm volatile("outb %0, %1" : : "a"(value), "Nd"(port));
@@ -24,45 +127,357 @@ uint8_t result;
 asm volatile("inb %1, %0" : "=a"(result) : "Nd"(port));
 return result;
 }
+static void outl(uint16_t port, uint32_t value) {
+asm volatile("outl %0, %1" : : "a"(value), "Nd"(port));
+}
+static uint32_t inl(uint16_t port) {
+uint32_t result;
+asm volatile("inl %1, %0" : "=a"(result) : "Nd"(port));
+return result;
+}
 static void io_wait() {
 outb(0x80, 0);
 }
-static int strlen(const char* str) {
+static void insw(uint16_t port, void* buffer, uint32_t count) {
+asm volatile("rep insw" : "+D"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+static void outsw(uint16_t port, const void* buffer, uint32_t count) {
+asm volatile("rep outsw" : "+S"(buffer), "+c"(count) : "d"(port) : "memory");
+}
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t& a, uint32_t& b, uint32_t& c, uint32_t& d) {
+asm volatile("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(leaf), "c"(subleaf));
+}
+static inline uint64_t rdtsc() {
+uint32_t lo, hi;
+asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+return ((uint64_t)hi << 32) | lo;
+}
+class CPU {
+private:
+static void enable_a20() {
+uint8_t value = inb(0x92);
+if (!(value & 0x02)) outb(0x92, (value | 0x02) & ~0x01);
+}
+
+static void enable_sse() {
+uint32_t cr0, cr4;
+asm volatile("mov %%cr0, %0" : "=r"(cr0));
+cr0 &= ~(1 << 2);
+cr0 |= (1 << 1);
+asm volatile("mov %0, %%cr0" : : "r"(cr0));
+asm volatile("mov %%cr4, %0" : "=r"(cr4));
+cr4 |= (1 << 9) | (1 << 10);
+asm volatile("mov %0, %%cr4" : : "r"(cr4));
+asm volatile("fninit");
+}
+public:
+static char vendor[13];
+static bool has_tsc;
+static bool has_fxsr;
+static bool has_sse2;
+static bool has_erms;
+static bool has_apic;
+static void init() {
+enable_a20();
+uint32_t a, b, c, d;
+cpuid(0, 0, a, b, c, d);
+uint32_t max_leaf = a;
+*(uint32_t*)(vendor + 0) = b;
+*(uint32_t*)(vendor + 4) = d;
+*(uint32_t*)(vendor + 8) = c;
+vendor[12] = 0;
+if (max_leaf >= 1) {
+cpuid(1, 0, a, b, c, d);
+has_tsc = (d >> 4) & 1;
+has_fxsr = (d >> 24) & 1;
+has_apic = (d >> 9) & 1;
+has_sse2 = ((d >> 25) & 1) && ((d >> 26) & 1) && has_fxsr;
+}
+if (max_leaf >= 7) {
+cpuid(7, 0, a, b, c, d);
+has_erms = (b >> 9) & 1;
+}
+if (has_sse2) enable_sse();
+}
+
+static void init_ap() {
+if (has_sse2) enable_sse();
+}
+};
+char CPU::vendor[13] = {0};
+bool CPU::has_tsc = false;
+bool CPU::has_fxsr = false;
+bool CPU::has_sse2 = false;
+bool CPU::has_erms = false;
+bool CPU::has_apic = false;
+static void memcpy_bytes(void* dest, const void* src, uint32_t n) {
+uint8_t* d = (uint8_t*)dest;
+const uint8_t* s = (const uint8_t*)src;
+for (uint32_t i = 0; i < n; i++) d[i] = s[i];
+}
+static void memcpy_movsd(void* dest, const void* src, uint32_t n) {
+uint32_t dwords = n >> 2;
+uint32_t rest = n & 3;
+asm volatile("rep movsl\n\t"
+"mov %3, %%ecx\n\t"
+"rep movsb"
+: "+D"(dest), "+S"(src), "+c"(dwords) : "r"(rest) : "memory");
+}
+static void memcpy_erms(void* dest, const void* src, uint32_t n) {
+asm volatile("rep movsb" : "+D"(dest), "+S"(src), "+c"(n) : : "memory");
+}
+__attribute__((target("sse2"))) static void memcpy_sse2(void* dest, const void* src, uint32_t n) {
+uint8_t* d = (uint8_t*)dest;
+const uint8_t* s = (const uint8_t*)src;
+while (n && ((uint32_t)d & 15)) {
+*d++ = *s++;
+n--;
+}
+uint32_t blocks = n >> 6;
+if (blocks) {
+asm volatile("1:\n\t"
+"movdqu (%1), %%xmm0\n\t"
+"movdqu 16(%1), %%xmm1\n\t"
+"movdqu 32(%1), %%xmm2\n\t"
+"movdqu 48(%1), %%xmm3\n\t"
+"movdqa %%xmm0, (%0)\n\t"
+"movdqa %%xmm1, 16(%0)\n\t"
+"movdqa %%xmm2, 32(%0)\n\t"
+"movdqa %%xmm3, 48(%0)\n\t"
+"add $64, %0\n\t"
+"add $64, %1\n\t"
+"dec %2\n\t"
+"jnz 1b"
+: "+r"(d), "+r"(s), "+r"(blocks) : : "xmm0", "xmm1", "xmm2", "xmm3", "memory", "cc");
+}
+n &= 63;
+asm volatile("rep movsb" : "+D"(d), "+S"(s), "+c"(n) : : "memory");
+}
+static void memset_bytes(void* ptr, uint8_t value, uint32_t n) {
+uint8_t* p = (uint8_t*)ptr;
+for (uint32_t i = 0; i < n; i++) p[i] = value;
+}
+static void memset_stosd(void* ptr, uint8_t value, uint32_t n) {
+uint32_t pattern = value * 0x01010101u;
+uint32_t dwords = n >> 2;
+uint32_t rest = n & 3;
+asm volatile("rep stosl\n\t"
+"mov %3, %%ecx\n\t"
+"rep stosb"
+: "+D"(ptr), "+c"(dwords) : "a"(pattern), "r"(rest) : "memory");
+}
+static void memset_erms(void* ptr, uint8_t value, uint32_t n) {
+asm volatile("rep stosb" : "+D"(ptr), "+c"(n) : "a"(value) : "memory");
+}
+__attribute__((target("sse2"))) static void memset_sse2(void* ptr, uint8_t value, uint32_t n) {
+uint8_t* p = (uint8_t*)ptr;
+while (n && ((uint32_t)p & 15)) {
+*p++ = value;
+n--;
+}
+uint32_t blocks = n >> 6;
+if (blocks) {
+uint32_t pattern = value * 0x01010101u;
+asm volatile("movd %2, %%xmm0\n\t"
+"pshufd $0, %%xmm0, %%xmm0\n\t"
+"1:\n\t"
+"movdqa %%xmm0, (%0)\n\t"
+"movdqa %%xmm0, 16(%0)\n\t"
+"movdqa %%xmm0, 32(%0)\n\t"
+"movdqa %%xmm0, 48(%0)\n\t"
+"add $64, %0\n\t"
+"dec %1\n\t"
+"jnz 1b"
+: "+r"(p), "+r"(blocks) : "r"(pattern) : "xmm0", "memory", "cc");
+}
+n &= 63;
+asm volatile("rep stosb" : "+D"(p), "+c"(n) : "a"(value) : "memory");
+}
+static int strlen_bytes(const char* str) {
 int len = 0;
 while (str[len]) len++;
 return len;
 }
-static const char* strstr(const char* haystack, const char* needle) {
-if (!needle || !needle[0]) return haystack;
-for (; haystack && *haystack; ++haystack) {
-const char* h = haystack;
-const char* n = needle;
-while (*h && *n && *h == *n) { ++h; ++n; }
-if (!*n) return haystack;
+static int strlen_words(const char* str) {
+const char* p = str;
+while ((uint32_t)p & 3) {
+if (!*p) return p - str;
+p++;
+}
+const uint32_t* w = (const uint32_t*)p;
+while (!((*w - 0x01010101u) & ~*w & 0x80808080u)) w++;
+p = (const char*)w;
+while (*p) p++;
+return p - str;
+}
+__attribute__((target("sse2"))) static int strlen_sse2(const char* str) {
+uint32_t offset = (uint32_t)str & 15;
+const char* p = str - offset;
+uint32_t mask;
+asm volatile("pxor %%xmm0, %%xmm0\n\t"
+"movdqa (%1), %%xmm1\n\t"
+"pcmpeqb %%xmm0, %%xmm1\n\t"
+"pmovmskb %%xmm1, %0"
+: "=r"(mask) : "r"(p) : "xmm0", "xmm1", "memory");
+mask >>= offset;
+if (mask) return __builtin_ctz(mask);
+while (true) {
+p += 16;
+asm volatile("pxor %%xmm0, %%xmm0\n\t"
+"movdqa (%1), %%xmm1\n\t"
+"pcmpeqb %%xmm0, %%xmm1\n\t"
+"pmovmskb %%xmm1, %0"
+: "=r"(mask) : "r"(p) : "xmm0", "xmm1", "memory");
+if (mask) return (p - str) + __builtin_ctz(mask);
+}
+}
+static const void* memchr_bytes(const void* ptr, uint8_t value, uint32_t n) {
+const uint8_t* p = (const uint8_t*)ptr;
+for (uint32_t i = 0; i < n; i++) {
+if (p[i] == value) return p + i;
 }
 return 0;
 }
-static void strcpy(char* dest, const char* src) {
-int i = 0;
-while (src[i]) {
-dest[i] = src[i];
-i++;
+static const void* memchr_words(const void* ptr, uint8_t value, uint32_t n) {
+const uint8_t* p = (const uint8_t*)ptr;
+while (n && ((uint32_t)p & 3)) {
+if (*p == value) return p;
+p++;
+n--;
+}
+uint32_t pattern = value * 0x01010101u;
+while (n >= 4) {
+uint32_t v = *(const uint32_t*)p ^ pattern;
+if ((v - 0x01010101u) & ~v & 0x80808080u) break;
+p += 4;
+n -= 4;
+}
+return memchr_bytes(p, value, n);
+}
+__attribute__((target("sse2"))) static const void* memchr_sse2(const void* ptr, uint8_t value, uint32_t n) {
+const uint8_t* p = (const uint8_t*)ptr;
+while (n && ((uint32_t)p & 15)) {
+if (*p == value) return p;
+p++;
+n--;
+}
+uint32_t blocks = n >> 4;
+if (blocks) {
+uint32_t mask = value * 0x01010101u;
+asm volatile("movd %0, %%xmm0\n\t"
+"pshufd $0, %%xmm0, %%xmm0\n\t"
+"1:\n\t"
+"movdqa (%1), %%xmm1\n\t"
+"pcmpeqb %%xmm0, %%xmm1\n\t"
+"pmovmskb %%xmm1, %0\n\t"
+"test %0, %0\n\t"
+"jnz 2f\n\t"
+"add $16, %1\n\t"
+"dec %2\n\t"
+"jnz 1b\n\t"
+"2:"
+: "+r"(mask), "+r"(p), "+r"(blocks) : : "xmm0", "xmm1", "memory", "cc");
+if (mask) return p + __builtin_ctz(mask);
+}
+return memchr_bytes(p, value, n & 15);
+}
+typedef void (*memcpy_fn)(void*, const void*, uint32_t);
+typedef void (*memset_fn)(void*, uint8_t, uint32_t);
+typedef int (*strlen_fn)(const char*);
+typedef const void* (*memchr_fn)(const void*, uint8_t, uint32_t);
+struct MemVariant {
+const char* name;
+memcpy_fn copy;
+memset_fn fill;
+};
+class MemOps {
+public:
+static memcpy_fn copy;
+static memset_fn fill;
+static strlen_fn length;
+static memchr_fn find;
+static MemVariant variants[4];
+static int variant_count;
+static int selected;
+static void init() {
+variant_count = 0;
+variants[variant_count].name = "bytes";
+variants[variant_count].copy = memcpy_bytes;
+variants[variant_count].fill = memset_bytes;
+variant_count++;
+variants[variant_count].name = "movsd";
+variants[variant_count].copy = memcpy_movsd;
+variants[variant_count].fill = memset_stosd;
+selected = variant_count;
+variant_count++;
+if (CPU::has_sse2) {
+variants[variant_count].name = "sse2";
+variants[variant_count].copy = memcpy_sse2;
+variants[variant_count].fill = memset_sse2;
+selected = variant_count;
+variant_count++;
+}
+if (CPU::has_erms) {
+variants[variant_count].name = "erms";
+variants[variant_count].copy = memcpy_erms;
+variants[variant_count].fill = memset_erms;
+selected = variant_count;
+variant_count++;
+}
+copy = variants[selected].copy;
+fill = variants[selected].fill;
+length = CPU::has_sse2 ? strlen_sse2 : strlen_words;
+find = CPU::has_sse2 ? memchr_sse2 : memchr_words;
 }
-dest[i] = 0;
+};
+memcpy_fn MemOps::copy = memcpy_bytes;
+memset_fn MemOps::fill = memset_bytes;
+strlen_fn MemOps::length = strlen_bytes;
+memchr_fn MemOps::find = memchr_bytes;
+MemVariant MemOps::variants[4];
+int MemOps::variant_count = 0;
+int MemOps::selected = 0;
+static void memcpy(void* dest, const void* src, uint32_t n) {
+if (n < 16) {
+memcpy_bytes(dest, src, n);
+return;
 }
-static void strncpy(char* dest, const char* src, int n) {
-int i;
-for (i = 0; i < n - 1 && src[i]; i++) dest[i] = src[i];
-dest[i] = 0;
+MemOps::copy(dest, src, n);
 }
-static void strcat(char* dest, const char* src) {
-int i = strlen(dest);
-int j = 0;
-while (src[j]) {
-dest[i] = src[j];
-i++; j++;
+static void memset(void* ptr, uint8_t value, uint32_t n) {
+if (n < 16) {
+memset_bytes(ptr, value, n);
+return;
 }
-dest[i] = 0;
+MemOps::fill(ptr, value, n);
+}
+static void memmove(void* dest, const void* src, uint32_t n) {
+uint8_t* d = (uint8_t*)dest;
+const uint8_t* s = (const uint8_t*)src;
+if (d == s || n == 0) return;
+if (d < s || d >= s + n) {
+memcpy(d, s, n);
+return;
+}
+d += n;
+s += n;
+uint32_t rest = n & 3;
+while (rest--) *--d = *--s;
+uint32_t dwords = n >> 2;
+if (dwords) {
+d -= 4;
+s -= 4;
+asm volatile("std\n\t"
+"rep movsl\n\t"
+"cld"
+: "+D"(d), "+S"(s), "+c"(dwords) : : "memory");
+}
+}
+static const void* memchr(const void* ptr, uint8_t value, uint32_t n) {
+return MemOps::find(ptr, value, n);
+}
+static int strlen(const char* str) {
+return MemOps::length(str);
 }
 static int strcmp(const char* a, const char* b) {
 while (*a && *b && *a == *b) { a++; b++; }
@@ -75,14 +490,30 @@ if (a[i] == 0) return 0;
 }
 return 0;
 }
-static void memset(void* ptr, uint8_t value, uint32_t n) {
-uint8_t* p = (uint8_t*)ptr;
-for (uint32_t i = 0; i < n; i++) p[i] = value;
+static const char* strstr(const char* haystack, const char* needle) {
+if (!needle || !needle[0]) return haystack;
+if (!haystack) return 0;
+int hlen = strlen(haystack);
+int nlen = strlen(needle);
+const char* end = haystack + hlen - nlen;
+while (haystack <= end) {
+haystack = (const char*)memchr(haystack, needle[0], end - haystack + 1);
+if (!haystack) return 0;
+if (strncmp(haystack, needle, nlen) == 0) return haystack;
+haystack++;
 }
-static void memcpy(void* dest, const void* src, uint32_t n) {
-uint8_t* d = (uint8_t*)dest;
-const uint8_t* s = (const uint8_t*)src;
-for (uint32_t i = 0; i < n; i++) d[i] = s[i];
+return 0;
+}
+static void strcpy(char* dest, const char* src) {
+memcpy(dest, src, strlen(src) + 1);
+}
+static void strncpy(char* dest, const char* src, int n) {
+int i;
+for (i = 0; i < n - 1 && src[i]; i++) dest[i] = src[i];
+dest[i] = 0;
+}
+static void strcat(char* dest, const char* src) {
+strcpy(dest + strlen(dest), src);
 }
 static void int_to_str(int num, char* str) {
 if (num == 0) {
@@ -106,2224 +537,8222 @@ str[pos++] = temp[j];
 }
 str[pos] = 0;
 }
-struct FileEntry {
-char name[13];
-uint32_t size;
-uint32_t data_offset;
-bool used;
-bool read_only;
-};
-struct FileSystemHeader {
-uint32_t magic;
-uint32_t version;
-uint32_t next_free_offset;
-uint32_t file_count;
+static void u64_to_str(uint64_t num, char* str) {
+char temp[21];
+int i = 0;
+do {
+temp[i++] = '0' + (char)(num % 10);
+num /= 10;
+} while (num > 0);
+int pos = 0;
+while (i > 0) str[pos++] = temp[--i];
+str[pos] = 0;
+}
+static void fixed_to_str(uint32_t value, int decimals, char* str) {
+uint32_t scale = 1;
+for (int i = 0; i < decimals; i++) scale *= 10;
+u64_to_str(value / scale, str);
+if (decimals == 0) return;
+int pos = strlen(str);
+str[pos++] = '.';
+uint32_t frac = value % scale;
+for (int i = decimals - 1; i >= 0; i--) {
+str[pos + i] = '0' + (frac % 10);
+frac /= 10;
+}
+str[pos + decimals] = 0;
+}
+static void format_ns(uint64_t ns, char* str) {
+if (ns < 1000) {
+u64_to_str(ns, str);
+strcat(str, " ns");
+} else if (ns < 1000000) {
+fixed_to_str((uint32_t)ns, 3, str);
+strcat(str, " us");
+} else if (ns < 1000000000) {
+fixed_to_str((uint32_t)(ns / 1000), 3, str);
+strcat(str, " ms");
+} else {
+fixed_to_str((uint32_t)(ns / 1000000), 3, str);
+strcat(str, " s");
+}
+}
+class CRC32 {
+private:
+static uint32_t table[256];
+public:
+static void init() {
+for (uint32_t i = 0; i < 256; i++) {
+uint32_t c = i;
+for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+table[i] = c;
+}
+}
+
+static uint32_t update(uint32_t crc, const void* data, uint32_t length) {
+const uint8_t* p = (const uint8_t*)data;
+crc = ~crc;
+for (uint32_t i = 0; i < length; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+return ~crc;
+}
 };
-class FileSystem {
+uint32_t CRC32::table[256];
+class Clock {
 private:
-FileEntry files[MAX_FILES];
-uint8_t* fs_buffer;
-uint32_t next_free_offset;
-void load_metadata() {
-FileSystemHeader* header = (FileSystemHeader*)fs_buffer;
-if (header->magic != FS_MAGIC) {
-memset(files, 0, sizeof(files));
-next_free_offset = 0;
+static uint64_t boot_tsc;
+static uint32_t tsc_khz;
+static uint64_t pit_measure(uint16_t count) {
+outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+outb(0x43, 0xB0);
+outb(0x42, count & 0xFF);
+outb(0x42, count >> 8);
+uint8_t gate = inb(0x61) & ~0x01;
+outb(0x61, gate);
+outb(0x61, gate | 0x01);
+uint64_t start = rdtsc();
+while (!(inb(0x61) & 0x20)) {}
+return rdtsc() - start;
+}
+public:
+static void init() {
+if (!CPU::has_tsc) return;
+uint64_t best = 0;
+for (int i = 0; i < 3; i++) {
+uint64_t delta = pit_measure(PIT_HZ / 1000 * CALIBRATE_MS);
+if (best == 0 || delta < best) best = delta;
+}
+tsc_khz = (uint32_t)(best / CALIBRATE_MS);
+boot_tsc = rdtsc();
+}
+static uint32_t get_tsc_khz() { return tsc_khz; }
+static uint64_t cycles() { return CPU::has_tsc ? rdtsc() : 0; }
+static uint64_t cycles_to_ns(uint64_t cycles) {
+if (tsc_khz == 0) return 0;
+uint64_t rem;
+uint64_t ms = __udivmoddi4(cycles, tsc_khz, &rem);
+return ms * 1000000 + rem * 1000000 / tsc_khz;
+}
+static uint64_t now_ns() {
+return cycles_to_ns(cycles() - boot_tsc);
+}
+static void delay_us(uint32_t us) {
+if (tsc_khz == 0) {
+for (uint32_t i = 0; i < us; i++) io_wait();
 return;
 }
-memcpy(files, fs_buffer + sizeof(FileSystemHeader), sizeof(files));
-next_free_offset = header->next_free_offset;
+uint64_t end = rdtsc() + (uint64_t)tsc_khz * us / 1000;
+while (rdtsc() < end) {}
 }
+};
+uint64_t Clock::boot_tsc = 0;
+uint32_t Clock::tsc_khz = 0;
+class LocalAPIC {
+private:
+static volatile uint32_t* base;
+static uint8_t cpu_by_id[256];
+static uint32_t timer_count;
+public:
+static void set_base(uint32_t address) { base = (volatile uint32_t*)address; }
+static bool is_present() { return base != 0; }
+static uint32_t read(uint32_t reg) { return base[reg / 4]; }
+static void write(uint32_t reg, uint32_t value) { base[reg / 4] = value; }
+static uint8_t id() { return base ? read(0x20) >> 24 : 0; }
+static void map_cpu(uint8_t apic_id, int cpu) { cpu_by_id[apic_id] = cpu; }
+static int cpu_index() { return base ? cpu_by_id[id()] : 0; }
 
-void save_metadata() {
-FileSystemHeader header;
-header.magic = FS_MAGIC;
-header.version = 2;
-header.next_free_offset = next_free_offset;
-header.file_count = get_file_count();
-memcpy(fs_buffer, &header, sizeof(FileSystemHeader));
-memcpy(fs_buffer + sizeof(FileSystemHeader), files, sizeof(files));
+static void enable() {
+write(0x80, 0);
+write(0xF0, 0x100 | SPURIOUS_VECTOR);
 }
 
-int find_free_file() {
-for (int i = 0; i < MAX_FILES; i++) {
-if (!files[i].used) return i;
+static void eoi() { write(0xB0, 0); }
+
+static void broadcast_ipi(uint8_t vector) {
+write(0x310, 0);
+write(0x300, 0xC0000 | vector);
+while (read(0x300) & (1 << 12)) {}
 }
-return -1;
+
+static void send_ipi(uint8_t apic_id, uint32_t command) {
+write(0x310, (uint32_t)apic_id << 24);
+write(0x300, command);
+while (read(0x300) & (1 << 12)) {}
 }
 
-int find_file(const char* name) {
-for (int i = 0; i < MAX_FILES; i++) {
-if (files[i].used && strcmp(files[i].name, name) == 0) return i;
+static void calibrate_timer() {
+write(0x3E0, 0x3);
+write(0x320, 0x10000);
+write(0x380, 0xFFFFFFFF);
+Clock::delay_us(10000);
+uint32_t elapsed = 0xFFFFFFFF - read(0x390);
+write(0x380, 0);
+timer_count = elapsed * 100 / LAPIC_TIMER_HZ;
 }
-return -1;
+
+static void start_timer() {
+if (timer_count == 0) return;
+write(0x3E0, 0x3);
+write(0x320, LAPIC_TIMER_VECTOR | 0x20000);
+write(0x380, timer_count);
 }
+
+static uint32_t get_timer_count() { return timer_count; }
+};
+volatile uint32_t* LocalAPIC::base = 0;
+uint8_t LocalAPIC::cpu_by_id[256];
+uint32_t LocalAPIC::timer_count = 0;
+class ScopedTimer {
+private:
+uint64_t start;
+uint64_t& total;
 public:
-FileSystem() : fs_buffer((uint8_t*)FS_START), next_free_offset(0) {
-load_metadata();
-create_default_files();
+ScopedTimer(uint64_t& t) : start(Clock::cycles()), total(t) {}
+~ScopedTimer() { total += Clock::cycles() - start; }
+uint64_t elapsed() { return Clock::cycles() - start; }
+};
+struct ProfileZone {
+const char* name;
+uint32_t calls;
+uint64_t total_cycles;
+uint64_t max_cycles;
+bool registered;
+};
+class Profiler {
+private:
+static ProfileZone* zones[MAX_PROFILE_ZONES];
+static int zone_count;
+public:
+static void add(ProfileZone* zone) {
+if (!__sync_bool_compare_and_swap(&zone->registered, false, true)) return;
+int slot = __sync_fetch_and_add(&zone_count, 1);
+if (slot < MAX_PROFILE_ZONES) zones[slot] = zone;
 }
-void create_default_files() {
-if (find_file("README.TXT") == -1) {
-create_file("README.TXT",
-"EH-DSB v0.01 - Commands\n"
-"==========================\n"
-"help/?       - Show help\n"
-"ls/dir       - List files\n"
-"cat <file>   - View file\n"
-"edit <file>  - Edit file\n"
-"rm <file>    - Delete file\n"
-"mv <old> <new> - Rename\n"
-"time         - Show time\n"
-"clear/cls    - Clear screen\n"
-"about        - info\n"
-"history      - Command history\n"
-"reboot       - Reboot system\n"
-"echo <text>  - Print text\n"
-"mem          - Memory info\n"
-"info         - Information\n"
-"tz <offset>  - Set timezone (-12 to +12)\n", true);
+static void reset() {
+for (int i = 0; i < get_zone_count(); i++) {
+if (!zones[i]) continue;
+zones[i]->calls = 0;
+zones[i]->total_cycles = 0;
+zones[i]->max_cycles = 0;
 }
-if (find_file("HELLO.BF") == -1) {
-create_file("HELLO.BF",
-"++++++++++[>+++++++>++++++++++>+++>+<<<<-]>++.>+.+++++++..+++.>++.<<+++++++++++++++.>.+++.------.--------.>+.>.");
 }
-if (find_file("ECHO.BF") == -1) {
-create_file("ECHO.BF", ",[.,]");
+static int get_zone_count() { return zone_count < MAX_PROFILE_ZONES ? zone_count : MAX_PROFILE_ZONES; }
+static int sorted(ProfileZone** out, int max) {
+int count = 0;
+for (int i = 0; i < get_zone_count(); i++) {
+if (!zones[i]) continue;
+int pos = count;
+while (pos > 0 && out[pos - 1]->total_cycles < zones[i]->total_cycles) {
+if (pos < max) out[pos] = out[pos - 1];
+pos--;
 }
+if (pos < max) out[pos] = zones[i];
+if (count < max) count++;
 }
+return count;
+}
+};
+ProfileZone* Profiler::zones[MAX_PROFILE_ZONES];
+int Profiler::zone_count = 0;
+class ProfileScope {
+private:
+ProfileZone& zone;
+uint64_t start;
+public:
+ProfileScope(ProfileZone& z) : zone(z) {
+if (!zone.registered) Profiler::add(&zone);
+start = Clock::cycles();
+}
+~ProfileScope() {
+uint64_t elapsed = Clock::cycles() - start;
+zone.calls++;
+zone.total_cycles += elapsed;
+if (elapsed > zone.max_cycles) zone.max_cycles = elapsed;
+}
+};
+#define PROFILE_CONCAT2(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT2(a, b)
+#ifdef EHDSB_PROFILE
+#define PROFILE_ZONE(zone_name) \
+static ProfileZone PROFILE_CONCAT(profile_zone_, __LINE__) = {zone_name, 0, 0, 0, false}; \
+ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(PROFILE_CONCAT(profile_zone_, __LINE__))
+#else
+#define PROFILE_ZONE(zone_name)
+#endif
+enum TraceType { TRACE_BEGIN_EVENT, TRACE_END_EVENT, TRACE_INSTANT_EVENT };
+struct TraceEvent {
+uint64_t timestamp;
+const char* name;
+uint8_t type;
+uint8_t cpu;
+uint16_t arg;
+};
+class Trace {
+private:
+static volatile uint32_t heads[MAX_CPUS];
+static uint64_t start_tsc;
+public:
+static volatile bool enabled;
+static int cpu_index() { return LocalAPIC::cpu_index(); }
 
-bool create_file(const char* name, const char* content, bool read_only = false) {
-int idx = find_free_file();
-if (idx == -1) return false;
-
-strncpy(files[idx].name, name, 12);
-files[idx].size = content ? strlen(content) : 0;
-files[idx].used = true;
-files[idx].read_only = read_only;
-files[idx].data_offset = next_free_offset;
+static TraceEvent* ring(int cpu) {
+return (TraceEvent*)TRACE_BUFFER + cpu * TRACE_EVENTS;
+}
 
-if (next_free_offset + files[idx].size > FS_TOTAL_SIZE - FS_METADATA_SIZE) {
-files[idx].used = false;
-return false;
+static void record(const char* name, uint8_t type) {
+if (!enabled) return;
+int cpu = cpu_index();
+uint32_t slot = __sync_fetch_and_add(&heads[cpu], 1) % TRACE_EVENTS;
+TraceEvent* event = ring(cpu) + slot;
+event->timestamp = Clock::cycles();
+event->name = name;
+event->type = type;
+event->cpu = (uint8_t)cpu;
+event->arg = 0;
 }
 
-if (content) {
-memcpy(fs_buffer + FS_METADATA_SIZE + files[idx].data_offset, content, files[idx].size);
+static void start() {
+enabled = false;
+for (int i = 0; i < MAX_CPUS; i++) heads[i] = 0;
+start_tsc = Clock::cycles();
+enabled = true;
 }
 
-next_free_offset += files[idx].size;
-save_metadata();
-return true;
+static void stop() { enabled = false; }
+static uint64_t get_start() { return start_tsc; }
+static uint32_t get_head(int cpu) { return heads[cpu]; }
+};
+volatile uint32_t Trace::heads[MAX_CPUS];
+uint64_t Trace::start_tsc = 0;
+volatile bool Trace::enabled = false;
+class TraceScope {
+private:
+const char* name;
+public:
+TraceScope(const char* n) : name(n) { Trace::record(name, TRACE_BEGIN_EVENT); }
+~TraceScope() { Trace::record(name, TRACE_END_EVENT); }
+};
+#define TRACE_BEGIN(name) Trace::record(name, TRACE_BEGIN_EVENT)
+#define TRACE_END(name) Trace::record(name, TRACE_END_EVENT)
+#define TRACE_INSTANT(name) Trace::record(name, TRACE_INSTANT_EVENT)
+#define TRACE_SCOPE(name) TraceScope PROFILE_CONCAT(trace_scope_, __LINE__)(name)
+struct LockStats {
+const char* name;
+uint32_t acquires;
+uint32_t contended;
+uint64_t spin_cycles;
+uint64_t max_hold;
+bool registered;
+};
+class Locks {
+private:
+static LockStats* locks[MAX_LOCKS];
+static int lock_count;
+public:
+static void add(LockStats* stats) {
+if (!__sync_bool_compare_and_swap(&stats->registered, false, true)) return;
+int slot = __sync_fetch_and_add(&lock_count, 1);
+if (slot < MAX_LOCKS) locks[slot] = stats;
 }
 
-bool save_file(const char* name, const char* content, uint32_t size) {
-int idx = find_file(name);
-if (idx == -1) {
-idx = find_free_file();
-if (idx == -1) return false;
-strncpy(files[idx].name, name, 12);
-files[idx].used = true;
-files[idx].read_only = false;
-files[idx].data_offset = next_free_offset;
-next_free_offset += size;
-} else {
-if (files[idx].read_only) return false;
-files[idx].data_offset = next_free_offset;
-next_free_offset += size;
+static void acquired(LockStats& stats, uint64_t start, uint64_t now, bool contended) {
+if (!stats.registered) add(&stats);
+__sync_fetch_and_add(&stats.acquires, 1);
+if (contended) {
+__sync_fetch_and_add(&stats.contended, 1);
+stats.spin_cycles += now - start;
+}
 }
 
-files[idx].size = size;
+static void released(LockStats& stats, uint64_t held) {
+if (held > stats.max_hold) stats.max_hold = held;
+}
 
-if (files[idx].data_offset + size > FS_TOTAL_SIZE - FS_METADATA_SIZE) return false;
+static void reset() {
+for (int i = 0; i < get_count(); i++) {
+if (!locks[i]) continue;
+locks[i]->acquires = 0;
+locks[i]->contended = 0;
+locks[i]->spin_cycles = 0;
+locks[i]->max_hold = 0;
+}
+}
 
-memcpy(fs_buffer + FS_METADATA_SIZE + files[idx].data_offset, content, size);
-save_metadata();
+static int get_count() { return lock_count < MAX_LOCKS ? lock_count : MAX_LOCKS; }
+static LockStats* get(int index) { return index < get_count() ? locks[index] : 0; }
+};
+LockStats* Locks::locks[MAX_LOCKS];
+int Locks::lock_count = 0;
+class SpinLock {
+private:
+volatile uint32_t next;
+volatile uint32_t serving;
+uint64_t acquired_at;
+LockStats stats;
+public:
+constexpr SpinLock(const char* name) : next(0), serving(0), acquired_at(0), stats{name, 0, 0, 0, 0, false} {}
+
+void lock() {
+uint32_t ticket = __sync_fetch_and_add(&next, 1);
+uint64_t start = Clock::cycles();
+bool contended = serving != ticket;
+while (serving != ticket) asm volatile("pause");
+acquired_at = Clock::cycles();
+Locks::acquired(stats, start, acquired_at, contended);
+}
+
+bool try_lock() {
+uint32_t ticket = serving;
+if (!__sync_bool_compare_and_swap(&next, ticket, ticket + 1)) return false;
+acquired_at = Clock::cycles();
+Locks::acquired(stats, acquired_at, acquired_at, false);
 return true;
 }
 
-bool load_file(const char* name, char* buffer, uint32_t &size) {
-int idx = find_file(name);
-if (idx == -1) return false;
+void unlock() {
+Locks::released(stats, Clock::cycles() - acquired_at);
+__sync_synchronize();
+serving = serving + 1;
+}
 
-size = files[idx].size;
-if (size > MAX_FILE_SIZE) size = MAX_FILE_SIZE;
+bool is_locked() { return next != serving; }
+};
+class IrqSpinLock {
+private:
+SpinLock spin;
+uint32_t saved_flags;
+public:
+constexpr IrqSpinLock(const char* name) : spin(name), saved_flags(0) {}
 
-memcpy(buffer, fs_buffer + FS_METADATA_SIZE + files[idx].data_offset, size);
-if (size < MAX_FILE_SIZE) buffer[size] = 0;
+void lock() {
+uint32_t flags;
+asm volatile("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+spin.lock();
+saved_flags = flags;
+}
 
-return true;
+void unlock() {
+uint32_t flags = saved_flags;
+spin.unlock();
+if (flags & 0x200) asm volatile("sti" : : : "memory");
 }
+};
+class SeqLock {
+private:
+volatile uint32_t sequence;
+SpinLock writer;
+public:
+constexpr SeqLock(const char* name) : sequence(0), writer(name) {}
 
-bool delete_file(const char* name) {
-int idx = find_file(name);
-if (idx == -1) return false;
-if (files[idx].read_only) return false;
+void write_begin() {
+writer.lock();
+sequence = sequence + 1;
+__sync_synchronize();
+}
 
-files[idx].used = false;
-save_metadata();
-return true;
+void write_end() {
+__sync_synchronize();
+sequence = sequence + 1;
+writer.unlock();
 }
 
-bool rename_file(const char* old_name, const char* new_name) {
-int idx = find_file(old_name);
-if (idx == -1) return false;
-if (files[idx].read_only) return false;
-if (find_file(new_name) != -1) return false;
+uint32_t read_begin() {
+uint32_t seq;
+while ((seq = sequence) & 1) asm volatile("pause");
+__sync_synchronize();
+return seq;
+}
 
-memset(files[idx].name, 0, 13);
-strncpy(files[idx].name, new_name, 12);
-save_metadata();
+bool read_retry(uint32_t seq) {
+__sync_synchronize();
+return sequence != seq;
+}
+};
+template <class L>
+class LockGuard {
+private:
+L& lock;
+public:
+LockGuard(L& l) : lock(l) { lock.lock(); }
+~LockGuard() { lock.unlock(); }
+};
+template <class T, uint32_t N>
+class MpscQueue {
+private:
+struct Slot {
+volatile uint32_t sequence;
+T value;
+};
+volatile uint32_t head;
+uint8_t pad0[60];
+volatile uint32_t tail;
+uint8_t pad1[60];
+Slot slots[N];
+public:
+bool push(const T& value) {
+while (true) {
+uint32_t pos = head;
+uint32_t index = pos & (N - 1);
+Slot& slot = slots[index];
+int32_t diff = (int32_t)(slot.sequence + index - pos);
+if (diff == 0) {
+if (__sync_bool_compare_and_swap(&head, pos, pos + 1)) {
+slot.value = value;
+__sync_synchronize();
+slot.sequence = pos + 1 - index;
 return true;
 }
+} else if (diff < 0) {
+return false;
+}
+asm volatile("pause");
+}
+}
 
-bool toggle_readonly(const char* name) {
-int idx = find_file(name);
-if (idx == -1) return false;
-if (strcmp(name, "README.TXT") == 0) return false;
-
-files[idx].read_only = !files[idx].read_only;
-save_metadata();
+bool pop(T& value) {
+uint32_t pos = tail;
+uint32_t index = pos & (N - 1);
+Slot& slot = slots[index];
+if ((int32_t)(slot.sequence + index - (pos + 1)) < 0) return false;
+value = slot.value;
+__sync_synchronize();
+slot.sequence = pos + N - index;
+tail = pos + 1;
 return true;
 }
 
-int get_file_count() {
+int pop_batch(T* out, int max) {
 int count = 0;
-for (int i = 0; i < MAX_FILES; i++) {
-if (files[i].used) count++;
-}
+while (count < max && pop(out[count])) count++;
 return count;
 }
 
-FileEntry* get_file(int index) {
-if (index < 0 || index >= MAX_FILES) return 0;
-int count = 0;
-for (int i = 0; i < MAX_FILES; i++) {
-if (files[i].used) {
-if (count == index) return &files[i];
-count++;
+uint32_t size() { return head - tail; }
+};
+template <class T, uint32_t N>
+class SpscQueue {
+private:
+volatile uint32_t head;
+uint8_t pad0[60];
+volatile uint32_t tail;
+uint8_t pad1[60];
+T slots[N];
+public:
+bool push(const T& value) {
+uint32_t pos = head;
+if (pos - tail >= N) return false;
+slots[pos & (N - 1)] = value;
+asm volatile("" : : : "memory");
+head = pos + 1;
+return true;
+}
+
+bool pop(T& value) {
+uint32_t pos = tail;
+if (pos == head) return false;
+value = slots[pos & (N - 1)];
+asm volatile("" : : : "memory");
+tail = pos + 1;
+return true;
+}
+
+int pop_batch(T* out, int max) {
+int count = 0;
+while (count < max && pop(out[count])) count++;
+return count;
+}
+
+uint32_t size() { return head - tail; }
+};
+struct InterruptFrame {
+uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;
+uint32_t vector, error_code;
+uint32_t eip, cs, eflags;
+};
+struct InterruptContext {
+uint8_t fpu[512];
+InterruptFrame* frame;
+};
+struct IDTEntry {
+uint16_t offset_low;
+uint16_t selector;
+uint8_t zero;
+uint8_t type;
+uint16_t offset_high;
+} __attribute__((packed));
+struct IDTPointer {
+uint16_t limit;
+uint32_t base;
+} __attribute__((packed));
+struct TSS {
+uint32_t prev, esp0, ss0, esp1, ss1, esp2, ss2, cr3;
+uint32_t eip, eflags, eax, ecx, edx, ebx, esp, ebp, esi, edi;
+uint32_t es, cs, ss, ds, fs, gs, ldt;
+uint16_t trap, iomap;
+} __attribute__((packed));
+class GDT {
+private:
+static uint64_t entries[MAX_CPUS][GDT_ENTRIES];
+static TSS tss[MAX_CPUS];
+static uint64_t descriptor(uint32_t base, uint32_t limit, uint8_t access, uint8_t flags) {
+uint64_t value = limit & 0xFFFF;
+value |= (uint64_t)(base & 0xFFFFFF) << 16;
+value |= (uint64_t)access << 40;
+value |= (uint64_t)((limit >> 16) & 0xF) << 48;
+value |= (uint64_t)(flags & 0xF) << 52;
+value |= (uint64_t)(base >> 24) << 56;
+return value;
+}
+public:
+static void init(int cpu, uint32_t stack_top) {
+TSS& task = tss[cpu];
+uint64_t* gdt = entries[cpu];
+memset(&task, 0, sizeof(TSS));
+task.ss0 = 0x10;
+task.esp0 = stack_top;
+task.iomap = sizeof(TSS);
+gdt[0] = 0;
+gdt[1] = descriptor(0, 0xFFFFF, 0x9A, 0xC);
+gdt[2] = descriptor(0, 0xFFFFF, 0x92, 0xC);
+gdt[3] = descriptor((uint32_t)&task, sizeof(TSS) - 1, 0x89, 0x0);
+IDTPointer pointer;
+pointer.limit = sizeof(entries[cpu]) - 1;
+pointer.base = (uint32_t)gdt;
+asm volatile("lgdt %0" : : "m"(pointer));
+asm volatile("mov $0x10, %%ax\n\t"
+"mov %%ax, %%ds\n\t"
+"mov %%ax, %%es\n\t"
+"mov %%ax, %%fs\n\t"
+"mov %%ax, %%gs\n\t"
+"mov %%ax, %%ss" : : : "eax", "memory");
+asm volatile("ltr %%ax" : : "a"((uint16_t)TSS_SELECTOR));
+}
+
+static void set_kernel_stack(uint32_t esp0) { tss[LocalAPIC::cpu_index()].esp0 = esp0; }
+};
+uint64_t GDT::entries[MAX_CPUS][GDT_ENTRIES];
+TSS GDT::tss[MAX_CPUS];
+typedef void (*interrupt_handler)(InterruptFrame*);
+extern "C" {
+uint8_t isr_save_fpu = 0;
+extern uint32_t isr_stub_table[ISR_COUNT];
+InterruptContext* interrupt_dispatch(InterruptContext* context);
+}
+asm(".section .text\n"
+".macro ISR_NOERR n\n"
+"isr_stub_\\n:\n"
+"pushl $0\n"
+"pushl $\\n\n"
+"jmp isr_common\n"
+".endm\n"
+".macro ISR_ERR n\n"
+"isr_stub_\\n:\n"
+"pushl $\\n\n"
+"jmp isr_common\n"
+".endm\n"
+"ISR_NOERR 0\n"
+"ISR_NOERR 1\n"
+"ISR_NOERR 2\n"
+"ISR_NOERR 3\n"
+"ISR_NOERR 4\n"
+"ISR_NOERR 5\n"
+"ISR_NOERR 6\n"
+"ISR_NOERR 7\n"
+"ISR_ERR 8\n"
+"ISR_NOERR 9\n"
+"ISR_ERR 10\n"
+"ISR_ERR 11\n"
+"ISR_ERR 12\n"
+"ISR_ERR 13\n"
+"ISR_ERR 14\n"
+"ISR_NOERR 15\n"
+"ISR_NOERR 16\n"
+"ISR_ERR 17\n"
+"ISR_NOERR 18\n"
+"ISR_NOERR 19\n"
+"ISR_NOERR 20\n"
+"ISR_ERR 21\n"
+"ISR_NOERR 22\n"
+"ISR_NOERR 23\n"
+"ISR_NOERR 24\n"
+"ISR_NOERR 25\n"
+"ISR_NOERR 26\n"
+"ISR_NOERR 27\n"
+"ISR_NOERR 28\n"
+"ISR_ERR 29\n"
+"ISR_ERR 30\n"
+"ISR_NOERR 31\n"
+"ISR_NOERR 32\n"
+"ISR_NOERR 33\n"
+"ISR_NOERR 34\n"
+"ISR_NOERR 35\n"
+"ISR_NOERR 36\n"
+"ISR_NOERR 37\n"
+"ISR_NOERR 38\n"
+"ISR_NOERR 39\n"
+"ISR_NOERR 40\n"
+"ISR_NOERR 41\n"
+"ISR_NOERR 42\n"
+"ISR_NOERR 43\n"
+"ISR_NOERR 44\n"
+"ISR_NOERR 45\n"
+"ISR_NOERR 46\n"
+"ISR_NOERR 47\n"
+"ISR_NOERR 48\n"
+"ISR_NOERR 49\n"
+"ISR_NOERR 50\n"
+"ISR_NOERR 51\n"
+"ISR_NOERR 52\n"
+"ISR_NOERR 53\n"
+"ISR_NOERR 54\n"
+"ISR_NOERR 55\n"
+"ISR_NOERR 56\n"
+"ISR_NOERR 57\n"
+"ISR_NOERR 58\n"
+"ISR_NOERR 59\n"
+"ISR_NOERR 60\n"
+"ISR_NOERR 61\n"
+"ISR_NOERR 62\n"
+"ISR_NOERR 63\n"
+"isr_common:\n"
+"pusha\n"
+"mov %esp, %ebp\n"
+"sub $528, %esp\n"
+"and $-16, %esp\n"
+"mov %ebp, 512(%esp)\n"
+"cmpb $0, isr_save_fpu\n"
+"je 1f\n"
+"fxsave (%esp)\n"
+"1:\n"
+"cld\n"
+"push %esp\n"
+"call interrupt_dispatch\n"
+"mov %eax, %esp\n"
+"cmpb $0, isr_save_fpu\n"
+"je 2f\n"
+"fxrstor (%esp)\n"
+"2:\n"
+"mov 512(%esp), %esp\n"
+"popa\n"
+"add $8, %esp\n"
+"iret\n"
+".section .rodata\n"
+".global isr_stub_table\n"
+".align 4\n"
+"isr_stub_table:\n"
+".long isr_stub_0, isr_stub_1, isr_stub_2, isr_stub_3, isr_stub_4, isr_stub_5, isr_stub_6, isr_stub_7\n"
+".long isr_stub_8, isr_stub_9, isr_stub_10, isr_stub_11, isr_stub_12, isr_stub_13, isr_stub_14, isr_stub_15\n"
+".long isr_stub_16, isr_stub_17, isr_stub_18, isr_stub_19, isr_stub_20, isr_stub_21, isr_stub_22, isr_stub_23\n"
+".long isr_stub_24, isr_stub_25, isr_stub_26, isr_stub_27, isr_stub_28, isr_stub_29, isr_stub_30, isr_stub_31\n"
+".long isr_stub_32, isr_stub_33, isr_stub_34, isr_stub_35, isr_stub_36, isr_stub_37, isr_stub_38, isr_stub_39\n"
+".long isr_stub_40, isr_stub_41, isr_stub_42, isr_stub_43, isr_stub_44, isr_stub_45, isr_stub_46, isr_stub_47\n"
+".long isr_stub_48, isr_stub_49, isr_stub_50, isr_stub_51, isr_stub_52, isr_stub_53, isr_stub_54, isr_stub_55\n"
+".long isr_stub_56, isr_stub_57, isr_stub_58, isr_stub_59, isr_stub_60, isr_stub_61, isr_stub_62, isr_stub_63\n"
+".section .text\n");
+static void hex_to_str(uint32_t value, char* str) {
+static const char digits[] = "0123456789ABCDEF";
+for (int i = 7; i >= 0; i--) {
+str[i] = digits[value & 0xF];
+value >>= 4;
+}
+str[8] = 0;
+}
+static uint32_t parse_hex(const char*& p) {
+uint32_t value = 0;
+while (true) {
+char c = *p;
+if (c >= '0' && c <= '9') value = (value << 4) | (c - '0');
+else if (c >= 'a' && c <= 'f') value = (value << 4) | (c - 'a' + 10);
+else if (c >= 'A' && c <= 'F') value = (value << 4) | (c - 'A' + 10);
+else break;
+p++;
+}
+return value;
+}
+struct ACPIHeader {
+char signature[4];
+uint32_t length;
+uint8_t revision;
+uint8_t checksum;
+char oem_id[6];
+char oem_table_id[8];
+uint32_t oem_revision;
+uint32_t creator_id;
+uint32_t creator_revision;
+} __attribute__((packed));
+class ACPI {
+private:
+static bool checksum(const void* data, uint32_t length) {
+const uint8_t* p = (const uint8_t*)data;
+uint8_t sum = 0;
+for (uint32_t i = 0; i < length; i++) sum += p[i];
+return sum == 0;
 }
+
+static const uint8_t* find_rsdp(uint32_t start, uint32_t length) {
+for (uint32_t address = start; address < start + length; address += 16) {
+const uint8_t* p = (const uint8_t*)address;
+if (strncmp((const char*)p, "RSD PTR ", 8) == 0 && checksum(p, 20)) return p;
 }
 return 0;
 }
 
-uint32_t get_fs_size() {
-uint32_t total = 0;
-for (int i = 0; i < MAX_FILES; i++) {
-if (files[i].used) total += files[i].size;
+static void parse_madt(const ACPIHeader* madt) {
+const uint8_t* p = (const uint8_t*)madt;
+const uint8_t* end = p + madt->length;
+lapic_address = *(const uint32_t*)(p + 36);
+const uint8_t* entry = p + 44;
+while (entry + 2 <= end && entry[1] >= 2) {
+if (entry[0] == 0) {
+if ((*(const uint32_t*)(entry + 4) & 1) && cpu_count < MAX_CPUS) cpu_apic_ids[cpu_count++] = entry[3];
+} else if (entry[0] == 1) {
+if (ioapic_address == 0) {
+ioapic_address = *(const uint32_t*)(entry + 4);
+ioapic_gsi_base = *(const uint32_t*)(entry + 8);
+}
+} else if (entry[0] == 2) {
+if (entry[3] < 16) {
+irq_gsi[entry[3]] = *(const uint32_t*)(entry + 4);
+irq_flags[entry[3]] = *(const uint16_t*)(entry + 8);
+}
+}
+entry += entry[1];
+}
+}
+public:
+static uint32_t lapic_address;
+static uint32_t ioapic_address;
+static uint32_t ioapic_gsi_base;
+static uint8_t cpu_apic_ids[MAX_CPUS];
+static int cpu_count;
+static uint32_t irq_gsi[16];
+static uint16_t irq_flags[16];
+static bool init() {
+for (int i = 0; i < 16; i++) {
+irq_gsi[i] = i;
+irq_flags[i] = 0;
+}
+uint32_t ebda = (uint32_t)*(volatile uint16_t*)0x40E << 4;
+const uint8_t* rsdp = ebda ? find_rsdp(ebda, 1024) : 0;
+if (!rsdp) rsdp = find_rsdp(0xE0000, 0x20000);
+if (!rsdp) return false;
+const ACPIHeader* rsdt = (const ACPIHeader*)*(const uint32_t*)(rsdp + 16);
+if (!rsdt || !checksum(rsdt, rsdt->length)) return false;
+uint32_t count = (rsdt->length - sizeof(ACPIHeader)) / 4;
+const uint32_t* tables = (const uint32_t*)(rsdt + 1);
+for (uint32_t i = 0; i < count; i++) {
+const ACPIHeader* table = (const ACPIHeader*)tables[i];
+if (strncmp(table->signature, "APIC", 4) == 0 && checksum(table, table->length)) {
+parse_madt(table);
+return cpu_count > 0;
+}
+}
+return false;
+}
+};
+uint32_t ACPI::lapic_address = 0;
+uint32_t ACPI::ioapic_address = 0;
+uint32_t ACPI::ioapic_gsi_base = 0;
+uint8_t ACPI::cpu_apic_ids[MAX_CPUS];
+int ACPI::cpu_count = 0;
+uint32_t ACPI::irq_gsi[16];
+uint16_t ACPI::irq_flags[16];
+class IOAPIC {
+private:
+static volatile uint32_t* base;
+static uint32_t redirections;
+static uint32_t read(uint32_t reg) {
+base[0] = reg;
+return base[4];
+}
+static void write(uint32_t reg, uint32_t value) {
+base[0] = reg;
+base[4] = value;
+}
+static uint32_t pin(int irq) { return ACPI::irq_gsi[irq] - ACPI::ioapic_gsi_base; }
+public:
+static void init(uint8_t bsp_apic_id) {
+base = (volatile uint32_t*)ACPI::ioapic_address;
+redirections = ((read(1) >> 16) & 0xFF) + 1;
+for (uint32_t i = 0; i < redirections; i++) {
+write(0x10 + i * 2, 0x10000);
+write(0x11 + i * 2, 0);
+}
+for (int irq = 0; irq < 16; irq++) {
+uint32_t p = pin(irq);
+if (p >= redirections) continue;
+uint32_t low = (IRQ_BASE + irq) | 0x10000;
+if ((ACPI::irq_flags[irq] & 3) == 3) low |= 1 << 13;
+if (((ACPI::irq_flags[irq] >> 2) & 3) == 3) low |= 1 << 15;
+write(0x11 + p * 2, (uint32_t)bsp_apic_id << 24);
+write(0x10 + p * 2, low);
 }
-return total;
 }
 
-uint32_t get_free_space() {
-return FS_TOTAL_SIZE - FS_METADATA_SIZE - get_fs_size();
+static bool is_active() { return base != 0; }
+static uint32_t get_redirections() { return redirections; }
+
+static void set_mask(int irq, bool masked) {
+uint32_t p = pin(irq);
+if (p >= redirections) return;
+uint32_t low = read(0x10 + p * 2);
+write(0x10 + p * 2, masked ? (low | 0x10000) : (low & ~0x10000));
 }
 };
-class RTC {
+volatile uint32_t* IOAPIC::base = 0;
+uint32_t IOAPIC::redirections = 0;
+class Interrupts {
 private:
-static uint8_t bcd_to_bin(uint8_t bcd) {
-return (bcd >> 4) * 10 + (bcd & 0x0F);
+static IDTEntry idt[256];
+static interrupt_handler handlers[ISR_COUNT];
+static InterruptContext* (*switch_hook)(InterruptContext*);
+static void (*panic_hook)(const char*);
+static void remap_pic() {
+outb(0x20, 0x11);
+io_wait();
+outb(0xA0, 0x11);
+io_wait();
+outb(0x21, IRQ_BASE);
+io_wait();
+outb(0xA1, IRQ_BASE + 8);
+io_wait();
+outb(0x21, 0x04);
+io_wait();
+outb(0xA1, 0x02);
+io_wait();
+outb(0x21, 0x01);
+io_wait();
+outb(0xA1, 0x01);
+io_wait();
+outb(0x21, 0xFB);
+outb(0xA1, 0xFF);
+}
+
+static void panic(InterruptFrame* frame) {
+static const char* names[20] = {
+"Divide error", "Debug", "NMI", "Breakpoint", "Overflow", "Bound range",
+"Invalid opcode", "No FPU", "Double fault", "FPU segment", "Invalid TSS",
+"Segment not present", "Stack fault", "General protection", "Page fault",
+"Reserved", "FPU error", "Alignment check", "Machine check", "SIMD error"
+};
+char line[VGA_WIDTH + 1];
+char hex[9];
+strcpy(line, "KERNEL PANIC: ");
+strcat(line, frame->vector < 20 ? names[frame->vector] : "Exception");
+strcat(line, " EIP=");
+hex_to_str(frame->eip, hex);
+strcat(line, hex);
+strcat(line, " ERR=");
+hex_to_str(frame->error_code, hex);
+strcat(line, hex);
+for (int i = 0; i < VGA_WIDTH; i++) {
+char c = i < strlen(line) ? line[i] : ' ';
+vga_buffer[i] = (0x4F << 8) | (uint8_t)c;
+}
+if (panic_hook) panic_hook(line);
+while (true) {
+asm volatile("cli; hlt");
 }
-static uint8_t read_register(uint8_t reg) {
-outb(0x70, reg);
-return inb(0x71);
 }
-static uint32_t timer_ticks;
-static int timezone_offset;
 public:
-static void init() {
-timezone_offset = 3;
+static void load() {
+IDTPointer pointer;
+pointer.limit = sizeof(idt) - 1;
+pointer.base = (uint32_t)idt;
+asm volatile("lidt %0" : : "m"(pointer));
 }
-static void set_timezone(int offset) {
-if (offset >= -12 && offset <= 12) {
-timezone_offset = offset;
+
+static void init() {
+for (int i = 0; i < ISR_COUNT; i++) {
+uint32_t address = isr_stub_table[i];
+idt[i].offset_low = address & 0xFFFF;
+idt[i].selector = 0x08;
+idt[i].zero = 0;
+idt[i].type = 0x8E;
+idt[i].offset_high = address >> 16;
+handlers[i] = 0;
 }
+load();
+remap_pic();
+isr_save_fpu = CPU::has_fxsr ? 1 : 0;
 }
-static int get_timezone() {
-return timezone_offset;
+
+static void set_panic_hook(void (*hook)(const char*)) { panic_hook = hook; }
+
+static void set_handler(int vector, interrupt_handler handler) {
+if (vector >= 0 && vector < ISR_COUNT) handlers[vector] = handler;
 }
-static void get_time(uint8_t& hour, uint8_t& minute, uint8_t& second) {
-uint8_t century_register = 0x32;
-uint8_t century = 0;
-uint8_t registerB;
 
-do {
-hour = read_register(0x04);
-minute = read_register(0x02);
-second = read_register(0x00);
-century = read_register(century_register);
-registerB = read_register(0x0B);
-} while (hour != read_register(0x04) || minute != read_register(0x02) || second != read_register(0x00));
+static void set_switch_hook(InterruptContext* (*hook)(InterruptContext*)) { switch_hook = hook; }
 
-if (!(registerB & 0x04)) {
-hour = bcd_to_bin(hour);
-minute = bcd_to_bin(minute);
-second = bcd_to_bin(second);
+static void unmask_irq(int irq) {
+if (IOAPIC::is_active()) {
+IOAPIC::set_mask(irq, false);
+return;
+}
+uint16_t port = irq < 8 ? 0x21 : 0xA1;
+outb(port, inb(port) & ~(1 << (irq & 7)));
 }
 
-int temp_hour = (int)hour + timezone_offset;
-while (temp_hour >= 24) temp_hour -= 24;
-while (temp_hour < 0) temp_hour += 24;
-hour = (uint8_t)temp_hour;
+static void mask_irq(int irq) {
+if (IOAPIC::is_active()) {
+IOAPIC::set_mask(irq, true);
+return;
+}
+uint16_t port = irq < 8 ? 0x21 : 0xA1;
+outb(port, inb(port) | (1 << (irq & 7)));
+}
 
-if (!(registerB & 0x02)) {
-if (hour >= 12) {
-if (hour != 12) hour -= 12;
-} else {
-if (hour == 12) hour = 0;
+static void enable() { asm volatile("sti"); }
+static void disable() { asm volatile("cli"); }
+
+static uint32_t save() {
+uint32_t flags;
+asm volatile("pushf\n\t"
+"pop %0\n\t"
+"cli" : "=r"(flags) : : "memory");
+return flags;
 }
+
+static void restore(uint32_t flags) {
+if (flags & 0x200) asm volatile("sti" : : : "memory");
 }
 
-if (century) {
-century = bcd_to_bin(century);
+static bool are_enabled() {
+uint32_t flags;
+asm volatile("pushf\n\t"
+"pop %0" : "=r"(flags) : : "memory");
+return flags & 0x200;
 }
+
+static InterruptContext* dispatch(InterruptContext* context) {
+InterruptFrame* frame = context->frame;
+uint32_t vector = frame->vector;
+if (vector < IRQ_BASE) {
+if (handlers[vector]) handlers[vector](frame);
+else panic(frame);
+return context;
 }
-static void tick() {
-timer_ticks++;
+if (vector == YIELD_VECTOR) {
+return switch_hook ? switch_hook(context) : context;
 }
-static bool should_update() {
-static uint32_t last = 0;
-if (timer_ticks - last > 18) {
-last = timer_ticks;
-return true;
+if (vector >= IRQ_BASE + 16) {
+if (vector == SPURIOUS_VECTOR) return context;
+if (handlers[vector]) handlers[vector](frame);
+LocalAPIC::eoi();
+return context;
+}
+uint32_t irq = vector - IRQ_BASE;
+if (!IOAPIC::is_active() && (irq == 7 || irq == 15)) {
+outb(irq == 7 ? 0x20 : 0xA0, 0x0B);
+if (!(inb(irq == 7 ? 0x20 : 0xA0) & 0x80)) {
+if (irq == 15) outb(0x20, 0x20);
+return context;
 }
-return false;
 }
+if (handlers[vector]) {
+static const char* irq_names[16] = {
+"IRQ0 timer", "IRQ1 keyboard", "IRQ2", "IRQ3", "IRQ4 serial", "IRQ5", "IRQ6 floppy", "IRQ7",
+"IRQ8 rtc", "IRQ9", "IRQ10", "IRQ11", "IRQ12 mouse", "IRQ13", "IRQ14 ata", "IRQ15 ata"
 };
-uint32_t RTC::timer_ticks = 0;
-int RTC::timezone_offset = 3;
-class Mouse {
-private:
-static int mouse_x;
-static int mouse_y;
-static bool mouse_left;
-static bool mouse_right;
-static bool mouse_middle;
-static bool mouse_enabled;
-static uint8_t mouse_packet[3];
-static int mouse_byte;
-static int mouse_remainder_x;
-static int mouse_remainder_y;
-static void wait_write() {
-for (int i = 0; i < 100000; i++) {
-if ((inb(0x64) & 2) == 0) return;
-io_wait();
+TRACE_SCOPE(irq_names[irq]);
+handlers[vector](frame);
+}
+if (IOAPIC::is_active()) {
+LocalAPIC::eoi();
+} else {
+if (irq >= 8) outb(0xA0, 0x20);
+outb(0x20, 0x20);
 }
+return switch_hook ? switch_hook(context) : context;
+}
+};
+IDTEntry Interrupts::idt[256];
+interrupt_handler Interrupts::handlers[ISR_COUNT];
+InterruptContext* (*Interrupts::switch_hook)(InterruptContext*) = 0;
+void (*Interrupts::panic_hook)(const char*) = 0;
+extern "C" InterruptContext* interrupt_dispatch(InterruptContext* context) {
+return Interrupts::dispatch(context);
+}
+extern "C" char ap_trampoline_start[];
+extern "C" char ap_trampoline_end[];
+extern "C" char ap_trampoline_stack[];
+extern "C" char ap_trampoline_entry[];
+asm(".text\n"
+".code16\n"
+".global ap_trampoline_start\n"
+"ap_trampoline_start:\n"
+"cli\n"
+"cld\n"
+"xor %ax, %ax\n"
+"mov %ax, %ds\n"
+"lgdtl (ap_trampoline_gdt_pointer - ap_trampoline_start + 0x8000)\n"
+"mov %cr0, %eax\n"
+"or $1, %eax\n"
+"mov %eax, %cr0\n"
+"ljmpl $0x08, $(ap_trampoline_32 - ap_trampoline_start + 0x8000)\n"
+".code32\n"
+"ap_trampoline_32:\n"
+"mov $0x10, %ax\n"
+"mov %ax, %ds\n"
+"mov %ax, %es\n"
+"mov %ax, %fs\n"
+"mov %ax, %gs\n"
+"mov %ax, %ss\n"
+"mov (ap_trampoline_stack - ap_trampoline_start + 0x8000), %esp\n"
+"mov (ap_trampoline_entry - ap_trampoline_start + 0x8000), %eax\n"
+"call *%eax\n"
+"1:\n"
+"cli\n"
+"hlt\n"
+"jmp 1b\n"
+"ap_trampoline_gdt:\n"
+".quad 0\n"
+".quad 0x00CF9A000000FFFF\n"
+".quad 0x00CF92000000FFFF\n"
+"ap_trampoline_gdt_pointer:\n"
+".word 23\n"
+".long ap_trampoline_gdt - ap_trampoline_start + 0x8000\n"
+".global ap_trampoline_stack\n"
+"ap_trampoline_stack:\n"
+".long 0\n"
+".global ap_trampoline_entry\n"
+"ap_trampoline_entry:\n"
+".long 0\n"
+".global ap_trampoline_end\n"
+"ap_trampoline_end:\n");
+extern "C" void ap_main();
+struct CpuInfo {
+uint8_t apic_id;
+volatile bool online;
+volatile uint32_t ticks;
+};
+class Smp {
+private:
+static CpuInfo cpus[MAX_CPUS];
+static int cpu_count;
+static void on_lapic_tick(InterruptFrame*) {
+cpus[LocalAPIC::cpu_index()].ticks++;
 }
 
-static void wait_read() {
-for (int i = 0; i < 100000; i++) {
-if (inb(0x64) & 1) return;
-io_wait();
+static void boot_ap(int cpu) {
+uint8_t* trampoline = (uint8_t*)AP_TRAMPOLINE;
+*(uint32_t*)(trampoline + (ap_trampoline_stack - ap_trampoline_start)) = AP_STACKS + cpu * AP_STACK_SIZE;
+*(uint32_t*)(trampoline + (ap_trampoline_entry - ap_trampoline_start)) = (uint32_t)ap_main;
+uint8_t apic_id = cpus[cpu].apic_id;
+LocalAPIC::send_ipi(apic_id, 0x4500);
+Clock::delay_us(10000);
+for (int i = 0; i < 2 && !cpus[cpu].online; i++) {
+LocalAPIC::send_ipi(apic_id, 0x4600 | (AP_TRAMPOLINE >> 12));
+Clock::delay_us(200);
+}
+for (int i = 0; i < 1000 && !cpus[cpu].online; i++) Clock::delay_us(100);
 }
+public:
+static void init() {
+cpu_count = 1;
+cpus[0].online = true;
+if (!CPU::has_apic || !ACPI::init() || ACPI::lapic_address == 0) return;
+LocalAPIC::set_base(ACPI::lapic_address);
+uint8_t bsp_id = LocalAPIC::id();
+cpus[0].apic_id = bsp_id;
+LocalAPIC::map_cpu(bsp_id, 0);
+for (int i = 0; i < ACPI::cpu_count; i++) {
+uint8_t apic_id = ACPI::cpu_apic_ids[i];
+if (apic_id == bsp_id || cpu_count >= MAX_CPUS) continue;
+cpus[cpu_count].apic_id = apic_id;
+cpus[cpu_count].online = false;
+LocalAPIC::map_cpu(apic_id, cpu_count);
+cpu_count++;
+}
+LocalAPIC::enable();
+if (ACPI::ioapic_address) {
+outb(0x21, 0xFF);
+outb(0xA1, 0xFF);
+IOAPIC::init(bsp_id);
+}
+LocalAPIC::calibrate_timer();
+Interrupts::set_handler(LAPIC_TIMER_VECTOR, on_lapic_tick);
+}
+
+static void start_aps() {
+if (!LocalAPIC::is_present()) return;
+memcpy((void*)AP_TRAMPOLINE, ap_trampoline_start, ap_trampoline_end - ap_trampoline_start);
+for (int cpu = 1; cpu < cpu_count; cpu++) boot_ap(cpu);
+LocalAPIC::start_timer();
+}
+
+static void ap_online(int cpu) { cpus[cpu].online = true; }
+static int get_cpu_count() { return cpu_count; }
+static const CpuInfo& get_cpu(int cpu) { return cpus[cpu]; }
+
+static int get_online_count() {
+int count = 0;
+for (int i = 0; i < cpu_count; i++) {
+if (cpus[i].online) count++;
+}
+return count;
+}
+};
+CpuInfo Smp::cpus[MAX_CPUS];
+int Smp::cpu_count = 1;
+typedef void (*job_fn)(void* arg, uint32_t begin, uint32_t end);
+struct WaitGroup {
+volatile int32_t pending;
+void (*on_done)(WaitGroup*);
+void* owner;
+};
+struct Job {
+job_fn fn;
+void* arg;
+uint32_t begin;
+uint32_t end;
+WaitGroup* group;
+};
+struct JobDeque {
+volatile int32_t top;
+uint8_t pad0[60];
+volatile int32_t bottom;
+uint8_t pad1[60];
+Job* slots[JOB_DEQUE_SIZE];
+Job pool[JOB_POOL_SIZE];
+uint32_t pool_next;
+volatile uint32_t executed;
+volatile uint32_t stolen;
+};
+class Jobs {
+private:
+static volatile int workers;
+static void (*completion_hook)(WaitGroup*);
+static JobDeque* deque(int cpu) { return (JobDeque*)JOB_DEQUES + cpu; }
+
+static bool push(int cpu, const Job& job) {
+JobDeque* q = deque(cpu);
+int32_t b = q->bottom;
+int32_t t = q->top;
+if (b - t >= JOB_DEQUE_SIZE) return false;
+Job* slot = &q->pool[q->pool_next++ % JOB_POOL_SIZE];
+*slot = job;
+q->slots[b % JOB_DEQUE_SIZE] = slot;
+asm volatile("" : : : "memory");
+q->bottom = b + 1;
+return true;
 }
 
-static void write_mouse(uint8_t value) {
-wait_write();
-outb(0x64, 0xD4);
-wait_write();
-outb(0x60, value);
-for (int i = 0; i < 1000; i++) io_wait();
+static bool pop(int cpu, Job& job) {
+JobDeque* q = deque(cpu);
+int32_t b = q->bottom - 1;
+q->bottom = b;
+__sync_synchronize();
+int32_t t = q->top;
+if (t > b) {
+q->bottom = b + 1;
+return false;
+}
+job = *q->slots[b % JOB_DEQUE_SIZE];
+if (t == b) {
+bool won = __sync_bool_compare_and_swap(&q->top, t, t + 1);
+q->bottom = b + 1;
+return won;
+}
+return true;
 }
 
-static uint8_t read_mouse() {
-wait_read();
-uint8_t val = inb(0x60);
-for (int i = 0; i < 100; i++) io_wait();
-return val;
+static bool steal(int victim, Job& job) {
+JobDeque* q = deque(victim);
+int32_t t = q->top;
+asm volatile("" : : : "memory");
+int32_t b = q->bottom;
+if (t >= b) return false;
+job = *q->slots[t % JOB_DEQUE_SIZE];
+return __sync_bool_compare_and_swap(&q->top, t, t + 1);
 }
 
-static bool wait_ack() {
-for (int i = 0; i < 100000; i++) {
-if (inb(0x64) & 1) {
-uint8_t b = inb(0x60);
-if (b == 0xFA) return true;
-if (b == 0xFE) return false;
+static bool take(int cpu, Job& job) {
+if (pop(cpu, job)) return true;
+int count = Smp::get_cpu_count();
+for (int i = 1; i < count; i++) {
+int victim = (cpu + i) % count;
+if (steal(victim, job)) {
+deque(cpu)->stolen++;
+return true;
 }
-io_wait();
 }
 return false;
 }
 
-static void clear_buffer() {
-for (int i = 0; i < 20; i++) {
-if (inb(0x64) & 1) {
-inb(0x60);
+static bool has_work() {
+for (int i = 0; i < Smp::get_cpu_count(); i++) {
+if (deque(i)->bottom > deque(i)->top) return true;
 }
-io_wait();
+return false;
 }
+
+static void run(int cpu, Job& job) {
+job.fn(job.arg, job.begin, job.end);
+deque(cpu)->executed++;
+WaitGroup* group = job.group;
+if (!group) return;
+bool notify = group->on_done != 0;
+if (__sync_sub_and_fetch(&group->pending, 1) == 0 && notify && completion_hook) completion_hook(group);
 }
 public:
 static void init() {
-mouse_x = 40;
-mouse_y = 12;
-mouse_left = false;
-mouse_right = false;
-mouse_middle = false;
-mouse_enabled = false;
-mouse_byte = 0;
-mouse_remainder_x = 0;
-mouse_remainder_y = 0;
-mouse_packet[0] = 0;
-mouse_packet[1] = 0;
-mouse_packet[2] = 0;
-for (int i = 0; i < 10000; i++) io_wait();
-clear_buffer();
-wait_write();
-outb(0x64, 0xA8);
-for (int i = 0; i < 1000; i++) io_wait();
+memset(deque(0), 0, sizeof(JobDeque) * MAX_CPUS);
+workers = Smp::get_cpu_count();
+}
 
-wait_write();
-outb(0x64, 0x20);
-for (int i = 0; i < 1000; i++) io_wait();
-wait_read();
-uint8_t status = inb(0x60);
-for (int i = 0; i < 100; i++) io_wait();
+static void worker_loop(int cpu) {
+while (true) {
+Job job;
+if (cpu < workers && take(cpu, job)) {
+run(cpu, job);
+continue;
+}
+Interrupts::disable();
+if (cpu < workers && has_work()) Interrupts::enable();
+else asm volatile("sti\n\thlt");
+}
+}
 
-status |= 2;
-status &= ~1;
+static void wait(WaitGroup& group) {
+int cpu = LocalAPIC::cpu_index();
+while (group.pending > 0) {
+Job job;
+uint32_t flags = Interrupts::save();
+bool found = take(cpu, job);
+Interrupts::restore(flags);
+if (found) run(cpu, job);
+else asm volatile("pause");
+}
+}
 
-wait_write();
-outb(0x64, 0x60);
-for (int i = 0; i < 1000; i++) io_wait();
-wait_write();
-outb(0x60, status);
-for (int i = 0; i < 1000; i++) io_wait();
+static void submit(uint32_t begin, uint32_t end, uint32_t grain, job_fn fn, void* arg, WaitGroup& group) {
+if (grain == 0) grain = 1;
+int cpu = LocalAPIC::cpu_index();
+if (end > begin) __sync_fetch_and_add(&group.pending, (end - begin + grain - 1) / grain);
+for (uint32_t i = begin; i < end; i += grain) {
+Job job;
+job.fn = fn;
+job.arg = arg;
+job.begin = i;
+job.end = end - i > grain ? i + grain : end;
+job.group = &group;
+uint32_t flags = Interrupts::save();
+bool queued = push(cpu, job);
+Interrupts::restore(flags);
+if (!queued) run(cpu, job);
+}
+if (workers > 1) LocalAPIC::broadcast_ipi(WAKE_VECTOR);
+}
 
-clear_buffer();
+static void parallel_for(uint32_t begin, uint32_t end, uint32_t grain, job_fn fn, void* arg) {
+WaitGroup group;
+group.pending = 0;
+group.on_done = 0;
+submit(begin, end, grain, fn, arg, group);
+wait(group);
+}
 
-write_mouse(0xFF);
-for (int i = 0; i < 50000; i++) io_wait();
-clear_buffer();
-if (inb(0x64) & 1) inb(0x60);
-if (inb(0x64) & 1) inb(0x60);
+static void set_completion_hook(void (*hook)(WaitGroup*)) { completion_hook = hook; }
 
-write_mouse(0xF6);
-if (!wait_ack()) {
-clear_buffer();
-return;
+static void set_workers(int count) {
+int cpus = Smp::get_online_count();
+workers = count < 1 ? 1 : (count > cpus ? cpus : count);
 }
-if (inb(0x64) & 1) inb(0x60);
 
-write_mouse(0xF4);
-if (!wait_ack()) {
-clear_buffer();
-return;
+static int get_workers() { return workers; }
+static uint32_t get_executed(int cpu) { return deque(cpu)->executed; }
+static uint32_t get_stolen(int cpu) { return deque(cpu)->stolen; }
+};
+volatile int Jobs::workers = 1;
+void (*Jobs::completion_hook)(WaitGroup*) = 0;
+extern "C" void ap_main() {
+int cpu = LocalAPIC::cpu_index();
+GDT::init(cpu, AP_STACKS + cpu * AP_STACK_SIZE);
+Interrupts::load();
+CPU::init_ap();
+LocalAPIC::enable();
+LocalAPIC::start_timer();
+Smp::ap_online(cpu);
+Interrupts::enable();
+Jobs::worker_loop(cpu);
+}
+extern "C" char __text_start[];
+extern "C" char __text_end[];
+extern "C" char _binary_ksyms_txt_start[];
+extern "C" char _binary_ksyms_txt_end[];
+class Symbols {
+private:
+static uint32_t addresses[MAX_SYMBOLS];
+static const char* names[MAX_SYMBOLS];
+static int count;
+public:
+static void init() {
+const char* p = _binary_ksyms_txt_start;
+const char* end = _binary_ksyms_txt_end;
+count = 0;
+while (p < end && count < MAX_SYMBOLS) {
+uint32_t address = parse_hex(p);
+if (*p == ' ') p++;
+addresses[count] = address;
+names[count] = p;
+count++;
+while (p < end && *p != '\n') p++;
+p++;
+}
 }
 
-clear_buffer();
-for (int i = 0; i < 10000; i++) io_wait();
+static int get_count() { return count; }
 
-mouse_enabled = true;
+static int find(uint32_t address) {
+int lo = 0;
+int hi = count - 1;
+int found = -1;
+while (lo <= hi) {
+int mid = (lo + hi) / 2;
+if (addresses[mid] <= address) {
+found = mid;
+lo = mid + 1;
+} else {
+hi = mid - 1;
+}
+}
+return found;
 }
 
-static void handle_packet() {
-if (!mouse_enabled) return;
-
-uint8_t buttons = mouse_packet[0];
+static void get_name(int index, char* out, int max) {
+int i = 0;
+if (index >= 0 && index < count) {
+const char* p = names[index];
+while (i < max - 1 && p[i] && p[i] != '\n') {
+out[i] = p[i];
+i++;
+}
+}
+out[i] = 0;
+}
+};
+uint32_t Symbols::addresses[MAX_SYMBOLS];
+const char* Symbols::names[MAX_SYMBOLS];
+int Symbols::count = 0;
+class Sampler {
+private:
+static uint32_t* const buckets;
+static uint32_t total;
+static uint32_t outside;
+public:
+static void init() {
+memset(buckets, 0, SAMPLE_BUCKETS * sizeof(uint32_t));
+}
 
-if ((buttons & 0x08) == 0) {
-mouse_byte = 0;
+static void record(uint32_t eip) {
+total++;
+uint32_t bucket = (eip - (uint32_t)__text_start) >> SAMPLE_SHIFT;
+if (eip < (uint32_t)__text_start || bucket >= SAMPLE_BUCKETS) {
+outside++;
 return;
 }
+buckets[bucket]++;
+}
 
-int8_t dx = (int8_t)mouse_packet[1];
-int8_t dy = (int8_t)mouse_packet[2];
-
-if (buttons & 0x10) dx = (int8_t)(dx | 0xC0);
-if (buttons & 0x20) dy = (int8_t)(dy | 0xC0);
+static void reset() {
+Interrupts::disable();
+memset(buckets, 0, SAMPLE_BUCKETS * sizeof(uint32_t));
+total = 0;
+outside = 0;
+Interrupts::enable();
+}
 
-mouse_remainder_x += dx;
-mouse_remainder_y += dy;
-
-int move_x = mouse_remainder_x / 4;
-int move_y = mouse_remainder_y / 4;
-
-mouse_remainder_x %= 4;
-mouse_remainder_y %= 4;
+static uint32_t get_total() { return total; }
+static uint32_t get_outside() { return outside; }
+static uint32_t get_bucket(int index) { return buckets[index]; }
+static uint32_t bucket_address(int index) { return (uint32_t)__text_start + ((uint32_t)index << SAMPLE_SHIFT); }
+};
+uint32_t* const Sampler::buckets = (uint32_t*)SAMPLE_BUFFER;
+uint32_t Sampler::total = 0;
+uint32_t Sampler::outside = 0;
+enum ThreadState { THREAD_FREE, THREAD_READY, THREAD_RUNNING, THREAD_SLEEPING, THREAD_BLOCKED, THREAD_DEAD };
+enum ThreadPriority { PRIO_IDLE, PRIO_NORMAL, PRIO_UI };
+struct Thread {
+const char* name;
+uint8_t state;
+uint8_t priority;
+int next;
+InterruptContext* context;
+void (*entry)(void*);
+void* arg;
+uint32_t stack_top;
+uint32_t wake_ms;
+uint32_t ticks_left;
+uint32_t switches;
+uint64_t cycles;
+};
+struct WaitQueue {
+int head;
+int tail;
+};
+class Scheduler {
+private:
+static Thread threads[MAX_THREADS];
+static volatile int current;
+static volatile bool need_resched;
+static volatile uint32_t now_ms;
+static uint32_t quantum;
+static uint64_t slice_start;
+static void idle(void*) {
+while (true) asm volatile("sti\n\thlt");
+}
+
+static void start() {
+Thread& thread = threads[current];
+thread.entry(thread.arg);
+exit();
+}
+
+static void make_ready(int id) {
+threads[id].state = THREAD_READY;
+if (threads[id].priority > threads[current].priority) need_resched = true;
+}
+
+static int pick() {
+int best = -1;
+for (int n = 1; n <= MAX_THREADS; n++) {
+int i = (current + n) % MAX_THREADS;
+Thread& thread = threads[i];
+bool eligible = thread.state == THREAD_READY || (i == current && thread.state == THREAD_RUNNING);
+if (!eligible) continue;
+if (best < 0 || thread.priority > threads[best].priority) best = i;
+}
+return best;
+}
+
+static InterruptContext* schedule(InterruptContext* context) {
+if (!need_resched) return context;
+need_resched = false;
+int next = pick();
+Thread& prev = threads[current];
+if (next == current) {
+prev.ticks_left = quantum;
+return context;
+}
+uint64_t now = Clock::cycles();
+prev.cycles += now - slice_start;
+prev.context = context;
+if (prev.state == THREAD_RUNNING) prev.state = THREAD_READY;
+current = next;
+Thread& thread = threads[next];
+thread.state = THREAD_RUNNING;
+thread.ticks_left = quantum;
+thread.switches++;
+slice_start = now;
+GDT::set_kernel_stack(thread.stack_top);
+return thread.context;
+}
+
+static void reschedule() {
+need_resched = true;
+asm volatile("int %0" : : "i"(YIELD_VECTOR) : "memory");
+}
+public:
+static void init() {
+memset(threads, 0, sizeof(threads));
+quantum = SCHED_QUANTUM_MS * TIMER_HZ / 1000;
+Thread& ui = threads[0];
+ui.name = "ui";
+ui.state = THREAD_RUNNING;
+ui.priority = PRIO_UI;
+ui.next = -1;
+ui.stack_top = 0x90000;
+ui.ticks_left = quantum;
+ui.switches = 1;
+current = 0;
+slice_start = Clock::cycles();
+spawn("idle", idle, 0, PRIO_IDLE);
+Interrupts::set_switch_hook(schedule);
+}
+
+static int spawn(const char* name, void (*entry)(void*), void* arg, uint8_t priority) {
+uint32_t flags = Interrupts::save();
+for (int i = 1; i < MAX_THREADS; i++) {
+Thread& thread = threads[i];
+if (thread.state != THREAD_FREE && thread.state != THREAD_DEAD) continue;
+uint32_t top = THREAD_STACKS + i * THREAD_STACK_SIZE;
+InterruptFrame* frame = (InterruptFrame*)(top - sizeof(InterruptFrame));
+memset(frame, 0, sizeof(InterruptFrame));
+frame->eip = (uint32_t)start;
+frame->cs = 0x08;
+frame->eflags = 0x202;
+InterruptContext* context = (InterruptContext*)(((uint32_t)frame - sizeof(InterruptContext)) & ~15);
+memset(context->fpu, 0, sizeof(context->fpu));
+*(uint16_t*)&context->fpu[0] = 0x37F;
+*(uint32_t*)&context->fpu[24] = 0x1F80;
+context->frame = frame;
+thread.name = name;
+thread.priority = priority;
+thread.next = -1;
+thread.context = context;
+thread.entry = entry;
+thread.arg = arg;
+thread.stack_top = top;
+thread.switches = 0;
+thread.cycles = 0;
+make_ready(i);
+Interrupts::restore(flags);
+return i;
+}
+Interrupts::restore(flags);
+return -1;
+}
 
-mouse_x += move_x;
-mouse_y -= move_y;
+static void tick(uint32_t ms) {
+now_ms = ms;
+for (int i = 0; i < MAX_THREADS; i++) {
+if (threads[i].state == THREAD_SLEEPING && (int32_t)(ms - threads[i].wake_ms) >= 0) make_ready(i);
+}
+Thread& thread = threads[current];
+if (thread.ticks_left > 0) thread.ticks_left--;
+if (thread.ticks_left == 0) need_resched = true;
+}
 
-if (mouse_x < 0) mouse_x = 0;
-if (mouse_x > 79) mouse_x = 79;
-if (mouse_y < 0) mouse_y = 0;
-if (mouse_y > 24) mouse_y = 24;
+static void yield() {
+uint32_t flags = Interrupts::save();
+reschedule();
+Interrupts::restore(flags);
+}
 
-mouse_left = (buttons & 1) != 0;
-mouse_right = (buttons & 2) != 0;
-mouse_middle = (buttons & 4) != 0;
+static void sleep(uint32_t ms) {
+uint32_t flags = Interrupts::save();
+threads[current].wake_ms = now_ms + ms;
+threads[current].state = THREAD_SLEEPING;
+reschedule();
+Interrupts::restore(flags);
 }
 
-static void update() {
-if (!mouse_enabled) return;
+static void exit() {
+Interrupts::disable();
+threads[current].state = THREAD_DEAD;
+reschedule();
+while (true) asm volatile("hlt");
+}
 
-while (inb(0x64) & 0x20) {
-uint8_t byte = read_mouse();
+static void wait(WaitQueue& queue) {
+Thread& thread = threads[current];
+thread.state = THREAD_BLOCKED;
+thread.next = -1;
+if (queue.tail >= 0) threads[queue.tail].next = current;
+else queue.head = current;
+queue.tail = current;
+reschedule();
+}
 
-if (mouse_byte == 0) {
-if ((byte & 0x08) == 0 || (byte & 0xC0) != 0) {
-continue;
+static void wake_all(WaitQueue& queue) {
+uint32_t flags = Interrupts::save();
+int id = queue.head;
+queue.head = -1;
+queue.tail = -1;
+while (id >= 0) {
+int next = threads[id].next;
+threads[id].next = -1;
+make_ready(id);
+id = next;
 }
+Interrupts::restore(flags);
 }
 
-mouse_packet[mouse_byte] = byte;
-mouse_byte++;
-
-if (mouse_byte >= 3) {
-mouse_byte = 0;
-handle_packet();
+static void wake_one(WaitQueue& queue) {
+uint32_t flags = Interrupts::save();
+int id = queue.head;
+if (id >= 0) {
+queue.head = threads[id].next;
+if (queue.head < 0) queue.tail = -1;
+threads[id].next = -1;
+make_ready(id);
 }
+Interrupts::restore(flags);
 }
+
+static void set_quantum(uint32_t ms) {
+quantum = ms * TIMER_HZ / 1000;
+if (quantum == 0) quantum = 1;
 }
 
-static int get_x() { return mouse_x; }
-static int get_y() { return mouse_y; }
-static bool is_left_clicked() { return mouse_left; }
-static bool is_right_clicked() { return mouse_right; }
-static bool is_middle_clicked() { return mouse_middle; }
-static bool is_enabled() { return mouse_enabled; }
+static uint32_t get_quantum_ms() { return quantum * 1000 / TIMER_HZ; }
+static int self() { return current; }
 
-static void reset_clicks() {
-mouse_left = false;
-mouse_right = false;
-mouse_middle = false;
+static Thread get_thread(int id) {
+uint32_t flags = Interrupts::save();
+Thread thread = threads[id];
+if (id == current) thread.cycles += Clock::cycles() - slice_start;
+Interrupts::restore(flags);
+return thread;
 }
 };
-int Mouse::mouse_x = 40;
-int Mouse::mouse_y = 12;
-bool Mouse::mouse_left = false;
-bool Mouse::mouse_right = false;
-bool Mouse::mouse_middle = false;
-bool Mouse::mouse_enabled = false;
-uint8_t Mouse::mouse_packet[3] = {0, 0, 0};
-int Mouse::mouse_byte = 0;
-int Mouse::mouse_remainder_x = 0;
-int Mouse::mouse_remainder_y = 0;
-class Keyboard {
+Thread Scheduler::threads[MAX_THREADS];
+volatile int Scheduler::current = 0;
+volatile bool Scheduler::need_resched = false;
+volatile uint32_t Scheduler::now_ms = 0;
+uint32_t Scheduler::quantum = SCHED_QUANTUM_MS * TIMER_HZ / 1000;
+uint64_t Scheduler::slice_start = 0;
+class Mutex {
 private:
-static bool left_shift, right_shift, caps_lock;
+volatile uint32_t held;
+volatile uint32_t waiting;
+WaitQueue waiters;
+uint64_t acquired_at;
+LockStats stats;
 public:
-static bool is_key_pressed() {
-uint8_t status = inb(0x64);
-return (status & 0x01) && !(status & 0x20);
+constexpr Mutex(const char* name) : held(0), waiting(0), waiters{-1, -1}, acquired_at(0), stats{name, 0, 0, 0, 0, false} {}
+
+void lock() {
+uint64_t start = Clock::cycles();
+bool contended = false;
+while (!__sync_bool_compare_and_swap(&held, 0, 1)) {
+contended = true;
+if (!Interrupts::are_enabled() || LocalAPIC::cpu_index() != 0) {
+asm volatile("pause");
+continue;
 }
-static uint8_t get_scancode() {
-return inb(0x60);
+uint32_t flags = Interrupts::save();
+__sync_fetch_and_add(&waiting, 1);
+if (held) Scheduler::wait(waiters);
+__sync_fetch_and_sub(&waiting, 1);
+Interrupts::restore(flags);
+}
+acquired_at = Clock::cycles();
+Locks::acquired(stats, start, acquired_at, contended);
 }
-static char get_char() {
-uint8_t sc = get_scancode();
-if (sc == 0x2A) { left_shift = true; return 0; }
-if (sc == 0xAA) { left_shift = false; return 0; }
-if (sc == 0x36) { right_shift = true; return 0; }
-if (sc == 0xB6) { right_shift = false; return 0; }
-if (sc == 0x3A) { caps_lock = !caps_lock; return 0; }
-if (sc & 0x80) return 0;
-
-bool is_shifted = (left_shift || right_shift) ^ caps_lock;
 
-static const char normal[58] = {
-0, 0,
-'1','2','3','4','5','6','7','8','9','0','-','=',
-'\b','\t','q','w','e','r','t','y','u','i','o','p','[',']','\n',
-0, 'a','s','d','f','g','h','j','k','l',';','\'','`',
-0, '\\','z','x','c','v','b','n','m',',','.','/',
-0, '*', 0, ' '
-};
-static const char shifted[58] = {
-0, 0,
-'!','@','#','$','%','^','&','*','(',')','_','+',
-'\b','\t','Q','W','E','R','T','Y','U','I','O','P','{','}','\n',
-0, 'A','S','D','F','G','H','J','K','L',':','"','~',
-0, '|','Z','X','C','V','B','N','M','<','>','?',
-0, '*', 0, ' '
+void unlock() {
+Locks::released(stats, Clock::cycles() - acquired_at);
+__sync_synchronize();
+held = 0;
+__sync_synchronize();
+if (waiting) Scheduler::wake_one(waiters);
+}
 };
-
-if (sc == 0x3B) return (char)0xF1;
-if (sc == 0x3C) return (char)0xF2;
-if (sc == 0x3D) return (char)0xF3;
-if (sc == 0x3E) return (char)0xF4;
-if (sc == 0x3F) return (char)0xF5;
-if (sc == 0x40) return (char)0xF6;
-if (sc == 0x41) return (char)0xF7;
-if (sc == 0x42) return (char)0xF8;
-if (sc == 0x43) return (char)0xF9;
-if (sc == 0x44) return (char)0xFA;
-if (sc == 0x48) return (char)0x10;
-if (sc == 0x50) return (char)0x11;
-
-if (sc < 58) {
-if (is_shifted && shifted[sc]) return shifted[sc];
-return normal[sc];
+class RWLock {
+private:
+volatile int32_t state;
+volatile uint32_t writers_waiting;
+volatile uint32_t local_holders;
+volatile uint32_t local_writers;
+volatile uint32_t sleepers;
+WaitQueue waiters;
+uint64_t write_start;
+LockStats stats;
+static bool is_local() { return LocalAPIC::cpu_index() == 0; }
+
+bool blocked(bool writer) {
+if (writer) return state != 0;
+return state < 0 || writers_waiting != 0;
+}
+
+void wait(bool writer) {
+if (!is_local() || !Interrupts::are_enabled()) {
+asm volatile("pause");
+return;
 }
-return 0;
+uint32_t flags = Interrupts::save();
+bool owner_here = local_holders > 0 || (!writer && state >= 0 && local_writers > 0);
+if (blocked(writer) && owner_here) {
+sleepers++;
+Scheduler::wait(waiters);
+sleepers--;
+Interrupts::restore(flags);
+return;
+}
+Interrupts::restore(flags);
+asm volatile("pause");
 }
 
-static void flush() {
-while (is_key_pressed()) get_scancode();
+void released() {
+if (!is_local()) return;
+local_holders--;
+if (sleepers) Scheduler::wake_all(waiters);
+}
+public:
+constexpr RWLock(const char* name) : state(0), writers_waiting(0), local_holders(0), local_writers(0), sleepers(0), waiters{-1, -1}, write_start(0), stats{name, 0, 0, 0, 0, false} {}
+
+uint64_t read_lock() {
+uint64_t start = Clock::cycles();
+bool contended = false;
+for (;;) {
+uint32_t flags = Interrupts::save();
+int32_t current = state;
+bool acquired = current >= 0 && writers_waiting == 0 && __sync_bool_compare_and_swap(&state, current, current + 1);
+if (acquired && is_local()) local_holders++;
+Interrupts::restore(flags);
+if (acquired) break;
+contended = true;
+wait(false);
+}
+uint64_t now = Clock::cycles();
+Locks::acquired(stats, start, now, contended);
+return now;
+}
+
+void read_unlock(uint64_t acquired_at) {
+Locks::released(stats, Clock::cycles() - acquired_at);
+uint32_t flags = Interrupts::save();
+__sync_fetch_and_sub(&state, 1);
+released();
+Interrupts::restore(flags);
+}
+
+void write_lock() {
+uint64_t start = Clock::cycles();
+bool contended = false;
+uint32_t flags = Interrupts::save();
+__sync_fetch_and_add(&writers_waiting, 1);
+if (is_local()) local_writers++;
+Interrupts::restore(flags);
+for (;;) {
+flags = Interrupts::save();
+bool acquired = __sync_bool_compare_and_swap(&state, 0, -1);
+if (acquired) {
+__sync_fetch_and_sub(&writers_waiting, 1);
+if (is_local()) {
+local_writers--;
+local_holders++;
+}
+}
+Interrupts::restore(flags);
+if (acquired) break;
+contended = true;
+wait(true);
+}
+write_start = Clock::cycles();
+Locks::acquired(stats, start, write_start, contended);
+}
+
+void write_unlock() {
+Locks::released(stats, Clock::cycles() - write_start);
+uint32_t flags = Interrupts::save();
+__sync_synchronize();
+state = 0;
+released();
+Interrupts::restore(flags);
 }
 };
-bool Keyboard::left_shift = false;
-bool Keyboard::right_shift = false;
-bool Keyboard::caps_lock = false;
-class VGATerminal {
+class ReadGuard {
 private:
-uint8_t color;
-int cursor_x, cursor_y;
-int mouse_x, mouse_y;
-bool mouse_visible;
-uint16_t mouse_orig_val;
-int last_mouse_x, last_mouse_y;
-bool mouse_orig_valid;
-void clear_mouse_cursor() {
-if (!mouse_visible || !mouse_orig_valid) return;
-if (last_mouse_x >= 0 && last_mouse_x < VGA_WIDTH &&
-last_mouse_y >= 0 && last_mouse_y < VGA_HEIGHT) {
-vga_buffer[last_mouse_y * VGA_WIDTH + last_mouse_x] = mouse_orig_val;
+RWLock& lock;
+uint64_t acquired_at;
+public:
+ReadGuard(RWLock& l) : lock(l), acquired_at(l.read_lock()) {}
+~ReadGuard() { lock.read_unlock(acquired_at); }
+};
+class WriteGuard {
+private:
+RWLock& lock;
+public:
+WriteGuard(RWLock& l) : lock(l) { lock.write_lock(); }
+~WriteGuard() { lock.write_unlock(); }
+};
+enum TimerMode { TIMER_IRQ, TIMER_UI };
+typedef void (*timer_fn)(void*);
+struct TimerCallback {
+TimerCallback* next;
+TimerCallback* prev;
+uint32_t expires;
+uint32_t period;
+timer_fn fn;
+void* arg;
+uint8_t mode;
+volatile bool pending;
+volatile bool queued;
+};
+enum EventType { EVENT_NONE, EVENT_KEY, EVENT_MOUSE, EVENT_TIMER, EVENT_PAINT, EVENT_JOB };
+struct Event {
+uint8_t type;
+char key;
+uint8_t buttons;
+uint8_t pressed;
+int16_t x;
+int16_t y;
+uint32_t ms;
+void* data;
+bool clicked(int rx, int ry, int w, int h) const {
+return type == EVENT_MOUSE && (pressed & 1) && x >= rx && x < rx + w && y >= ry && y < ry + h;
 }
-mouse_orig_valid = false;
+};
+class LoopLatency {
+private:
+static uint32_t buckets[LATENCY_BUCKETS];
+static uint64_t max_us;
+public:
+static void record(uint64_t cycles) {
+uint64_t us = Clock::cycles_to_ns(cycles) / 1000;
+if (us > max_us) max_us = us;
+int bucket = 0;
+while (bucket < LATENCY_BUCKETS - 1 && us >= (2ULL << bucket)) bucket++;
+buckets[bucket]++;
 }
 
-void save_mouse_char() {
-if (!mouse_visible || mouse_x < 0 || mouse_x >= VGA_WIDTH ||
-mouse_y < 0 || mouse_y >= VGA_HEIGHT) return;
+static uint32_t get(int bucket) { return buckets[bucket]; }
+static uint64_t get_max() { return max_us; }
 
-int idx = mouse_y * VGA_WIDTH + mouse_x;
-mouse_orig_val = vga_buffer[idx];
-mouse_orig_valid = true;
+static void reset() {
+memset(buckets, 0, sizeof(buckets));
+max_us = 0;
+}
+};
+uint32_t LoopLatency::buckets[LATENCY_BUCKETS];
+uint64_t LoopLatency::max_us = 0;
+class EventQueue {
+private:
+static MpscQueue<Event, EVENT_QUEUE_SIZE> queue;
+static SpscQueue<Event, INPUT_QUEUE_SIZE> input;
+static volatile uint32_t dropped;
+static WaitQueue waiters;
+static timer_fn mouse_hook;
+static void* mouse_arg;
+static void deliver(const Event& event) {
+if (event.type == EVENT_TIMER) {
+TimerCallback* timer = (TimerCallback*)event.data;
+timer->queued = false;
+if (timer->fn) timer->fn(timer->arg);
+} else if (event.type == EVENT_JOB) {
+WaitGroup* group = (WaitGroup*)event.data;
+if (group->on_done) group->on_done(group);
+} else if (event.type == EVENT_MOUSE && mouse_hook) {
+mouse_hook(mouse_arg);
+}
+}
+
+static void on_wake(InterruptFrame*) {
+if (LocalAPIC::cpu_index() == 0) Scheduler::wake_all(waiters);
+}
+
+static void notify() {
+if (LocalAPIC::cpu_index() != 0) {
+LocalAPIC::send_ipi(Smp::get_cpu(0).apic_id, 0x4000 | WAKE_VECTOR);
+return;
+}
+uint32_t flags = Interrupts::save();
+Scheduler::wake_all(waiters);
+Interrupts::restore(flags);
+}
+public:
+static void init() {
+Interrupts::set_handler(WAKE_VECTOR, on_wake);
+}
 
-last_mouse_x = mouse_x;
-last_mouse_y = mouse_y;
+static bool push(const Event& event) {
+if (!queue.push(event)) {
+__sync_fetch_and_add(&dropped, 1);
+return false;
+}
+notify();
+return true;
 }
 
-void draw_mouse_cursor() {
-if (!mouse_visible) return;
-if (mouse_x < 0 || mouse_x >= VGA_WIDTH ||
-mouse_y < 0 || mouse_y >= VGA_HEIGHT) return;
+static bool push_input(const Event& event) {
+if (!input.push(event)) {
+__sync_fetch_and_add(&dropped, 1);
+return false;
+}
+Scheduler::wake_all(waiters);
+return true;
+}
 
-int idx = mouse_y * VGA_WIDTH + mouse_x;
-vga_buffer[idx] = (0x0F << 8) | 0xDB;
+static void set_mouse_hook(timer_fn fn, void* arg) {
+mouse_hook = fn;
+mouse_arg = arg;
 }
 
-void update_mouse_position() {
-if (!Mouse::is_enabled()) return;
+static bool pop(Event& event) {
+if (!input.pop(event) && !queue.pop(event)) return false;
+deliver(event);
+return true;
+}
 
-int new_x = Mouse::get_x();
-int new_y = Mouse::get_y();
+static int pop_batch(Event* out, int max) {
+int count = input.pop_batch(out, max);
+count += queue.pop_batch(out + count, max - count);
+for (int i = 0; i < count; i++) deliver(out[i]);
+return count;
+}
 
-if (new_x != mouse_x || new_y != mouse_y) {
-clear_mouse_cursor();
-mouse_x = new_x;
-mouse_y = new_y;
-save_mouse_char();
-draw_mouse_cursor();
+static void wait(Event& event) {
+while (true) {
+uint32_t flags = Interrupts::save();
+if (get_pending() == 0) Scheduler::wait(waiters);
+Interrupts::restore(flags);
+if (pop(event)) return;
 }
 }
 
-void scroll() {
-clear_mouse_cursor();
-for (int y = 0; y < VGA_HEIGHT - 1; y++) {
-for (int x = 0; x < VGA_WIDTH; x++) {
-vga_buffer[y * VGA_WIDTH + x] = vga_buffer[(y + 1) * VGA_WIDTH + x];
-}
+static char wait_key() {
+Event event;
+while (true) {
+wait(event);
+if (event.type == EVENT_KEY) return event.key;
 }
-for (int x = 0; x < VGA_WIDTH; x++) {
-vga_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = (color << 8) | ' ';
 }
-if (cursor_y > 0) cursor_y--;
-mouse_orig_valid = false;
-save_mouse_char();
-draw_mouse_cursor();
+
+static void post(uint8_t type) {
+Event event;
+memset(&event, 0, sizeof(event));
+event.type = type;
+push(event);
 }
-public:
-VGATerminal() : color(0x07), cursor_x(0), cursor_y(0),
-mouse_x(40), mouse_y(12), mouse_visible(true),
-mouse_orig_val(0), last_mouse_x(-1), last_mouse_y(-1),
-mouse_orig_valid(false) {}
-void set_color(uint8_t fg, uint8_t bg) {
-color = (bg << 4) | fg;
+
+static bool post_timer(TimerCallback* timer, uint32_t ms) {
+Event event;
+memset(&event, 0, sizeof(event));
+event.type = EVENT_TIMER;
+event.ms = ms;
+event.data = timer;
+return push(event);
 }
 
-void set_mouse_visible(bool v) {
-mouse_visible = v;
+static void post_job(WaitGroup* group) {
+Event event;
+memset(&event, 0, sizeof(event));
+event.type = EVENT_JOB;
+event.data = group;
+push(event);
 }
 
-void clear() {
-clear_mouse_cursor();
-for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
-vga_buffer[i] = (color << 8) | ' ';
+static void clear() {
+Event event;
+while (input.pop(event) || queue.pop(event)) {
+if (event.type == EVENT_TIMER) ((TimerCallback*)event.data)->queued = false;
+if (event.type == EVENT_JOB) deliver(event);
 }
-cursor_x = cursor_y = 0;
-mouse_orig_valid = false;
-last_mouse_x = -1;
-last_mouse_y = -1;
-save_mouse_char();
-draw_mouse_cursor();
 }
 
-void clear_area(int x, int y, int w, int h) {
-clear_mouse_cursor();
-for (int row = y; row < y + h && row < VGA_HEIGHT; row++) {
-for (int col = x; col < x + w && col < VGA_WIDTH; col++) {
-vga_buffer[row * VGA_WIDTH + col] = (color << 8) | ' ';
+static uint32_t get_pending() { return input.size() + queue.size(); }
+static uint32_t get_dropped() { return dropped; }
+};
+MpscQueue<Event, EVENT_QUEUE_SIZE> EventQueue::queue;
+SpscQueue<Event, INPUT_QUEUE_SIZE> EventQueue::input;
+volatile uint32_t EventQueue::dropped = 0;
+WaitQueue EventQueue::waiters = {-1, -1};
+timer_fn EventQueue::mouse_hook = 0;
+void* EventQueue::mouse_arg = 0;
+class TimerWheel {
+private:
+static TimerCallback* wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint32_t current;
+static IrqSpinLock lock;
+static void insert(TimerCallback& timer) {
+uint32_t delta = timer.expires - current;
+if (delta >= (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+delta = (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+timer.expires = current + delta;
+}
+int level = 0;
+while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1u << (TIMER_WHEEL_BITS * (level + 1)))) level++;
+TimerCallback** slot = &wheel[level][(timer.expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+timer.prev = 0;
+timer.next = *slot;
+if (*slot) (*slot)->prev = &timer;
+*slot = &timer;
+timer.pending = true;
+}
+
+static void unlink(TimerCallback& timer) {
+if (timer.prev) {
+timer.prev->next = timer.next;
+} else {
+for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+TimerCallback** slot = &wheel[level][(timer.expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+if (*slot == &timer) {
+*slot = timer.next;
+break;
 }
 }
-mouse_orig_valid = false;
-save_mouse_char();
-draw_mouse_cursor();
+}
+if (timer.next) timer.next->prev = timer.prev;
+timer.next = timer.prev = 0;
+timer.pending = false;
 }
 
-void putchar(char c) {
-clear_mouse_cursor();
-if (c == '\n') {
-cursor_x = 0;
-cursor_y++;
-if (cursor_y >= VGA_HEIGHT) scroll();
-} else if (c == '\r') {
-cursor_x = 0;
-} else if (c == '\t') {
-cursor_x = (cursor_x + 8) & ~7;
-} else if (c == '\b') {
-if (cursor_x > 0) {
-cursor_x--;
-vga_buffer[cursor_y * VGA_WIDTH + cursor_x] = (color << 8) | ' ';
+static void cascade(int level) {
+TimerCallback** slot = &wheel[level][(current >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1)];
+TimerCallback* timer = *slot;
+*slot = 0;
+while (timer) {
+TimerCallback* next = timer->next;
+insert(*timer);
+timer = next;
 }
-} else if (c >= 32 && c <= 126) {
-if (cursor_x >= VGA_WIDTH) {
-cursor_x = 0;
-cursor_y++;
-if (cursor_y >= VGA_HEIGHT) scroll();
 }
-if (cursor_y < VGA_HEIGHT) {
-vga_buffer[cursor_y * VGA_WIDTH + cursor_x] = (color << 8) | c;
-cursor_x++;
+
+static void fire(TimerCallback& timer, uint32_t now) {
+if (timer.mode == TIMER_IRQ) {
+timer.fn(timer.arg);
+} else if (!timer.queued) {
+timer.queued = true;
+if (!EventQueue::post_timer(&timer, now)) timer.queued = false;
 }
 }
-mouse_orig_valid = false;
-save_mouse_char();
-draw_mouse_cursor();
+public:
+static void setup(TimerCallback& timer, timer_fn fn, void* arg, uint8_t mode) {
+memset(&timer, 0, sizeof(timer));
+timer.fn = fn;
+timer.arg = arg;
+timer.mode = mode;
 }
 
-void write(const char* str) {
-for (int i = 0; str[i]; i++) {
-putchar(str[i]);
+static void start(TimerCallback& timer, uint32_t delay_ms, uint32_t period_ms = 0) {
+LockGuard<IrqSpinLock> guard(lock);
+if (timer.pending) unlink(timer);
+timer.expires = current + (delay_ms ? delay_ms : 1);
+timer.period = period_ms;
+insert(timer);
 }
+
+static void cancel(TimerCallback& timer) {
+LockGuard<IrqSpinLock> guard(lock);
+if (timer.pending) unlink(timer);
+timer.period = 0;
 }
 
-void write_at(int x, int y, const char* str, uint8_t text_color) {
-if (x < 0 || x >= VGA_WIDTH || y < 0 || y >= VGA_HEIGHT) return;
-clear_mouse_cursor();
-uint8_t old_color = color;
-color = text_color;
-int pos = 0;
-while (str[pos] && x + pos < VGA_WIDTH) {
-vga_buffer[y * VGA_WIDTH + x + pos] = (color << 8) | str[pos];
-pos++;
+static void advance(uint32_t now) {
+lock.lock();
+while (current != now) {
+current++;
+for (int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+if ((current & ((1u << (TIMER_WHEEL_BITS * level)) - 1)) != 0) break;
+cascade(level);
 }
-color = old_color;
-mouse_orig_valid = false;
-save_mouse_char();
-draw_mouse_cursor();
+TimerCallback** slot = &wheel[0][current & (TIMER_WHEEL_SLOTS - 1)];
+while (*slot) {
+TimerCallback* timer = *slot;
+unlink(*timer);
+if (timer->period) {
+timer->expires = current + timer->period;
+insert(*timer);
 }
-
-void draw_box(int x, int y, int w, int h, uint8_t box_color) {
-if (w < 2 || h < 2) return;
-char buf[2] = {0, 0};
-clear_mouse_cursor();
-buf[0] = 0xC9; write_at(x, y, buf, box_color);
-buf[0] = 0xBB; write_at(x + w - 1, y, buf, box_color);
-buf[0] = 0xC8; write_at(x, y + h - 1, buf, box_color);
-buf[0] = 0xBC; write_at(x + w - 1, y + h - 1, buf, box_color);
-
-for (int i = x + 1; i < x + w - 1; i++) {
-buf[0] = 0xCD; write_at(i, y, buf, box_color);
-write_at(i, y + h - 1, buf, box_color);
+lock.unlock();
+fire(*timer, current);
+lock.lock();
 }
-for (int i = y + 1; i < y + h - 1; i++) {
-buf[0] = 0xBA; write_at(x, i, buf, box_color);
-write_at(x + w - 1, i, buf, box_color);
 }
-save_mouse_char();
-draw_mouse_cursor();
+lock.unlock();
 }
 
-void fill_rect(int x, int y, int w, int h, uint8_t rect_color, char fill_char) {
-clear_mouse_cursor();
-uint8_t old_color = color;
-color = rect_color;
-for (int row = y; row < y + h && row < VGA_HEIGHT; row++) {
-for (int col = x; col < x + w && col < VGA_WIDTH; col++) {
-vga_buffer[row * VGA_WIDTH + col] = (color << 8) | fill_char;
+static int get_pending() {
+LockGuard<IrqSpinLock> guard(lock);
+int count = 0;
+for (int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+for (TimerCallback* timer = wheel[level][i]; timer; timer = timer->next) count++;
 }
 }
-color = old_color;
-mouse_orig_valid = false;
-save_mouse_char();
-draw_mouse_cursor();
+return count;
+}
+};
+TimerCallback* TimerWheel::wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+uint32_t TimerWheel::current = 0;
+IrqSpinLock TimerWheel::lock("timer wheel");
+class Timeout {
+private:
+TimerCallback timer;
+volatile bool fired;
+static void on_expire(void* arg) { *(volatile bool*)arg = true; }
+public:
+Timeout(uint32_t ms) : fired(false) {
+TimerWheel::setup(timer, on_expire, (void*)&fired, TIMER_IRQ);
+TimerWheel::start(timer, ms);
+}
+~Timeout() { TimerWheel::cancel(timer); }
+bool expired() { return fired; }
+};
+class Timer {
+private:
+static volatile uint32_t ticks;
+static void on_tick(InterruptFrame* frame) {
+ticks++;
+Sampler::record(frame->eip);
+Scheduler::tick(get_ms());
+TimerWheel::advance(get_ms());
+}
+public:
+static void init() {
+uint32_t divisor = PIT_HZ / TIMER_HZ;
+outb(0x43, 0x36);
+outb(0x40, divisor & 0xFF);
+outb(0x40, divisor >> 8);
+Interrupts::set_handler(IRQ_BASE + 0, on_tick);
+Interrupts::unmask_irq(0);
 }
 
-void set_cursor(int x, int y) {
-if (x >= 0 && x < VGA_WIDTH) cursor_x = x;
-if (y >= 0 && y < VGA_HEIGHT) cursor_y = y;
+static uint32_t get_ticks() { return ticks; }
+static uint32_t get_ms() { return ticks * (1000 / TIMER_HZ); }
+};
+volatile uint32_t Timer::ticks = 0;
+class Serial {
+private:
+static uint8_t tx_buffer[SERIAL_TX_SIZE];
+static volatile uint32_t tx_head;
+static volatile uint32_t tx_tail;
+static uint32_t dropped;
+static bool present;
+static IrqSpinLock tx_lock;
+static void fill_fifo() {
+if (inb(COM1_PORT + 5) & 0x20) {
+for (int room = 16; room > 0 && tx_tail != tx_head; room--) {
+outb(COM1_PORT, tx_buffer[tx_tail % SERIAL_TX_SIZE]);
+tx_tail++;
+}
+}
+outb(COM1_PORT + 1, tx_tail == tx_head ? 0x00 : 0x02);
 }
 
-int get_cursor_x() { return cursor_x; }
-int get_cursor_y() { return cursor_y; }
+static void wait_room() {
+if (Interrupts::are_enabled()) {
+asm volatile("hlt");
+return;
+}
+{
+LockGuard<IrqSpinLock> guard(tx_lock);
+fill_fifo();
+}
+asm volatile("pause");
+}
 
-void save_state(int &x, int &y, uint8_t &c) {
-x = cursor_x;
-y = cursor_y;
-c = color;
+static void on_irq(InterruptFrame*) {
+uint8_t iir = inb(COM1_PORT + 2);
+if ((iir & 0x01) == 0 || (inb(COM1_PORT + 5) & 0x20)) {
+LockGuard<IrqSpinLock> guard(tx_lock);
+fill_fifo();
+}
+}
+public:
+static void init() {
+outb(COM1_PORT + 1, 0x00);
+outb(COM1_PORT + 3, 0x80);
+outb(COM1_PORT + 0, 0x01);
+outb(COM1_PORT + 1, 0x00);
+outb(COM1_PORT + 3, 0x03);
+outb(COM1_PORT + 2, 0xC7);
+outb(COM1_PORT + 4, 0x1E);
+outb(COM1_PORT + 0, 0xAE);
+present = inb(COM1_PORT + 0) == 0xAE;
+outb(COM1_PORT + 4, 0x0B);
+if (!present) return;
+Interrupts::set_handler(IRQ_BASE + 4, on_irq);
+Interrupts::set_panic_hook(write_polled);
+Interrupts::unmask_irq(4);
+}
+
+static bool is_present() { return present; }
+static uint32_t get_dropped() { return dropped; }
+
+static void putchar(char c) {
+if (!present) return;
+if (c == '\n') putchar('\r');
+LockGuard<IrqSpinLock> guard(tx_lock);
+if (tx_head - tx_tail >= SERIAL_TX_SIZE) {
+dropped++;
+} else {
+tx_buffer[tx_head % SERIAL_TX_SIZE] = (uint8_t)c;
+tx_head++;
+fill_fifo();
+}
 }
 
-void restore_state(int x, int y, uint8_t c) {
-clear_mouse_cursor();
-cursor_x = x;
-cursor_y = y;
-color = c;
-mouse_orig_valid = false;
-save_mouse_char();
-draw_mouse_cursor();
+static void write(const char* str) {
+while (*str) putchar(*str++);
 }
 
-void update_mouse() {
-update_mouse_position();
+static void write_wait(const char* str) {
+for (; *str && present; str++) {
+while (tx_head - tx_tail >= SERIAL_TX_SIZE - 1) wait_room();
+putchar(*str);
+}
 }
 
-bool is_mouse_over(int x, int y, int w, int h) {
-int mx = Mouse::get_x();
-int my = Mouse::get_y();
-return (mx >= x && mx < x + w && my >= y && my < y + h);
+static void write_polled(const char* str) {
+if (!present) return;
+for (; *str; str++) {
+if (*str == '\n') {
+while (!(inb(COM1_PORT + 5) & 0x20)) {}
+outb(COM1_PORT, '\r');
+}
+while (!(inb(COM1_PORT + 5) & 0x20)) {}
+outb(COM1_PORT, *str);
+}
 }
 
-bool is_mouse_clicked(int x, int y, int w, int h) {
-bool clicked = is_mouse_over(x, y, w, h) && Mouse::is_left_clicked();
-if (clicked) Mouse::reset_clicks();
-return clicked;
+static void flush() {
+while (present && tx_tail != tx_head) wait_room();
 }
 };
-class SystemMonitor {
+uint8_t Serial::tx_buffer[SERIAL_TX_SIZE];
+volatile uint32_t Serial::tx_head = 0;
+volatile uint32_t Serial::tx_tail = 0;
+uint32_t Serial::dropped = 0;
+bool Serial::present = false;
+IrqSpinLock Serial::tx_lock("serial");
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+class Log {
 private:
-VGATerminal& term;
-FileSystem& fs;
-bool active;
-uint32_t last_update;
-void draw_ui() {
-term.set_color(0x0F, 0x01);
-term.fill_rect(0, 0, 80, 25, 0x01, ' ');
-
-term.draw_box(1, 1, 78, 3, 0x3F);
-term.write_at(30, 2, "SYSTEM MONITOR  ", 0x3F);
-term.write_at(60, 2, "F10:Exit  ", 0x3F);
-
-term.draw_box(1, 5, 38, 8, 0x2F);
-term.write_at(15, 6, "File System  ", 0x2F);
-
-char buffer[32];
-int_to_str(fs.get_file_count(), buffer);
-term.write_at(3, 8, "Files:  ", 0x0F);
-term.write_at(15, 8, buffer, 0x0F);
-
-int_to_str(fs.get_fs_size(), buffer);
-term.write_at(3, 9, "Used:  ", 0x0F);
-term.write_at(15, 9, buffer, 0x0F);
-term.write_at(25, 9, "bytes  ", 0x0F);
-
-int_to_str(fs.get_free_space(), buffer);
-term.write_at(3, 10, "Free:  ", 0x0F);
-term.write_at(15, 10, buffer, 0x0F);
-term.write_at(25, 10, "bytes  ", 0x0F);
-
-term.draw_box(41, 5, 38, 8, 0x2F);
-term.write_at(55, 6, "Memory  ", 0x2F);
-
-term.write_at(43, 8, "Kernel:  ", 0x0F);
-term.write_at(60, 8, "64 KB  ", 0x0F);
-term.write_at(43, 9, "Stack:  ", 0x0F);
-term.write_at(60, 9, "32 KB  ", 0x0F);
-term.write_at(43, 10, "Heap:  ", 0x0F);
-term.write_at(60, 10, "128 KB  ", 0x0F);
-term.write_at(43, 11, "FS:  ", 0x0F);
-term.write_at(60, 11, "128 KB  ", 0x0F);
-
-term.draw_box(1, 14, 78, 8, 0x2F);
-term.write_at(35, 15, "System Status  ", 0x2F);
+static int min_level;
+static void append(char* out, int& pos, int max, const char* str) {
+while (*str && pos < max - 1) out[pos++] = *str++;
+}
+public:
+static void set_level(int level) { min_level = level; }
+static int get_level() { return min_level; }
 
-uint8_t hour, minute, second;
-RTC::get_time(hour, minute, second);
-char time_str[9];
-time_str[0] = '0' + (hour / 10);
-time_str[1] = '0' + (hour % 10);
-time_str[2] = ':';
-time_str[3] = '0' + (minute / 10);
-time_str[4] = '0' + (minute % 10);
-time_str[5] = ':';
-time_str[6] = '0' + (second / 10);
-time_str[7] = '0' + (second % 10);
-time_str[8] = 0;
+static void format(char* out, int max, const char* fmt, __builtin_va_list args) {
+int pos = 0;
+char num[24];
+for (; *fmt && pos < max - 1; fmt++) {
+if (*fmt != '%') {
+out[pos++] = *fmt;
+continue;
+}
+fmt++;
+bool wide = false;
+if (fmt[0] == 'l' && fmt[1] == 'l') {
+wide = true;
+fmt += 2;
+}
+switch (*fmt) {
+case 'd':
+if (wide) {
+int64_t value = __builtin_va_arg(args, int64_t);
+if (value < 0) append(out, pos, max, "-");
+u64_to_str(value < 0 ? 0 - (uint64_t)value : (uint64_t)value, num);
+} else {
+int_to_str(__builtin_va_arg(args, int), num);
+}
+append(out, pos, max, num);
+break;
+case 'u':
+if (wide) u64_to_str(__builtin_va_arg(args, uint64_t), num);
+else u64_to_str(__builtin_va_arg(args, uint32_t), num);
+append(out, pos, max, num);
+break;
+case 'x':
+if (wide) {
+uint64_t value = __builtin_va_arg(args, uint64_t);
+hex_to_str((uint32_t)(value >> 32), num);
+hex_to_str((uint32_t)value, num + 8);
+} else {
+hex_to_str(__builtin_va_arg(args, uint32_t), num);
+}
+append(out, pos, max, num);
+break;
+case 's': {
+const char* str = __builtin_va_arg(args, const char*);
+append(out, pos, max, str ? str : "(null)");
+break;
+}
+case 'c':
+out[pos++] = (char)__builtin_va_arg(args, int);
+break;
+case '%':
+out[pos++] = '%';
+break;
+default:
+if (!*fmt) fmt--;
+break;
+}
+}
+out[pos] = 0;
+}
+
+static void write(int level, const char* fmt, __builtin_va_list args) {
+static const char* names[4] = {"DEBUG", "INFO", "WARN", "ERROR"};
+if (level < min_level) return;
+char line[160];
+char stamp[24];
+uint64_t us = Clock::now_ns() / 1000;
+u64_to_str(us / 1000000, stamp);
+Serial::write("[");
+Serial::write(stamp);
+uint32_t frac = (uint32_t)(us % 1000000);
+for (int i = 6; i >= 1; i--) {
+stamp[i] = '0' + (frac % 10);
+frac /= 10;
+}
+stamp[0] = '.';
+stamp[7] = 0;
+Serial::write(stamp);
+Serial::write("] ");
+Serial::write(names[level]);
+Serial::write(": ");
+format(line, sizeof(line), fmt, args);
+Serial::write(line);
+Serial::write("\n");
+}
+};
+int Log::min_level = LOG_INFO;
+static void klog(int level, const char* fmt, ...) {
+__builtin_va_list args;
+__builtin_va_start(args, fmt);
+Log::write(level, fmt, args);
+__builtin_va_end(args);
+}
+class PCI {
+public:
+static uint32_t read(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset) {
+outl(0xCF8, 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC));
+return inl(0xCFC);
+}
 
-term.write_at(3, 17, "Current Time:  ", 0x0F);
-term.write_at(25, 17, time_str, 0x0A);
-term.write_at(3, 18, "System:  ", 0x0F);
-term.write_at(25, 18, "EH-DSB v0.01  ", 0x0A);
+static void write(uint8_t bus, uint8_t slot, uint8_t func, uint8_t offset, uint32_t value) {
+outl(0xCF8, 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)slot << 11) | ((uint32_t)func << 8) | (offset & 0xFC));
+outl(0xCFC, value);
+}
 
-term.fill_rect(2, 23, 3, 1, 0x4F, ' ');
-term.write_at(2, 23, "[X] ", 0x0F);
+static bool find_class(uint8_t class_code, uint8_t subclass, uint8_t& bus, uint8_t& slot, uint8_t& func) {
+for (int b = 0; b < 256; b++) {
+for (int s = 0; s < 32; s++) {
+for (int f = 0; f < 8; f++) {
+uint32_t id = read(b, s, f, 0x00);
+if ((id & 0xFFFF) == 0xFFFF) {
+if (f == 0) break;
+continue;
 }
-public:
-SystemMonitor(VGATerminal& t, FileSystem& f) : term(t), fs(f), active(false), last_update(0) {}
-void open() {
-active = true;
-term.set_color(0x0F, 0x01);
-term.clear();
-draw_ui();
+uint32_t class_reg = read(b, s, f, 0x08);
+if ((class_reg >> 24) == class_code && ((class_reg >> 16) & 0xFF) == subclass) {
+bus = b;
+slot = s;
+func = f;
+return true;
+}
+if (f == 0 && !(read(b, s, f, 0x0C) & 0x00800000)) break;
+}
+}
+}
+return false;
+}
+};
+enum DiskOp { DISK_READ, DISK_WRITE, DISK_FLUSH };
+enum DiskStatus { DISK_QUEUED, DISK_ACTIVE, DISK_DONE, DISK_ERROR };
+struct DiskRequest {
+uint8_t op;
+volatile uint8_t status;
+uint32_t lba;
+uint32_t count;
+uint32_t done;
+uint8_t* buffer;
+DiskRequest* next;
+};
+struct PRDEntry {
+uint32_t address;
+uint16_t bytes;
+uint16_t flags;
+};
+class ATA {
+private:
+static bool present;
+static char model[41];
+static uint32_t sectors;
+static uint8_t multiple;
+static uint64_t read_bytes;
+static uint64_t read_cycles;
+static uint64_t write_bytes;
+static uint64_t write_cycles;
+static uint32_t errors;
+static SpinLock lock;
+static uint16_t bus_master;
+static volatile bool dma_enabled;
+static DiskRequest* volatile active;
+static DiskRequest* queue_tail;
+static uint32_t chunk;
+static uint32_t dma_requests;
+static IrqSpinLock queue_lock;
+static WaitQueue waiters;
+static bool wait_ready() {
+Timeout timeout(ATA_TIMEOUT_MS);
+while (!timeout.expired()) {
+uint8_t status = inb(ATA_PRIMARY + 7);
+if (!(status & 0x80)) return true;
+}
+return false;
 }
 
-void close() { active = false; }
-bool is_active() { return active; }
+static bool wait_drq() {
+Timeout timeout(ATA_TIMEOUT_MS);
+while (!timeout.expired()) {
+uint8_t status = inb(ATA_PRIMARY + 7);
+if (status & 0x80) continue;
+if (status & 0x21) return false;
+if (status & 0x08) return true;
+}
+return false;
+}
 
-void handle_input(char c) {
-if (!active) return;
-if (c == (char)0xFA) {
-close();
+static void select(uint32_t lba, uint8_t count) {
+outb(ATA_PRIMARY + 6, 0xE0 | ((lba >> 24) & 0x0F));
+outb(ATA_PRIMARY + 2, count);
+outb(ATA_PRIMARY + 3, lba & 0xFF);
+outb(ATA_PRIMARY + 4, (lba >> 8) & 0xFF);
+outb(ATA_PRIMARY + 5, (lba >> 16) & 0xFF);
+}
+
+static bool transfer(uint32_t lba, uint32_t count, uint8_t* buffer, bool write) {
+while (count > 0) {
+uint32_t chunk = count > 256 ? 256 : count;
+if (!wait_ready()) return false;
+select(lba, (uint8_t)chunk);
+if (multiple > 1) outb(ATA_PRIMARY + 7, write ? 0xC5 : 0xC4);
+else outb(ATA_PRIMARY + 7, write ? 0x30 : 0x20);
+uint32_t block = multiple > 1 ? multiple : 1;
+for (uint32_t done = 0; done < chunk; done += block) {
+uint32_t n = chunk - done < block ? chunk - done : block;
+if (!wait_drq()) return false;
+if (write) outsw(ATA_PRIMARY, buffer, n * 256);
+else insw(ATA_PRIMARY, buffer, n * 256);
+buffer += n * 512;
+}
+lba += chunk;
+count -= chunk;
+}
+if (write) {
+if (!wait_ready()) return false;
+outb(ATA_PRIMARY + 7, 0xE7);
+if (!wait_ready()) return false;
+}
+return !(inb(ATA_PRIMARY + 7) & 0x21);
+}
+
+static void start(DiskRequest* request) {
+request->status = DISK_ACTIVE;
+if (inb(ATA_PRIMARY + 7) & 0x80) {
+request->status = DISK_ERROR;
+return;
+}
+if (request->op == DISK_FLUSH) {
+outb(ATA_PRIMARY + 6, 0xE0);
+outb(ATA_PRIMARY + 7, 0xE7);
 return;
 }
+uint32_t left = request->count - request->done;
+chunk = left > ATA_DMA_MAX_SECTORS ? ATA_DMA_MAX_SECTORS : left;
+PRDEntry* prd = (PRDEntry*)ATA_PRD_TABLE;
+uint32_t address = (uint32_t)(request->buffer + request->done * 512);
+uint32_t bytes = chunk * 512;
+int entries = 0;
+while (bytes > 0) {
+uint32_t room = 0x10000 - (address & 0xFFFF);
+uint32_t size = bytes < room ? bytes : room;
+prd[entries].address = address;
+prd[entries].bytes = (uint16_t)size;
+prd[entries].flags = 0;
+address += size;
+bytes -= size;
+entries++;
+}
+prd[entries - 1].flags = 0x8000;
+uint8_t direction = request->op == DISK_READ ? 0x08 : 0x00;
+outb(bus_master, direction);
+outl(bus_master + 4, ATA_PRD_TABLE);
+outb(bus_master + 2, inb(bus_master + 2) | 0x06);
+select(request->lba + request->done, (uint8_t)chunk);
+outb(ATA_PRIMARY + 7, request->op == DISK_READ ? 0xC8 : 0xCA);
+outb(bus_master, direction | 0x01);
+}
+
+static void advance() {
+while (active) {
+start(active);
+if (active->status != DISK_ERROR) return;
+active = active->next;
+}
+queue_tail = 0;
+}
+
+static void on_irq(InterruptFrame*) {
+uint8_t bm_status = inb(bus_master + 2);
+uint8_t status = inb(ATA_PRIMARY + 7);
+LockGuard<IrqSpinLock> guard(queue_lock);
+DiskRequest* request = active;
+if (!request) return;
+if (request->op != DISK_FLUSH) {
+if (!(bm_status & 0x04)) return;
+outb(bus_master, 0);
+outb(bus_master + 2, bm_status | 0x06);
+}
+if ((bm_status & 0x02) || (status & 0x21)) {
+request->status = DISK_ERROR;
+} else if (request->op != DISK_FLUSH && request->done + chunk < request->count) {
+request->done += chunk;
+start(request);
+if (request->status != DISK_ERROR) return;
+} else {
+request->done = request->count;
+request->status = DISK_DONE;
+}
+active = request->next;
+advance();
+Scheduler::wake_all(waiters);
+}
+
+static void init_dma() {
+uint8_t bus, slot, func;
+if (!PCI::find_class(0x01, 0x01, bus, slot, func)) return;
+uint32_t bar4 = PCI::read(bus, slot, func, 0x20);
+if (!(bar4 & 0x01) || (bar4 & 0xFFFC) == 0) return;
+bus_master = bar4 & 0xFFFC;
+PCI::write(bus, slot, func, 0x04, PCI::read(bus, slot, func, 0x04) | 0x05);
+outb(bus_master, 0);
+outb(bus_master + 2, 0x06);
+Interrupts::set_handler(IRQ_BASE + 14, on_irq);
+Interrupts::unmask_irq(14);
+outb(ATA_CONTROL, 0x00);
+dma_enabled = true;
+}
+
+static bool pio(uint8_t op, uint32_t lba, uint32_t count, uint8_t* buffer) {
+LockGuard<SpinLock> guard(lock);
+return transfer(lba, count, buffer, op != DISK_READ);
+}
+
+static bool io(uint8_t op, uint32_t lba, uint32_t count, uint8_t* buffer) {
+if (!dma_enabled) return pio(op, lba, count, buffer);
+DiskRequest request;
+request.op = op;
+request.lba = lba;
+request.count = count;
+request.buffer = buffer;
+if (!submit(request)) return pio(op, lba, count, buffer);
+wait(request);
+if (request.status != DISK_DONE) return false;
+if (op != DISK_WRITE) return true;
+request.op = DISK_FLUSH;
+if (!submit(request)) return pio(DISK_FLUSH, lba, 0, buffer);
+wait(request);
+return request.status == DISK_DONE;
+}
+public:
+static bool submit(DiskRequest& request) {
+request.status = DISK_QUEUED;
+request.done = 0;
+request.next = 0;
+LockGuard<IrqSpinLock> guard(queue_lock);
+if (!dma_enabled) return false;
+dma_requests++;
+if (active) {
+queue_tail->next = &request;
+queue_tail = &request;
+return true;
+}
+active = &request;
+queue_tail = &request;
+advance();
+return true;
 }
 
-void update() {
-if (!active) return;
-term.update_mouse();
-if (term.is_mouse_clicked(60, 2, 8, 1)) {
-close();
+static void wait(DiskRequest& request) {
+while (true) {
+uint32_t flags = Interrupts::save();
+Interrupts::disable();
+if (request.status == DISK_DONE || request.status == DISK_ERROR) {
+Interrupts::restore(flags);
 return;
 }
-if (term.is_mouse_clicked(2, 23, 3, 1)) {
-close();
+Scheduler::wait(waiters);
+Interrupts::restore(flags);
+}
+}
+
+static void set_dma(bool enable) {
+if (!bus_master) return;
+LockGuard<SpinLock> guard(lock);
+if (enable) {
+dma_enabled = true;
 return;
 }
-if (RTC::should_update()) {
-draw_ui();
+{
+LockGuard<IrqSpinLock> queue_guard(queue_lock);
+dma_enabled = false;
 }
+while (active) asm volatile("pause");
 }
+
+static void init() {
+outb(ATA_CONTROL, 0x02);
+if (inb(ATA_PRIMARY + 7) == 0xFF) return;
+outb(ATA_PRIMARY + 6, 0xA0);
+io_wait();
+outb(ATA_PRIMARY + 2, 0);
+outb(ATA_PRIMARY + 3, 0);
+outb(ATA_PRIMARY + 4, 0);
+outb(ATA_PRIMARY + 5, 0);
+outb(ATA_PRIMARY + 7, 0xEC);
+if (inb(ATA_PRIMARY + 7) == 0 || !wait_ready()) return;
+if (inb(ATA_PRIMARY + 4) != 0 || inb(ATA_PRIMARY + 5) != 0) return;
+if (!wait_drq()) return;
+uint16_t identify[256];
+insw(ATA_PRIMARY, identify, 256);
+for (int i = 0; i < 20; i++) {
+model[i * 2] = identify[27 + i] >> 8;
+model[i * 2 + 1] = identify[27 + i] & 0xFF;
+}
+model[40] = 0;
+for (int i = 39; i >= 0 && model[i] == ' '; i--) model[i] = 0;
+sectors = identify[60] | ((uint32_t)identify[61] << 16);
+uint8_t max_multiple = identify[47] & 0xFF;
+if (max_multiple > ATA_MAX_MULTIPLE) max_multiple = ATA_MAX_MULTIPLE;
+if (max_multiple > 1) {
+outb(ATA_PRIMARY + 6, 0xA0);
+outb(ATA_PRIMARY + 2, max_multiple);
+outb(ATA_PRIMARY + 7, 0xC6);
+if (wait_ready() && !(inb(ATA_PRIMARY + 7) & 0x01)) multiple = max_multiple;
+}
+present = sectors > 0;
+if (present) init_dma();
+}
+
+static bool read(uint32_t lba, uint32_t count, void* buffer) {
+if (!present || lba + count > sectors) return false;
+uint64_t start = Clock::cycles();
+bool ok = io(DISK_READ, lba, count, (uint8_t*)buffer);
+read_cycles += Clock::cycles() - start;
+if (ok) read_bytes += count * 512;
+else errors++;
+return ok;
+}
+
+static bool write(uint32_t lba, uint32_t count, const void* buffer) {
+if (!present || lba + count > sectors) return false;
+uint64_t start = Clock::cycles();
+bool ok = io(DISK_WRITE, lba, count, (uint8_t*)buffer);
+write_cycles += Clock::cycles() - start;
+if (ok) write_bytes += count * 512;
+else errors++;
+return ok;
+}
+
+static bool is_present() { return present; }
+static const char* get_model() { return model; }
+static uint32_t get_sectors() { return sectors; }
+static uint8_t get_multiple() { return multiple; }
+static uint64_t get_read_bytes() { return read_bytes; }
+static uint64_t get_read_cycles() { return read_cycles; }
+static uint64_t get_write_bytes() { return write_bytes; }
+static uint64_t get_write_cycles() { return write_cycles; }
+static uint32_t get_errors() { return errors; }
+static bool has_dma() { return bus_master != 0; }
+static bool is_dma_enabled() { return dma_enabled; }
+static uint32_t get_dma_requests() { return dma_requests; }
 };
-class TextEditor {
+bool ATA::present = false;
+char ATA::model[41];
+uint32_t ATA::sectors = 0;
+uint8_t ATA::multiple = 0;
+uint64_t ATA::read_bytes = 0;
+uint64_t ATA::read_cycles = 0;
+uint64_t ATA::write_bytes = 0;
+uint64_t ATA::write_cycles = 0;
+uint32_t ATA::errors = 0;
+SpinLock ATA::lock("ata");
+uint16_t ATA::bus_master = 0;
+volatile bool ATA::dma_enabled = false;
+DiskRequest* volatile ATA::active = 0;
+DiskRequest* ATA::queue_tail = 0;
+uint32_t ATA::chunk = 0;
+uint32_t ATA::dma_requests = 0;
+IrqSpinLock ATA::queue_lock("ata queue");
+WaitQueue ATA::waiters = {-1, -1};
+struct FloppyTrack {
+int16_t track;
+bool dirty;
+uint32_t stamp;
+};
+class Floppy {
 private:
-VGATerminal& term;
-FileSystem& fs;
-char buffer[MAX_FILE_SIZE];
-int cursor;
-int cursor_line;
-int cursor_col;
-int scroll_y;
-bool active;
-char current_filename[13];
-bool modified;
-void update_cursor_pos() {
-cursor_line = 0;
-cursor_col = 0;
-for (int i = 0; i < cursor && buffer[i]; i++) {
-if (buffer[i] == '\n') {
-cursor_line++;
-cursor_col = 0;
-} else {
-cursor_col++;
+static bool present;
+static volatile bool irq_fired;
+static volatile bool motor;
+static volatile uint32_t busy;
+static int current_cylinder;
+static FloppyTrack cache[FDC_CACHE_TRACKS];
+static uint32_t clock;
+static uint32_t track_reads;
+static uint32_t track_writes;
+static uint32_t hits;
+static uint32_t misses;
+static uint32_t seeks;
+static uint32_t errors;
+static TimerCallback motor_timer;
+static Mutex lock;
+static void on_irq(InterruptFrame*) {
+irq_fired = true;
+}
+
+static void on_motor_timer(void*) {
+if (busy) return;
+outb(FDC_BASE + 2, 0x0C);
+motor = false;
+}
+
+static bool wait_irq() {
+if (!Interrupts::are_enabled()) {
+klog(LOG_ERROR, "floppy: IRQ wait with interrupts disabled");
+return false;
 }
+Timeout timeout(FDC_TIMEOUT_MS);
+while (!irq_fired) {
+if (timeout.expired()) return false;
+Scheduler::sleep(1);
 }
-if (cursor_line < scroll_y) scroll_y = cursor_line;
-if (cursor_line >= scroll_y + 16) scroll_y = cursor_line - 15;
+return true;
 }
 
-void draw_content() {
-term.fill_rect(3, 4, 74, 16, 0x17, ' ');
+static bool send(uint8_t value) {
+Timeout timeout(FDC_TIMEOUT_MS);
+while (!timeout.expired()) {
+if ((inb(FDC_BASE + 4) & 0xC0) == 0x80) {
+outb(FDC_BASE + 5, value);
+return true;
+}
+}
+return false;
+}
 
-int line = scroll_y;
-int screen_line = 4;
-int buf_pos = 0;
-int cur_line = 0;
-
-while (cur_line < scroll_y && buffer[buf_pos]) {
-if (buffer[buf_pos] == '\n') cur_line++;
-buf_pos++;
+static bool receive(uint8_t& value) {
+Timeout timeout(FDC_TIMEOUT_MS);
+while (!timeout.expired()) {
+if ((inb(FDC_BASE + 4) & 0xC0) == 0xC0) {
+value = inb(FDC_BASE + 5);
+return true;
+}
+}
+return false;
 }
 
-while (screen_line < 20 && buffer[buf_pos] && line < scroll_y + 16) {
-char num[4];
-int_to_str(line + 1, num);
-if (line + 1 < 10) {
-term.write_at(2, screen_line, "    ", 0x08);
-term.write_at(3, screen_line, num, 0x08);
-} else {
-term.write_at(2, screen_line, num, 0x08);
+static bool sense_interrupt(uint8_t& st0, uint8_t& cylinder) {
+return send(0x08) && receive(st0) && receive(cylinder);
 }
 
-int col = 5;
-while (buffer[buf_pos] && buffer[buf_pos] != '\n' && screen_line < 20) {
-if (col < 77) {
-if (buffer[buf_pos] >= 32 && buffer[buf_pos] <= 126) {
-char ch[2] = {buffer[buf_pos], 0};
-term.write_at(col, screen_line, ch, 0x0F);
-col++;
-} else if (buffer[buf_pos] == '\t') {
-term.write_at(col, screen_line, "        ", 0x0F);
-col += 8;
+static bool reset() {
+irq_fired = false;
+outb(FDC_BASE + 2, 0x00);
+io_wait();
+outb(FDC_BASE + 2, motor ? 0x1C : 0x0C);
+if (!wait_irq()) return false;
+uint8_t st0, cylinder;
+for (int i = 0; i < 4; i++) {
+if (!sense_interrupt(st0, cylinder)) return false;
+}
+outb(FDC_BASE + 7, 0x00);
+current_cylinder = -1;
+return send(0x03) && send(0xDF) && send(0x02);
+}
+
+static void motor_on() {
+__sync_fetch_and_add(&busy, 1);
+TimerWheel::cancel(motor_timer);
+if (motor) return;
+outb(FDC_BASE + 2, 0x1C);
+motor = true;
+Scheduler::sleep(FDC_MOTOR_SPINUP_MS);
+}
+
+static void motor_release() {
+if (__sync_sub_and_fetch(&busy, 1) == 0) TimerWheel::start(motor_timer, FDC_MOTOR_OFF_MS);
+}
+
+static bool recalibrate() {
+for (int i = 0; i < 2; i++) {
+irq_fired = false;
+if (!send(0x07) || !send(0x00) || !wait_irq()) return false;
+uint8_t st0, cylinder;
+if (!sense_interrupt(st0, cylinder)) return false;
+if (!(st0 & 0xC0) && cylinder == 0) {
+current_cylinder = 0;
+return true;
 }
 }
-buf_pos++;
+return false;
 }
 
-if (buffer[buf_pos] == '\n') buf_pos++;
-screen_line++;
-line++;
+static bool seek(int cylinder, int head) {
+if (current_cylinder == cylinder) return true;
+if (current_cylinder < 0 && !recalibrate()) return false;
+irq_fired = false;
+if (!send(0x0F) || !send(head << 2) || !send(cylinder) || !wait_irq()) return false;
+uint8_t st0, pcn;
+if (!sense_interrupt(st0, pcn)) return false;
+seeks++;
+if ((st0 & 0xC0) || pcn != cylinder) {
+current_cylinder = -1;
+return false;
 }
-
-int disp_line = cursor_line - scroll_y + 4;
-int disp_col = cursor_col + 5;
-if (disp_line >= 4 && disp_line < 20 && disp_col < 77) {
-term.write_at(disp_col, disp_line, "_  ", 0x0F);
+current_cylinder = cylinder;
+return true;
 }
 
-char info[32];
-int_to_str(cursor_line + 1, info);
-term.write_at(3, 21, "Line:  ", 0x0F);
-term.write_at(9, 21, info, 0x0F);
-term.write_at(15, 21, "Col:  ", 0x0F);
-int_to_str(cursor_col + 1, info);
-term.write_at(20, 21, info, 0x0F);
-if (modified) term.write_at(60, 21, "Modified  ", 0x0E);
+static void dma_setup(bool write) {
+uint32_t address = FDC_DMA_BUFFER;
+uint32_t count = FDC_TRACK_SIZE - 1;
+outb(0x0A, 0x06);
+outb(0x0C, 0xFF);
+outb(0x04, address & 0xFF);
+outb(0x04, (address >> 8) & 0xFF);
+outb(0x81, (address >> 16) & 0xFF);
+outb(0x0C, 0xFF);
+outb(0x05, count & 0xFF);
+outb(0x05, (count >> 8) & 0xFF);
+outb(0x0B, write ? 0x4A : 0x46);
+outb(0x0A, 0x02);
+}
+
+static bool transfer_track(int track, bool write) {
+int cylinder = track / 2;
+int head = track % 2;
+for (int attempt = 0; attempt < FDC_RETRIES; attempt++) {
+if (!seek(cylinder, head)) {
+if (!reset()) break;
+continue;
 }
-public:
-TextEditor(VGATerminal& t, FileSystem& f) : term(t), fs(f), cursor(0), cursor_line(0), cursor_col(0), scroll_y(0), active(false), modified(false) {
-current_filename[0] = 0;
-buffer[0] = 0;
+dma_setup(write);
+irq_fired = false;
+bool sent = send(write ? 0x45 : 0x46) && send(head << 2) && send(cylinder) && send(head) &&
+send(1) && send(2) && send(FDC_SECTORS) && send(0x1B) && send(0xFF);
+if (sent && wait_irq()) {
+uint8_t result[7];
+bool ok = true;
+for (int i = 0; i < 7 && ok; i++) ok = receive(result[i]);
+if (ok && !(result[0] & 0xC0)) {
+if (write) track_writes++;
+else track_reads++;
+return true;
+}
+}
+errors++;
+reset();
+}
+return false;
 }
-void open(const char* filename = 0) {
-active = true;
-cursor = 0;
-cursor_line = 0;
-cursor_col = 0;
-scroll_y = 0;
-buffer[0] = 0;
-modified = false;
 
-if (filename && filename[0]) {
-strncpy(current_filename, filename, 12);
-uint32_t size;
-if (fs.load_file(filename, buffer, size)) {
-cursor = size;
-buffer[cursor] = 0;
-update_cursor_pos();
+static bool write_back(int slot) {
+FloppyTrack& entry = cache[slot];
+if (!entry.dirty) return true;
+memcpy((void*)FDC_DMA_BUFFER, (void*)(FDC_CACHE_BASE + slot * FDC_TRACK_SIZE), FDC_TRACK_SIZE);
+if (!transfer_track(entry.track, true)) return false;
+entry.dirty = false;
+return true;
 }
+
+static int get_track(int track, bool load) {
+int victim = 0;
+for (int i = 0; i < FDC_CACHE_TRACKS; i++) {
+if (cache[i].track == track) {
+cache[i].stamp = ++clock;
+hits++;
+return i;
+}
+if (cache[i].track < 0 || (cache[victim].track >= 0 && cache[i].stamp < cache[victim].stamp)) victim = i;
+}
+misses++;
+if (cache[victim].track >= 0 && !write_back(victim)) return -1;
+cache[victim].track = -1;
+if (load) {
+if (!transfer_track(track, false)) return -1;
+memcpy((void*)(FDC_CACHE_BASE + victim * FDC_TRACK_SIZE), (void*)FDC_DMA_BUFFER, FDC_TRACK_SIZE);
+}
+cache[victim].track = track;
+cache[victim].dirty = false;
+cache[victim].stamp = ++clock;
+return victim;
+}
+
+static bool access(uint32_t lba, uint32_t count, uint8_t* buffer, bool write) {
+if (!present || lba + count > FDC_TRACKS * FDC_SECTORS) return false;
+motor_on();
+LockGuard<Mutex> guard(lock);
+bool ok = true;
+while (count > 0 && ok) {
+int track = lba / FDC_SECTORS;
+uint32_t sector = lba % FDC_SECTORS;
+uint32_t n = FDC_SECTORS - sector < count ? FDC_SECTORS - sector : count;
+int slot = get_track(track, !(write && n == FDC_SECTORS));
+if (slot < 0) {
+ok = false;
+break;
+}
+uint8_t* data = (uint8_t*)(FDC_CACHE_BASE + slot * FDC_TRACK_SIZE + sector * 512);
+if (write) {
+memcpy(data, buffer, n * 512);
+cache[slot].dirty = true;
 } else {
-current_filename[0] = 0;
+memcpy(buffer, data, n * 512);
 }
-
-term.set_color(0x0F, 0x01);
-term.clear();
-draw_ui();
-draw_content();
+buffer += n * 512;
+lba += n;
+count -= n;
+}
+motor_release();
+return ok;
+}
+public:
+static void init() {
+for (int i = 0; i < FDC_CACHE_TRACKS; i++) cache[i].track = -1;
+uint32_t flags = Interrupts::save();
+Interrupts::disable();
+outb(0x70, 0x10);
+uint8_t type = inb(0x71) >> 4;
+Interrupts::restore(flags);
+if (type != 4) return;
+TimerWheel::setup(motor_timer, on_motor_timer, 0, TIMER_IRQ);
+Interrupts::set_handler(IRQ_BASE + 6, on_irq);
+Interrupts::unmask_irq(6);
+present = reset();
 }
 
-void close() {
-if (modified && current_filename[0]) save_file();
-active = false;
+static bool read(uint32_t lba, uint32_t count, void* buffer) {
+return access(lba, count, (uint8_t*)buffer, false);
 }
 
-bool is_active() { return active; }
+static bool write(uint32_t lba, uint32_t count, const void* buffer) {
+return access(lba, count, (uint8_t*)buffer, true);
+}
 
-void handle_input(char c) {
-if (!active) return;
+static bool sync() {
+if (!present) return false;
+motor_on();
+LockGuard<Mutex> guard(lock);
+bool ok = true;
+while (ok) {
+int slot = -1;
+for (int i = 0; i < FDC_CACHE_TRACKS; i++) {
+if (cache[i].dirty && (slot < 0 || cache[i].track < cache[slot].track)) slot = i;
+}
+if (slot < 0) break;
+ok = write_back(slot);
+}
+motor_release();
+return ok;
+}
 
-if (c == (char)0xF1) {
-close();
-return;
+static int get_dirty_count() {
+int count = 0;
+for (int i = 0; i < FDC_CACHE_TRACKS; i++) {
+if (cache[i].dirty) count++;
+}
+return count;
 }
 
-if (c == (char)0xF4) {
-save_file();
-return;
+static bool is_present() { return present; }
+static bool is_motor_on() { return motor; }
+static uint32_t get_track_reads() { return track_reads; }
+static uint32_t get_track_writes() { return track_writes; }
+static uint32_t get_hits() { return hits; }
+static uint32_t get_misses() { return misses; }
+static uint32_t get_seeks() { return seeks; }
+static uint32_t get_errors() { return errors; }
+};
+bool Floppy::present = false;
+volatile bool Floppy::irq_fired = false;
+volatile bool Floppy::motor = false;
+volatile uint32_t Floppy::busy = 0;
+int Floppy::current_cylinder = -1;
+FloppyTrack Floppy::cache[FDC_CACHE_TRACKS];
+uint32_t Floppy::clock = 0;
+uint32_t Floppy::track_reads = 0;
+uint32_t Floppy::track_writes = 0;
+uint32_t Floppy::hits = 0;
+uint32_t Floppy::misses = 0;
+uint32_t Floppy::seeks = 0;
+uint32_t Floppy::errors = 0;
+TimerCallback Floppy::motor_timer;
+Mutex Floppy::lock("floppy");
+enum FsBackend { FS_RAM, FS_ATA, FS_FLOPPY };
+struct CacheBlock {
+uint32_t lba;
+uint32_t generation;
+int16_t next;
+bool valid;
+bool dirty;
+bool referenced;
+};
+class BlockCache {
+private:
+static uint8_t device;
+static CacheBlock* blocks;
+static int16_t* buckets;
+static int hand;
+static uint32_t sequential_end;
+static uint32_t readahead;
+static uint32_t writeback_ms;
+static volatile bool flush_requested;
+static WaitQueue flusher_wait;
+static int flusher_thread;
+static uint32_t dirty;
+static uint32_t generation;
+static uint64_t hits;
+static uint64_t misses;
+static uint32_t readahead_blocks;
+static uint32_t writebacks;
+static uint32_t writeback_blocks;
+static uint32_t evictions;
+static uint32_t errors;
+static TimerCallback writeback_timer;
+static Mutex lock;
+static uint32_t* capture;
+static int captured;
+static uint8_t* data(int slot) { return (uint8_t*)(BCACHE_BASE + slot * 512); }
+
+static uint32_t bucket(uint32_t lba) { return (lba * 2654435761u) >> 22; }
+
+static bool device_io(uint32_t lba, uint32_t count, void* buffer, bool write) {
+if (capture && write) {
+for (uint32_t i = 0; i < count && captured < 8; i++) capture[captured++] = lba + i;
+return true;
+}
+if (device == FS_ATA) return write ? ATA::write(lba, count, buffer) : ATA::read(lba, count, buffer);
+if (device == FS_FLOPPY) return write ? Floppy::write(lba, count, buffer) : Floppy::read(lba, count, buffer);
+return false;
 }
 
-if (c == (char)0xF8) {
-if (scroll_y > 0) scroll_y--;
-draw_content();
-return;
+static int lookup(uint32_t lba) {
+for (int i = buckets[bucket(lba)]; i >= 0; i = blocks[i].next) {
+if (blocks[i].lba == lba) return i;
+}
+return -1;
 }
 
-if (c == (char)0xF9) {
-scroll_y++;
-draw_content();
+static void unlink(int slot) {
+int16_t* link = &buckets[bucket(blocks[slot].lba)];
+while (*link >= 0) {
+if (*link == slot) {
+*link = blocks[slot].next;
 return;
 }
+link = &blocks[*link].next;
+}
+}
 
-if (c == '\b') {
-if (cursor > 0) {
-cursor--;
-for (int i = cursor; i < MAX_FILE_SIZE - 1 && buffer[i]; i++) {
-buffer[i] = buffer[i + 1];
+static int write_run(int slot) {
+uint32_t lba = blocks[slot].lba;
+uint32_t count = 0;
+while (count < BCACHE_MAX_RUN) {
+int next = count ? lookup(lba + count) : slot;
+if (next < 0 || !blocks[next].dirty || blocks[next].generation != blocks[slot].generation) break;
+memcpy((uint8_t*)BCACHE_WRITE_BUFFER + count * 512, data(next), 512);
+count++;
 }
-modified = true;
-update_cursor_pos();
-draw_content();
+if (!device_io(lba, count, (void*)BCACHE_WRITE_BUFFER, true)) {
+errors++;
+return -1;
 }
-} else if (c == '\n') {
-if (cursor < MAX_FILE_SIZE - 2) {
-for (int i = strlen(buffer); i >= cursor; i--) {
-buffer[i + 1] = buffer[i];
+for (uint32_t i = 0; i < count; i++) {
+blocks[lookup(lba + i)].dirty = false;
 }
-buffer[cursor] = '\n';
-cursor++;
-modified = true;
-update_cursor_pos();
-draw_content();
+dirty -= count;
+writebacks++;
+writeback_blocks += count;
+return count;
 }
-} else if (c >= 32 && c <= 126 && cursor < MAX_FILE_SIZE - 2) {
-for (int i = strlen(buffer); i >= cursor; i--) {
-buffer[i + 1] = buffer[i];
+
+static bool flush_all() {
+bool wrote = false;
+uint32_t current = 0;
+while (dirty > 0) {
+int first = -1;
+for (int i = 0; i < BCACHE_BLOCKS; i++) {
+if (!blocks[i].dirty) continue;
+if (first < 0 || blocks[i].generation < blocks[first].generation ||
+(blocks[i].generation == blocks[first].generation && blocks[i].lba < blocks[first].lba)) first = i;
 }
-buffer[cursor] = c;
-cursor++;
-modified = true;
-update_cursor_pos();
-draw_content();
-} else if (c == (char)0xF6) {
-if (cursor_line > 0) {
-int new_cursor = 0;
-int line = 0;
-for (int i = 0; i < cursor && buffer[i]; i++) {
-if (buffer[i] == '\n') line++;
+if (first < 0) return false;
+if (wrote && device == FS_FLOPPY && blocks[first].generation != current && !Floppy::sync()) return false;
+current = blocks[first].generation;
+if (write_run(first) < 0) return false;
+wrote = true;
 }
-for (int i = 0; buffer[i] && line > 0; i++) {
-if (buffer[i] == '\n') line--;
-new_cursor = i + 1;
+if (wrote && device == FS_FLOPPY) return Floppy::sync();
+return true;
 }
-cursor = new_cursor;
-update_cursor_pos();
-draw_content();
+
+static int allocate(uint32_t lba) {
+for (int scanned = 0; scanned < BCACHE_BLOCKS * 3; scanned++) {
+int slot = hand;
+hand = (hand + 1) % BCACHE_BLOCKS;
+CacheBlock& block = blocks[slot];
+if (block.valid && block.referenced) {
+block.referenced = false;
+continue;
 }
-} else if (c == (char)0xF7) {
-int new_cursor = cursor;
-while (buffer[new_cursor] && buffer[new_cursor] != '\n') new_cursor++;
-if (buffer[new_cursor] == '\n') new_cursor++;
-cursor = new_cursor;
-update_cursor_pos();
-draw_content();
+if (block.valid && block.dirty && scanned < BCACHE_BLOCKS * 2) continue;
+if (block.valid && block.dirty && !flush_all()) continue;
+if (block.valid) {
+unlink(slot);
+evictions++;
+}
+block.lba = lba;
+block.valid = true;
+block.dirty = false;
+block.referenced = true;
+block.next = buckets[bucket(lba)];
+buckets[bucket(lba)] = slot;
+return slot;
 }
+return -1;
 }
 
-void save_file() {
-if (current_filename[0] == 0) {
-term.fill_rect(20, 10, 40, 5, 0x17, ' ');
-term.draw_box(20, 10, 40, 5, 0x2F);
-term.write_at(22, 11, "Filename:  ", 0x2F);
-term.write_at(22, 12, "  >   ", 0x0F);
+static bool fill(uint32_t lba, uint32_t count) {
+uint32_t n = 0;
+while (n < count && n < BCACHE_MAX_RUN && lookup(lba + n) < 0) n++;
+if (!device_io(lba, n, (void*)BCACHE_READ_BUFFER, false)) {
+errors++;
+return false;
+}
+for (uint32_t i = 0; i < n; i++) {
+int slot = allocate(lba + i);
+if (slot < 0) return false;
+memcpy(data(slot), (uint8_t*)BCACHE_READ_BUFFER + i * 512, 512);
+blocks[slot].referenced = i == 0;
+}
+readahead_blocks += n > 1 ? n - 1 : 0;
+return true;
+}
 
-char filename[13] = {0};
-int pos = 0;
+static void on_writeback(void*) {
+flush_requested = true;
+Scheduler::wake_all(flusher_wait);
+}
 
+static void flusher(void*) {
 while (true) {
-if (Keyboard::is_key_pressed()) {
-char ch = Keyboard::get_char();
-if (ch == '\n') {
-filename[pos] = 0;
-break;
-} else if (ch == '\b') {
-if (pos > 0) {
-pos--;
-term.write_at(24 + pos, 12, "     ", 0x0F);
+uint32_t flags = Interrupts::save();
+if (!flush_requested) Scheduler::wait(flusher_wait);
+flush_requested = false;
+Interrupts::restore(flags);
+if (!sync()) klog(LOG_ERROR, "bcache: writeback failed");
 }
-} else if (ch >= 32 && ch <= 126 && pos < 12) {
-filename[pos] = ch;
-pos++;
-char ch_str[2] = {ch, 0};
-term.write_at(24 + pos - 1, 12, ch_str, 0x0F);
-} else if (ch == (char)0xFA) {
-draw_ui();
-draw_content();
-return;
 }
+public:
+static void init(uint8_t backend) {
+device = backend;
+blocks = (CacheBlock*)BCACHE_META;
+buckets = (int16_t*)(BCACHE_META + BCACHE_BLOCKS * sizeof(CacheBlock));
+memset(blocks, 0, BCACHE_BLOCKS * sizeof(CacheBlock));
+for (int i = 0; i < BCACHE_HASH; i++) buckets[i] = -1;
+TimerWheel::setup(writeback_timer, on_writeback, 0, TIMER_IRQ);
+if (device != FS_RAM && flusher_thread < 0) flusher_thread = Scheduler::spawn("flush", flusher, 0, PRIO_NORMAL);
+}
+
+static bool read(uint32_t lba, uint32_t count, void* buffer) {
+if (device == FS_RAM) return false;
+LockGuard<Mutex> guard(lock);
+uint8_t* out = (uint8_t*)buffer;
+if (lba == sequential_end) {
+readahead = readahead * 2 > BCACHE_READAHEAD_MAX ? BCACHE_READAHEAD_MAX : readahead * 2;
+} else {
+readahead = BCACHE_READAHEAD_MIN;
+}
+sequential_end = lba + count;
+for (uint32_t i = 0; i < count; i++) {
+int slot = lookup(lba + i);
+if (slot < 0) {
+misses++;
+uint32_t want = count - i > readahead ? count - i : readahead;
+if (!fill(lba + i, want)) return false;
+slot = lookup(lba + i);
+if (slot < 0) return false;
+} else {
+hits++;
+blocks[slot].referenced = true;
 }
+memcpy(out + i * 512, data(slot), 512);
 }
-
-if (filename[0]) {
-strncpy(current_filename, filename, 12);
-} else {
-draw_ui();
-draw_content();
-return;
+return true;
 }
+
+static bool write(uint32_t lba, uint32_t count, const void* buffer) {
+if (device == FS_RAM) return false;
+LockGuard<Mutex> guard(lock);
+const uint8_t* in = (const uint8_t*)buffer;
+for (uint32_t i = 0; i < count; i++) {
+int slot = lookup(lba + i);
+if (slot < 0) slot = allocate(lba + i);
+if (slot < 0) return false;
+memcpy(data(slot), in + i * 512, 512);
+blocks[slot].referenced = true;
+blocks[slot].generation = generation;
+if (!blocks[slot].dirty) {
+blocks[slot].dirty = true;
+dirty++;
+}
+}
+if (writeback_ms == 0) return flush_all();
+if (!writeback_timer.pending) TimerWheel::start(writeback_timer, writeback_ms);
+return true;
 }
 
-if (fs.save_file(current_filename, buffer, strlen(buffer))) {
-modified = false;
-term.fill_rect(20, 10, 40, 3, 0x17, ' ');
-term.draw_box(20, 10, 40, 3, 0x2F);
-term.write_at(22, 11, "Saved!  ", 0x0A);
-for (int i = 0; i < 300000; i++);
+static bool sync() {
+if (device == FS_RAM) return true;
+LockGuard<Mutex> guard(lock);
+TimerWheel::cancel(writeback_timer);
+return flush_all();
+}
+
+static void barrier() {
+LockGuard<Mutex> guard(lock);
+generation++;
+}
+
+static void discard(uint32_t lba) {
+int slot = lookup(lba);
+if (slot < 0) return;
+if (blocks[slot].dirty) dirty--;
+unlink(slot);
+blocks[slot].valid = false;
+blocks[slot].dirty = false;
+}
+
+static bool self_test() {
+if (device == FS_RAM || !sync()) return false;
+uint8_t block[512];
+memset(block, 0xA5, sizeof(block));
+uint32_t order[8];
+uint32_t delay = writeback_ms;
+writeback_ms = 60000;
+{
+LockGuard<Mutex> guard(lock);
+capture = order;
+captured = 0;
+}
+bool ok = write(ATA_BENCH_LBA, 1, block);
+barrier();
+ok = ok && write(ATA_BENCH_LBA + 8, 1, block);
+barrier();
+ok = ok && write(ATA_BENCH_LBA, 1, block);
+ok = sync() && ok;
+LockGuard<Mutex> guard(lock);
+capture = 0;
+writeback_ms = delay;
+discard(ATA_BENCH_LBA);
+discard(ATA_BENCH_LBA + 8);
+return ok && captured == 2 && order[0] == ATA_BENCH_LBA + 8 && order[1] == ATA_BENCH_LBA;
+}
+
+static void set_writeback_delay(uint32_t ms) { writeback_ms = ms; }
+static uint32_t get_writeback_delay() { return writeback_ms; }
+static uint32_t get_dirty() { return dirty; }
+static uint64_t get_hits() { return hits; }
+static uint64_t get_misses() { return misses; }
+static uint32_t get_readahead_blocks() { return readahead_blocks; }
+static uint32_t get_writebacks() { return writebacks; }
+static uint32_t get_writeback_blocks() { return writeback_blocks; }
+static uint32_t get_evictions() { return evictions; }
+static uint32_t get_errors() { return errors; }
+static int get_hit_rate() {
+uint64_t total = hits + misses;
+return total ? (int)(hits * 100 / total) : 0;
+}
+};
+uint8_t BlockCache::device = FS_RAM;
+CacheBlock* BlockCache::blocks = 0;
+int16_t* BlockCache::buckets = 0;
+int BlockCache::hand = 0;
+uint32_t BlockCache::sequential_end = 0;
+uint32_t BlockCache::readahead = BCACHE_READAHEAD_MIN;
+uint32_t BlockCache::writeback_ms = BCACHE_WRITEBACK_MS;
+volatile bool BlockCache::flush_requested = false;
+WaitQueue BlockCache::flusher_wait = {-1, -1};
+int BlockCache::flusher_thread = -1;
+uint32_t BlockCache::dirty = 0;
+uint32_t BlockCache::generation = 0;
+uint64_t BlockCache::hits = 0;
+uint64_t BlockCache::misses = 0;
+uint32_t BlockCache::readahead_blocks = 0;
+uint32_t BlockCache::writebacks = 0;
+uint32_t BlockCache::writeback_blocks = 0;
+uint32_t BlockCache::evictions = 0;
+uint32_t BlockCache::errors = 0;
+TimerCallback BlockCache::writeback_timer;
+Mutex BlockCache::lock("block cache");
+uint32_t* BlockCache::capture = 0;
+int BlockCache::captured = 0;
+struct FileEntry {
+char name[13];
+bool used;
+bool read_only;
+bool directory;
+uint32_t size;
+uint32_t data_offset;
+uint16_t parent;
+};
+struct FileEntryV4 {
+char name[13];
+uint32_t size;
+uint32_t data_offset;
+bool used;
+bool read_only;
+};
+class NameIndex {
+private:
+int16_t* slots;
+uint32_t mask;
+FileEntry* entries;
+int capacity;
+uint32_t occupied;
+uint32_t probes;
+void place(int idx) {
+uint32_t i = hash(entries[idx].name) & mask;
+while (slots[i] >= 0) i = (i + 1) & mask;
+if (slots[i] == -1) occupied++;
+slots[i] = idx;
 }
 
-draw_ui();
-draw_content();
+void rebuild() {
+clear();
+for (int i = 0; i < capacity; i++) {
+if (entries[i].used) place(i);
+}
+}
+public:
+NameIndex() : slots(0), mask(0), entries(0), capacity(0), occupied(0), probes(0) {}
+static uint32_t hash(const char* name) {
+uint32_t h = 2166136261u;
+for (int i = 0; i < 12 && name[i]; i++) {
+h ^= (uint8_t)name[i];
+h *= 16777619u;
+}
+return h;
 }
 
-void draw_ui() {
-term.set_color(0x0F, 0x01);
-term.draw_box(1, 1, 78, 21, 0x3F);
+void init(int16_t* table, uint32_t size, FileEntry* files, int count) {
+slots = table;
+mask = size - 1;
+entries = files;
+capacity = count;
+clear();
+}
 
-char title[64];
-if (current_filename[0]) {
-strcpy(title, "Editor - ");
-strcat(title, current_filename);
-} else {
-strcpy(title, "Editor - New File ");
+void clear() {
+for (uint32_t i = 0; i <= mask; i++) slots[i] = -1;
+occupied = 0;
 }
-if (modified) strcat(title, " * ");
 
-term.write_at(5, 2, title, 0x3F);
-term.write_at(45, 2, "F1:Exit F4:Save  ", 0x3F);
-term.write_at(45, 3, "F8:Up F9:Dn  ", 0x3F);
-term.fill_rect(2, 23, 3, 1, 0x4F, ' ');
-term.write_at(2, 23, "[X] ", 0x0F);
+void insert(int idx) {
+place(idx);
+if (occupied > (mask + 1) / 4 * 3) rebuild();
 }
 
-void update() {
-if (!active) return;
-term.update_mouse();
-if (term.is_mouse_clicked(2, 23, 3, 1)) {
-close();
+void remove(int idx) {
+uint32_t i = hash(entries[idx].name) & mask;
+while (slots[i] != -1) {
+if (slots[i] == idx) {
+slots[i] = -2;
 return;
 }
+i = (i + 1) & mask;
+}
 }
 
-const char* get_current_filename() {
-return current_filename;
+int find(const char* name) {
+uint32_t i = hash(name) & mask;
+while (slots[i] != -1) {
+probes++;
+if (slots[i] >= 0 && strcmp(entries[slots[i]].name, name) == 0) return slots[i];
+i = (i + 1) & mask;
 }
-
-bool is_modified() {
-return modified;
+return -1;
 }
+
+uint32_t get_probes() { return probes; }
+};
+struct DirKey {
+uint16_t parent;
+char name[13];
 };
-class Calculator {
+struct DirNode {
+uint16_t count;
+bool leaf;
+int16_t next;
+DirKey keys[DIR_ORDER];
+int16_t slots[DIR_ORDER + 1];
+};
+struct DirCursor {
+int16_t node;
+int16_t slot;
+};
+class DirIndex {
 private:
-VGATerminal& term;
-char display[16];
-int value;
-char operation;
-int operand;
-bool active;
-bool new_input;
-public:
-Calculator(VGATerminal& t) : term(t), value(0), operation(0), operand(0), active(false), new_input(true) {
-display[0] = '0';
-display[1] = 0;
+DirNode* nodes;
+int capacity;
+int used;
+int released;
+int16_t root;
+int16_t head;
+int16_t free_list;
+FileEntry* entries;
+int entry_count;
+uint32_t probes;
+static int compare(uint16_t parent, const char* name, uint16_t other_parent, const char* other_name) {
+if (parent != other_parent) return parent < other_parent ? -1 : 1;
+return strcmp(name, other_name);
+}
+
+int compare(uint16_t parent, const char* name, int16_t idx) {
+return compare(parent, name, entries[idx].parent, entries[idx].name);
+}
+
+int16_t alloc(bool leaf) {
+int16_t n;
+if (free_list >= 0) {
+n = free_list;
+free_list = nodes[n].next;
+released--;
+} else if (used < capacity) {
+n = used++;
+} else {
+return -1;
 }
-void open() {
-active = true;
-value = 0;
-operation = 0;
-operand = 0;
-new_input = true;
-display[0] = '0';
-display[1] = 0;
-term.set_color(0x0F, 0x01);
-term.clear();
-draw_ui();
+nodes[n].count = 0;
+nodes[n].leaf = leaf;
+nodes[n].next = -1;
+return n;
 }
 
-void close() { active = false; }
-bool is_active() { return active; }
-
-void handle_input(char c) {
-if (!active) return;
+void release(int16_t n) {
+nodes[n].next = free_list;
+free_list = n;
+released++;
+}
 
-if (c == (char)0xF2) {
-close();
+void unlink_leaf(int16_t n) {
+if (head == n) {
+head = nodes[n].next;
 return;
 }
-
-if (c == 'c' || c == 'C') {
-value = 0;
-operand = 0;
-operation = 0;
-new_input = true;
-display[0] = '0';
-display[1] = 0;
-} else if (c >= '0' && c <= '9') {
-if (new_input || (display[0] == '0' && display[1] == 0)) {
-display[0] = c;
-display[1] = 0;
-new_input = false;
-} else {
-int len = strlen(display);
-if (len < 14) {
-display[len] = c;
-display[len + 1] = 0;
+for (int16_t p = head; p >= 0; p = nodes[p].next) {
+if (nodes[p].next != n) continue;
+nodes[p].next = nodes[n].next;
+return;
 }
 }
-value = 0;
-for (int i = 0; display[i]; i++) {
-value = value * 10 + (display[i] - '0');
+
+void drop(int16_t n, int16_t* path, int depth) {
+if (nodes[n].leaf) unlink_leaf(n);
+release(n);
+if (depth == 0) {
+root = head = -1;
+return;
 }
-} else if (c == '+' || c == '-' || c == '*' || c == '/') {
-if (operation != 0) calculate();
-operation = c;
-operand = value;
-new_input = true;
-} else if (c == '=' || c == '\n') {
-calculate();
-operation = 0;
-new_input = true;
+int16_t p = path[depth - 1];
+DirNode& node = nodes[p];
+if (node.count == 0) {
+drop(p, path, depth - 1);
+return;
+}
+int c = 0;
+while (node.slots[c] != n) c++;
+int k = c > 0 ? c - 1 : 0;
+memmove(node.keys + k, node.keys + k + 1, (node.count - k - 1) * sizeof(DirKey));
+memmove(node.slots + c, node.slots + c + 1, (node.count - c) * sizeof(int16_t));
+node.count--;
+while (!nodes[root].leaf && nodes[root].count == 0) {
+int16_t only = nodes[root].slots[0];
+release(root);
+root = only;
 }
-draw_display();
-draw_buttons();
 }
 
-void calculate() {
-switch (operation) {
-case '+': value = operand + value; break;
-case '-': value = operand - value; break;
-case '*': value = operand * value; break;
-case '/': if (value != 0) value = operand / value; break;
+int child(DirNode& node, uint16_t parent, const char* name) {
+int lo = 0;
+int hi = node.count;
+while (lo < hi) {
+int mid = (lo + hi) / 2;
+if (compare(parent, name, node.keys[mid].parent, node.keys[mid].name) < 0) hi = mid;
+else lo = mid + 1;
 }
-int_to_str(value, display);
+return lo;
 }
 
-void draw_ui() {
-term.draw_box(10, 5, 60, 15, 0x2F);
-term.write_at(15, 6, "Calculator - F2:Exit  ", 0x2F);
-draw_display();
-draw_buttons();
-term.fill_rect(11, 23, 3, 1, 0x4F, ' ');
-term.write_at(11, 23, "[X] ", 0x0F);
+int position(DirNode& node, uint16_t parent, const char* name) {
+int lo = 0;
+int hi = node.count;
+while (lo < hi) {
+int mid = (lo + hi) / 2;
+if (compare(parent, name, node.slots[mid]) > 0) lo = mid + 1;
+else hi = mid;
 }
-
-void draw_display() {
-term.fill_rect(12, 8, 56, 3, 0x70, ' ');
-term.write_at(13, 9, display, 0x0F);
+return lo;
 }
 
-void draw_buttons() {
-const char* buttons = "789/456*123-0C=+";
-for (int row = 0; row < 4; row++) {
-for (int col = 0; col < 4; col++) {
-int x = 12 + col * 14;
-int y = 12 + row * 2;
-term.draw_box(x, y, 12, 1, 0x70);
-char button[2] = {buttons[row * 4 + col], 0};
-term.write_at(x + 5, y, button, 0x0F);
+int16_t leaf_for(uint16_t parent, const char* name, int16_t* path, int& depth) {
+int16_t n = root;
+depth = 0;
+while (!nodes[n].leaf) {
+probes++;
+if (path) path[depth] = n;
+depth++;
+n = nodes[n].slots[child(nodes[n], parent, name)];
+}
+probes++;
+return n;
 }
+
+bool remove_from(int16_t n, int idx) {
+DirNode& node = nodes[n];
+for (int i = 0; i < node.count; i++) {
+if (node.slots[i] != idx) continue;
+memmove(node.slots + i, node.slots + i + 1, (node.count - i - 1) * sizeof(int16_t));
+node.count--;
+return true;
 }
+return false;
 }
 
-void update() {
-if (!active) return;
-term.update_mouse();
-if (term.is_mouse_clicked(11, 23, 3, 1)) {
-close();
-return;
+static void insert_slot(int16_t* slots, int count, int at, int16_t value) {
+memmove(slots + at + 1, slots + at, (count - at) * sizeof(int16_t));
+slots[at] = value;
 }
-for (int row = 0; row < 4; row++) {
-for (int col = 0; col < 4; col++) {
-int x = 12 + col * 14;
-int y = 12 + row * 2;
-if (term.is_mouse_clicked(x, y, 12, 1)) {
-const char* buttons = "789/456*123-0C=+";
-char c = buttons[row * 4 + col];
-handle_input(c);
-return;
+
+bool place(int idx) {
+if (root < 0) {
+root = head = alloc(true);
+if (root < 0) return false;
 }
+uint16_t parent = entries[idx].parent;
+const char* name = entries[idx].name;
+int16_t path[DIR_MAX_DEPTH];
+int depth;
+int16_t n = leaf_for(parent, name, path, depth);
+int at = position(nodes[n], parent, name);
+if (nodes[n].count < DIR_ORDER) {
+insert_slot(nodes[n].slots, nodes[n].count++, at, idx);
+return true;
 }
+int16_t right = alloc(true);
+if (right < 0) return false;
+DirNode& left = nodes[n];
+DirNode& split = nodes[right];
+int half = DIR_ORDER / 2;
+split.count = DIR_ORDER - half;
+memcpy(split.slots, left.slots + half, split.count * sizeof(int16_t));
+left.count = half;
+split.next = left.next;
+left.next = right;
+if (at <= half) insert_slot(left.slots, left.count++, at, idx);
+else insert_slot(split.slots, split.count++, at - half, idx);
+DirKey key;
+key.parent = entries[split.slots[0]].parent;
+memcpy(key.name, entries[split.slots[0]].name, 13);
+int16_t added = right;
+while (depth > 0) {
+DirNode& node = nodes[path[--depth]];
+at = child(node, key.parent, key.name);
+if (node.count < DIR_ORDER) {
+memmove(node.keys + at + 1, node.keys + at, (node.count - at) * sizeof(DirKey));
+node.keys[at] = key;
+insert_slot(node.slots, node.count + 1, at + 1, added);
+node.count++;
+return true;
 }
+int16_t sibling = alloc(false);
+if (sibling < 0) return false;
+DirKey keys[DIR_ORDER + 1];
+int16_t children[DIR_ORDER + 2];
+memcpy(keys, node.keys, DIR_ORDER * sizeof(DirKey));
+memcpy(children, node.slots, (DIR_ORDER + 1) * sizeof(int16_t));
+memmove(keys + at + 1, keys + at, (DIR_ORDER - at) * sizeof(DirKey));
+keys[at] = key;
+insert_slot(children, DIR_ORDER + 1, at + 1, added);
+int mid = (DIR_ORDER + 1) / 2;
+DirNode& upper = nodes[sibling];
+node.count = mid;
+memcpy(node.keys, keys, mid * sizeof(DirKey));
+memcpy(node.slots, children, (mid + 1) * sizeof(int16_t));
+upper.count = DIR_ORDER - mid;
+memcpy(upper.keys, keys + mid + 1, upper.count * sizeof(DirKey));
+memcpy(upper.slots, children + mid + 1, (upper.count + 1) * sizeof(int16_t));
+key = keys[mid];
+added = sibling;
+}
+int16_t top = alloc(false);
+if (top < 0) return false;
+nodes[top].count = 1;
+nodes[top].keys[0] = key;
+nodes[top].slots[0] = root;
+nodes[top].slots[1] = added;
+root = top;
+return true;
 }
-};
-class FileManager {
-private:
-VGATerminal& term;
-FileSystem& fs;
-TextEditor* editor;
-int selected;
-int page;
-bool active;
-bool delete_confirm;
-bool rename_mode;
-bool filter_mode;
-bool edit_mode;
-char filter[32];
-char new_name[13];
-int filter_pos;
-uint16_t* screen_backup;
-void backup_screen() {
-if (!screen_backup) {
-screen_backup = (uint16_t*)0x50000;
+public:
+DirIndex() : nodes(0), capacity(0), used(0), released(0), root(-1), head(-1), free_list(-1), entries(0), entry_count(0), probes(0) {}
+void init(DirNode* pool, int count, FileEntry* files, int files_count) {
+nodes = pool;
+capacity = count;
+entries = files;
+entry_count = files_count;
+clear();
 }
-memcpy(screen_backup, vga_buffer, VGA_WIDTH * VGA_HEIGHT * 2);
+
+void clear() {
+used = 0;
+released = 0;
+root = -1;
+head = -1;
+free_list = -1;
 }
 
-void restore_screen() {
-if (screen_backup) {
-memcpy(vga_buffer, screen_backup, VGA_WIDTH * VGA_HEIGHT * 2);
+bool rebuild() {
+clear();
+for (int i = 0; i < entry_count; i++) {
+if (entries[i].used && !place(i)) return false;
 }
+return true;
 }
 
-void draw_ui() {
-term.set_color(0x0F, 0x01);
-term.clear();
-term.draw_box(1, 1, 78, 21, 0x6F);
-term.write_at(5, 2, "File Manager - F3:Exit  ", 0x6F);
-term.write_at(3, 4, "Name  ", 0x6F);
-term.write_at(40, 4, "Size  ", 0x6F);
-term.write_at(60, 4, "Type  ", 0x6F);
-term.fill_rect(3, 6, 74, 14, 0x17, ' ');
-
-int items_per_page = 14;
-int start = page * items_per_page;
-int count = 0;
-int file_count = fs.get_file_count();
-
-for (int i = start; i < file_count && count < items_per_page; i++) {
-FileEntry* file = fs.get_file(i);
-if (!file) continue;
+bool insert(int idx) {
+return place(idx) || rebuild();
+}
 
-if (filter[0] && !strstr(file->name, filter)) continue;
+void remove(int idx) {
+if (root < 0) return;
+int16_t path[DIR_MAX_DEPTH];
+int depth;
+int16_t n = leaf_for(entries[idx].parent, entries[idx].name, path, depth);
+if (remove_from(n, idx)) {
+if (nodes[n].count == 0) drop(n, path, depth);
+return;
+}
+for (int16_t n = head; n >= 0; n = nodes[n].next) {
+if (remove_from(n, idx)) return;
+}
+}
 
-int y = 6 + count;
-uint8_t color = (count == selected) ? 0x70 : 0x0F;
+int find(uint16_t parent, const char* name) {
+if (root < 0) return -1;
+int depth;
+DirNode& node = nodes[leaf_for(parent, name, 0, depth)];
+int at = position(node, parent, name);
+if (at < node.count && compare(parent, name, node.slots[at]) == 0) return node.slots[at];
+return -1;
+}
 
-char line[40];
-strcpy(line, file->name);
-if (file->read_only) strcat(line, " [RO]");
-term.write_at(5, y, line, color);
+void first(DirCursor& cursor) {
+cursor.node = head;
+cursor.slot = 0;
+}
 
-char size_str[16];
-int_to_str(file->size, size_str);
-term.write_at(40, y, size_str, color);
+void seek(uint16_t parent, DirCursor& cursor) {
+cursor.node = -1;
+cursor.slot = 0;
+if (root < 0) return;
+int depth;
+cursor.node = leaf_for(parent, "", 0, depth);
+cursor.slot = position(nodes[cursor.node], parent, "");
+}
 
-const char* ext = strstr(file->name, ".");
-if (ext && (strcmp(ext, ".TXT") == 0 || strcmp(ext, ".txt") == 0)) {
-term.write_at(60, y, "Text  ", color);
-} else if (ext && (strcmp(ext, ".BF") == 0 || strcmp(ext, ".bf") == 0)) {
-term.write_at(60, y, "BF  ", color);
-} else {
-term.write_at(60, y, "File  ", color);
+int next(DirCursor& cursor) {
+while (cursor.node >= 0) {
+DirNode& node = nodes[cursor.node];
+if (cursor.slot < node.count) return node.slots[cursor.slot++];
+cursor.node = node.next;
+cursor.slot = 0;
+}
+return -1;
 }
 
-if (count == selected) term.write_at(3, y, " >", color);
+int get_nodes() { return used - released; }
+uint32_t get_probes() { return probes; }
+};
+struct Extent {
+uint32_t offset;
+uint32_t size;
+};
+class ExtentAllocator {
+private:
+Extent* extents;
+int count;
+int capacity;
+uint32_t total;
+void insert_at(int pos, uint32_t offset, uint32_t size) {
+for (int i = count; i > pos; i--) extents[i] = extents[i - 1];
+extents[pos].offset = offset;
+extents[pos].size = size;
 count++;
 }
 
-char info[32];
-int_to_str(page + 1, info);
-strcat(info, "/");
-int total_pages = (file_count + 13) / 14;
-if (total_pages == 0) total_pages = 1;
-char pages[8];
-int_to_str(total_pages, pages);
-strcat(info, pages);
-term.write_at(3, 20, "Page:  ", 0x0F);
-term.write_at(9, 20, info, 0x0F);
-
-if (delete_confirm) {
-term.write_at(3, 21, "Delete? (Y/N)  ", 0x0C);
-} else if (rename_mode) {
-term.write_at(3, 21, "New name:  ", 0x0E);
-term.write_at(13, 21, new_name, 0x0E);
-term.write_at(13 + strlen(new_name), 21, "_  ", 0x0E);
-} else if (filter_mode) {
-term.write_at(3, 21, "Filter:  ", 0x0E);
-term.write_at(11, 21, filter, 0x0E);
-term.write_at(11 + strlen(filter), 21, "_  ", 0x0E);
-} else {
-term.write_at(3, 21, "j/k:Move Space:Page Enter:Open d:Del r:Rename t:RO /:Filter", 0x0F);
+void remove_at(int pos) {
+for (int i = pos; i < count - 1; i++) extents[i] = extents[i + 1];
+count--;
 }
-term.write_at(50, 20, "Open ", 0x0F);
-term.write_at(59, 20, "Edit ", 0x0F);
-term.write_at(68, 20, "Del ", 0x0F);
+public:
+ExtentAllocator() : extents(0), count(0), capacity(0), total(0) {}
+static uint32_t round(uint32_t size) {
+return (size + FS_ALLOC_UNIT - 1) & ~(FS_ALLOC_UNIT - 1);
 }
 
-void open_selected() {
-FileEntry* file = fs.get_file(selected + page * 14);
-if (!file) return;
-
-backup_screen();
-term.clear();
-term.draw_box(0, 0, 80, 23, 0x6F);
-term.write_at(2, 1, "File:  ", 0x6F);
-term.write_at(8, 1, file->name, 0x6F);
-term.write_at(60, 1, "F10:Exit  ", 0x6F);
+void init(Extent* table, int max, uint32_t size) {
+extents = table;
+capacity = max;
+total = size;
+count = 0;
+insert_at(0, 0, size);
+}
 
-char content[MAX_FILE_SIZE];
-uint32_t size;
-if (fs.load_file(file->name, content, size)) {
-int line = 3;
-int col = 2;
-for (uint32_t i = 0; i < size && line < 22; i++) {
-if (content[i] == '\n') {
-line++;
-col = 2;
-if (line >= 22) break;
-continue;
+bool reserve(uint32_t offset, uint32_t size) {
+if (size == 0) return true;
+for (int i = 0; i < count; i++) {
+Extent& e = extents[i];
+if (offset < e.offset || offset + size > e.offset + e.size) continue;
+uint32_t tail = e.offset + e.size - (offset + size);
+if (offset == e.offset) {
+e.offset += size;
+e.size -= size;
+if (e.size == 0) remove_at(i);
+} else if (tail == 0) {
+e.size -= size;
+} else {
+if (count == capacity) return false;
+e.size = offset - e.offset;
+insert_at(i + 1, offset + size, tail);
 }
-if (col >= 78) {
-line++;
-col = 2;
-if (line >= 22) break;
+return true;
 }
-if (content[i] >= 32 && content[i] <= 126) {
-char ch_str[2] = {content[i], 0};
-term.write_at(col, line, ch_str, 0x0F);
-col++;
+return false;
 }
+
+uint32_t alloc(uint32_t size) {
+if (size == 0) return 0;
+int best = -1;
+for (int i = 0; i < count; i++) {
+if (extents[i].size >= size && (best < 0 || extents[i].size < extents[best].size)) best = i;
 }
+if (best < 0) return FS_NO_SPACE;
+uint32_t offset = extents[best].offset;
+extents[best].offset += size;
+extents[best].size -= size;
+if (extents[best].size == 0) remove_at(best);
+return offset;
 }
 
-while (true) {
-Mouse::update();
-term.update_mouse();
-io_wait();
-if (Keyboard::is_key_pressed()) {
-char c = Keyboard::get_char();
-if (c == (char)0xFA || c == '\n') break;
+void release(uint32_t offset, uint32_t size) {
+if (size == 0) return;
+int pos = 0;
+while (pos < count && extents[pos].offset < offset) pos++;
+bool merge_prev = pos > 0 && extents[pos - 1].offset + extents[pos - 1].size == offset;
+bool merge_next = pos < count && offset + size == extents[pos].offset;
+if (merge_prev && merge_next) {
+extents[pos - 1].size += size + extents[pos].size;
+remove_at(pos);
+} else if (merge_prev) {
+extents[pos - 1].size += size;
+} else if (merge_next) {
+extents[pos].offset = offset;
+extents[pos].size += size;
+} else {
+insert_at(pos, offset, size);
 }
 }
 
-restore_screen();
-draw_ui();
+uint32_t get_free() {
+uint32_t free = 0;
+for (int i = 0; i < count; i++) free += extents[i].size;
+return free;
 }
 
-void edit_selected() {
-FileEntry* file = fs.get_file(selected + page * 14);
-if (!file) return;
-if (file->read_only) {
-term.fill_rect(20, 10, 40, 3, 0x17, ' ');
-term.draw_box(20, 10, 40, 3, 0x2F);
-term.write_at(22, 11, "File is read-only!  ", 0x0C);
-for (int i = 0; i < 300000; i++);
-draw_ui();
-return;
+uint32_t get_largest() {
+uint32_t largest = 0;
+for (int i = 0; i < count; i++) {
+if (extents[i].size > largest) largest = extents[i].size;
 }
-
-if (editor) {
-editor->open(file->name);
-edit_mode = true;
+return largest;
 }
+
+uint32_t get_end() {
+if (count > 0 && extents[count - 1].offset + extents[count - 1].size == total) return extents[count - 1].offset;
+return total;
 }
 
-void toggle_readonly() {
-FileEntry* file = fs.get_file(selected + page * 14);
-if (!file) return;
+bool is_fragmented() {
+return count > 1 || (count == 1 && extents[0].offset + extents[0].size != total);
+}
 
-if (strcmp(file->name, "README.TXT") == 0) {
-term.fill_rect(20, 10, 40, 3, 0x17, ' ');
-term.draw_box(20, 10, 40, 3, 0x2F);
-term.write_at(22, 11, "Cannot change README!  ", 0x0C);
-for (int i = 0; i < 300000; i++);
-draw_ui();
-return;
+int get_count() { return count; }
+const Extent& get(int i) { return extents[i]; }
+};
+struct FileSystemHeader {
+uint32_t magic;
+uint32_t version;
+uint32_t next_free_offset;
+uint32_t file_count;
+uint32_t checkpoint_seq;
+};
+enum FileOpenMode { FILE_READ = 1, FILE_WRITE = 2, FILE_CREATE = 4, FILE_TRUNCATE = 8 };
+struct FileHandle {
+int index;
+uint32_t serial;
+uint32_t position;
+bool writable;
+};
+struct FileView {
+const uint8_t* data;
+uint32_t size;
+int index;
+uint32_t generation;
+};
+struct JournalRecord {
+uint32_t seq;
+uint32_t crc;
+uint16_t index;
+uint16_t reserved;
+FileEntry entry;
+};
+class FileSystem {
+private:
+FileEntry* files;
+uint32_t* generations;
+uint32_t* serials;
+DirIndex index;
+uint16_t cwd;
+int file_count;
+uint8_t* fs_buffer;
+ExtentAllocator extents;
+RWLock lock;
+uint8_t backend;
+TimerCallback compactor;
+uint32_t compact_moves;
+uint64_t compact_bytes;
+TimerCallback checkpointer;
+uint32_t journal_seq;
+int journal_count;
+uint64_t table_dirty;
+uint32_t journal_writes;
+uint32_t checkpoints;
+bool flush(uint32_t offset, uint32_t size) {
+if (backend == FS_RAM || size == 0) return true;
+uint32_t first = offset / 512;
+uint32_t last = (offset + size + 511) / 512;
+if (BlockCache::write(FS_DISK_LBA + first, last - first, fs_buffer + first * 512)) return true;
+klog(LOG_ERROR, "fs: write of %u bytes at 0x%x failed", size, offset);
+return false;
 }
 
-fs.toggle_readonly(file->name);
-draw_ui();
+JournalRecord* journal_record(int n) {
+return (JournalRecord*)(fs_buffer + FS_JOURNAL_OFFSET + (n / FS_JOURNAL_PER_SECTOR) * 512 + (n % FS_JOURNAL_PER_SECTOR) * sizeof(JournalRecord));
 }
-public:
-FileManager(VGATerminal& t, FileSystem& f, TextEditor* e = 0) : term(t), fs(f), editor(e), selected(0), page(0), active(false),
-delete_confirm(false), rename_mode(false), filter_mode(false), edit_mode(false), filter_pos(0) {
-filter[0] = 0;
-new_name[0] = 0;
-screen_backup = 0;
+
+static uint32_t record_crc(JournalRecord* record) {
+uint32_t crc = record->crc;
+record->crc = 0;
+uint32_t result = CRC32::update(0, record, sizeof(JournalRecord));
+record->crc = crc;
+return result;
 }
-void open() {
-active = true;
-edit_mode = false;
-selected = 0;
-page = 0;
-delete_confirm = false;
-rename_mode = false;
-filter_mode = false;
-filter[0] = 0;
-term.set_color(0x0F, 0x01);
-term.clear();
-draw_ui();
+
+void mark_dirty(int idx) {
+uint32_t offset = sizeof(FileSystemHeader) + idx * sizeof(FileEntry);
+table_dirty |= 1ULL << (offset / 512);
+table_dirty |= 1ULL << ((offset + sizeof(FileEntry) - 1) / 512);
 }
 
-void close() { active = false; }
-bool is_active() { return active; }
-bool is_edit_mode() { return edit_mode; }
-void set_edit_mode(bool mode) { edit_mode = mode; }
+void upgrade_v4() {
+for (int i = 0; i < MAX_FILES; i++) {
+FileEntryV4 old;
+memcpy(&old, &files[i], sizeof(old));
+memset(&files[i], 0, sizeof(FileEntry));
+memcpy(files[i].name, old.name, 13);
+files[i].used = old.used;
+files[i].read_only = old.read_only;
+files[i].size = old.size;
+files[i].data_offset = old.data_offset;
+files[i].parent = FS_ROOT;
+mark_dirty(i);
+}
+klog(LOG_INFO, "fs: upgraded version 4 file table, all files moved to /");
+}
 
-void handle_input(char c) {
-if (!active) return;
+int replay_journal() {
+FileSystemHeader* header = (FileSystemHeader*)fs_buffer;
+int n = 0;
+while (n < FS_JOURNAL_RECORDS) {
+JournalRecord* record = journal_record(n);
+if (record->seq != header->checkpoint_seq + 1 + n || record->index >= MAX_FILES) break;
+if (record->crc != record_crc(record)) break;
+memcpy(&files[record->index], &record->entry, sizeof(FileEntry));
+mark_dirty(record->index);
+n++;
+}
+journal_seq = header->checkpoint_seq + 1 + n;
+journal_count = n;
+return n;
+}
 
-if (c == (char)0xF3) {
-close();
+void load_metadata() {
+FileSystemHeader* header = (FileSystemHeader*)fs_buffer;
+files = (FileEntry*)(fs_buffer + sizeof(FileSystemHeader));
+memset(generations, 0, MAX_FILES * sizeof(uint32_t));
+memset(serials, 0, MAX_FILES * sizeof(uint32_t));
+index.init((DirNode*)FS_INDEX, FS_INDEX_NODES, files, MAX_FILES);
+cwd = FS_ROOT;
+file_count = 0;
+extents.init((Extent*)FS_FREE_LIST, MAX_FILES + 2, FS_TOTAL_SIZE - FS_METADATA_SIZE);
+bool upgrade = header->magic == FS_MAGIC && header->version == 4;
+if (header->magic == FS_MAGIC && header->version != FS_VERSION && !upgrade) {
+klog(LOG_ERROR, "fs: disk has version %u, expected %u, left untouched and running from RAM", header->version, FS_VERSION);
+backend = FS_RAM;
+}
+if (!upgrade && (header->magic != FS_MAGIC || header->version != FS_VERSION)) {
+memset(fs_buffer, 0, FS_METADATA_SIZE);
+header->magic = FS_MAGIC;
+header->version = FS_VERSION;
+journal_seq = 1;
+if (!flush(0, FS_METADATA_SIZE)) klog(LOG_ERROR, "fs: format not written to disk");
 return;
 }
-
-if (delete_confirm) {
-if (c == 'y' || c == 'Y') {
-FileEntry* file = fs.get_file(selected + page * 14);
-if (file && !file->read_only) {
-fs.delete_file(file->name);
-if (selected > 0) selected--;
+int replayed = replay_journal();
+bool repaired = false;
+if (upgrade) {
+upgrade_v4();
+repaired = true;
 }
-delete_confirm = false;
-} else if (c == 'n' || c == 'N' || c == (char)0xFA) {
-delete_confirm = false;
+for (int i = 0; i < MAX_FILES; i++) {
+if (!files[i].used) continue;
+if (!extents.reserve(files[i].data_offset, ExtentAllocator::round(files[i].size))) {
+klog(LOG_WARN, "fs: %s overlaps another file, dropped", files[i].name);
+files[i].used = false;
+mark_dirty(i);
+repaired = true;
+continue;
 }
-draw_ui();
-return;
+file_count++;
+}
+for (int i = 0; i < MAX_FILES; i++) {
+if (!files[i].used || files[i].parent == FS_ROOT) continue;
+uint16_t parent = files[i].parent;
+if (parent < MAX_FILES && files[parent].used && files[parent].directory) continue;
+klog(LOG_WARN, "fs: %s lost its directory, moved to /", files[i].name);
+files[i].parent = FS_ROOT;
+mark_dirty(i);
+repaired = true;
+}
+if (!index.rebuild()) klog(LOG_ERROR, "fs: directory index full, some names unreachable");
+if (replayed > 0) klog(LOG_INFO, "fs: replayed %d journal records", replayed);
+if ((replayed > 0 || repaired) && !checkpoint()) klog(LOG_ERROR, "fs: mount checkpoint failed");
+}
+
+bool checkpoint() {
+PROFILE_ZONE("FileSystem::checkpoint");
+TimerWheel::cancel(checkpointer);
+FileSystemHeader* header = (FileSystemHeader*)fs_buffer;
+BlockCache::barrier();
+for (int i = 1; i < 64; i++) {
+if ((table_dirty & (1ULL << i)) && !flush(i * 512, 512)) return false;
+}
+BlockCache::barrier();
+header->magic = FS_MAGIC;
+header->version = FS_VERSION;
+header->next_free_offset = extents.get_end();
+header->file_count = file_count;
+header->checkpoint_seq = journal_seq - 1;
+if (!flush(0, 512)) return false;
+BlockCache::barrier();
+table_dirty = 0;
+journal_count = 0;
+checkpoints++;
+return true;
 }
 
-if (rename_mode) {
-if (c == '\n') {
-FileEntry* file = fs.get_file(selected + page * 14);
-if (file && !file->read_only && new_name[0]) {
-fs.rename_file(file->name, new_name);
+bool save_metadata(int idx) {
+PROFILE_ZONE("FileSystem::save_metadata");
+TRACE_SCOPE("FileSystem::save_metadata");
+if (journal_count == FS_JOURNAL_RECORDS && !checkpoint()) return false;
+mark_dirty(idx);
+JournalRecord* record = journal_record(journal_count);
+record->seq = journal_seq;
+record->index = idx;
+record->reserved = 0;
+memcpy(&record->entry, &files[idx], sizeof(FileEntry));
+record->crc = record_crc(record);
+BlockCache::barrier();
+bool ok = flush(FS_JOURNAL_OFFSET + (journal_count / FS_JOURNAL_PER_SECTOR) * 512, 512);
+journal_seq++;
+journal_count++;
+journal_writes++;
+if (!checkpointer.pending) TimerWheel::start(checkpointer, FS_CHECKPOINT_MS);
+return ok;
+}
+
+static void on_checkpoint(void* arg) {
+FileSystem* fs = (FileSystem*)arg;
+WriteGuard guard(fs->lock);
+if (fs->journal_count > 0) fs->checkpoint();
 }
-rename_mode = false;
-new_name[0] = 0;
-} else if (c == '\b') {
-int len = strlen(new_name);
-if (len > 0) new_name[len - 1] = 0;
-} else if (c >= 32 && c <= 126 && strlen(new_name) < 12) {
-int len = strlen(new_name);
-new_name[len] = c;
-new_name[len + 1] = 0;
-} else if (c == (char)0xFA) {
-rename_mode = false;
-new_name[0] = 0;
+
+int find_free_file() {
+for (int i = 0; i < MAX_FILES; i++) {
+if (!files[i].used) return i;
 }
-draw_ui();
-return;
+return -1;
 }
 
-if (filter_mode) {
-if (c == '\n') {
-filter_mode = false;
-} else if (c == '\b') {
-if (filter_pos > 0) {
-filter_pos--;
-filter[filter_pos] = 0;
+bool step(uint16_t& dir, const char* name) {
+if (name[0] == 0 || strcmp(name, ".") == 0) return true;
+if (strcmp(name, "..") == 0) {
+if (dir != FS_ROOT) dir = files[dir].parent;
+return true;
 }
-} else if (c >= 32 && c <= 126 && filter_pos < 31) {
-filter[filter_pos] = c;
-filter_pos++;
-filter[filter_pos] = 0;
-} else if (c == 'c' || c == 'C') {
-filter[0] = 0;
-filter_pos = 0;
-} else if (c == (char)0xFA) {
-filter_mode = false;
-filter[0] = 0;
-filter_pos = 0;
+int idx = index.find(dir, name);
+if (idx == -1 || !files[idx].directory) return false;
+dir = idx;
+return true;
+}
+
+bool walk(const char* path, uint16_t& dir, char* leaf) {
+dir = cwd;
+if (*path == '/') dir = FS_ROOT;
+while (*path == '/') path++;
+while (true) {
+int len = 0;
+while (*path && *path != '/') {
+if (len == 12) return false;
+leaf[len++] = *path++;
+}
+leaf[len] = 0;
+while (*path == '/') path++;
+if (!*path) return true;
+if (!step(dir, leaf)) return false;
 }
-draw_ui();
-return;
 }
 
-if (c == '\n') {
-open_selected();
-return;
+static bool valid_name(const char* name) {
+return name[0] && strcmp(name, ".") != 0 && strcmp(name, "..") != 0;
 }
 
-if (c == 'e' || c == 'E') {
-edit_selected();
-return;
+bool target(const char* path, uint16_t& dir, char* leaf) {
+return walk(path, dir, leaf) && valid_name(leaf) && index.find(dir, leaf) == -1;
 }
 
-if (c == 't' || c == 'T') {
-toggle_readonly();
-return;
+int find_file(const char* path) {
+PROFILE_ZONE("FileSystem::find_file");
+uint16_t dir;
+char leaf[13];
+if (!walk(path, dir, leaf) || !valid_name(leaf)) return -1;
+return index.find(dir, leaf);
 }
 
-if (c == 'j' || c == 'J') {
-int items_per_page = 14;
-int file_count = fs.get_file_count();
-if (selected < items_per_page - 1 && selected + page * items_per_page < file_count - 1) {
-selected++;
+int find_dir(const char* path) {
+uint16_t dir;
+char leaf[13];
+if (!walk(path, dir, leaf) || !step(dir, leaf)) return -1;
+return dir;
 }
-} else if (c == 'k' || c == 'K') {
-if (selected > 0) selected--;
-} else if (c == ' ') {
-page++;
-if (page * 14 >= fs.get_file_count()) page = 0;
-selected = 0;
-} else if (c == 'd' || c == 'D') {
-FileEntry* file = fs.get_file(selected + page * 14);
-if (file && !file->read_only) delete_confirm = true;
-} else if (c == 'r' || c == 'R') {
-FileEntry* file = fs.get_file(selected + page * 14);
-if (file && !file->read_only) {
-rename_mode = true;
-strncpy(new_name, file->name, 12);
+
+bool inside(uint16_t dir, uint16_t ancestor) {
+for (int depth = 0; dir != FS_ROOT && depth < MAX_FILES; depth++) {
+if (dir == ancestor) return true;
+dir = files[dir].parent;
 }
-} else if (c == '/') {
-filter_mode = true;
-filter_pos = 0;
-filter[0] = 0;
-} else if (c == (char)0x1B) {
-filter[0] = 0;
-filter_pos = 0;
-filter_mode = false;
+return false;
 }
 
-draw_ui();
+int list_dir(uint16_t dir, int start, FileEntry** out, int max) {
+DirCursor cursor;
+index.seek(dir, cursor);
+int count = 0;
+int idx;
+while ((idx = index.next(cursor)) >= 0 && files[idx].parent == dir) {
+if (start > 0) {
+start--;
+continue;
 }
-
-void update() {
-if (!active) return;
-term.update_mouse();
-if (term.is_mouse_clicked(50, 20, 7, 1)) {
-open_selected();
-return;
+if (out) {
+if (count == max) break;
+out[count] = &files[idx];
 }
-if (term.is_mouse_clicked(59, 20, 7, 1)) {
-edit_selected();
-return;
+count++;
 }
-if (term.is_mouse_clicked(68, 20, 7, 1)) {
-FileEntry* file = fs.get_file(selected + page * 14);
-if (file && !file->read_only) delete_confirm = true;
-draw_ui();
-return;
+return count;
 }
-int items_per_page = 14;
-for (int i = 0; i < items_per_page; i++) {
-int y = 6 + i;
-if (term.is_mouse_clicked(5, y, 35, 1)) {
-selected = i;
-open_selected();
-return;
+
+uint32_t allocate(uint32_t size) {
+uint32_t offset = extents.alloc(size);
+if (offset != FS_NO_SPACE || extents.get_free() < size) return offset;
+while (compact_step()) {}
+return extents.alloc(size);
 }
+
+void release(uint32_t offset, uint32_t size) {
+extents.release(offset, size);
+if (!compactor.pending) TimerWheel::start(compactor, FS_COMPACT_MS);
 }
+
+void release(int idx) {
+release(files[idx].data_offset, ExtentAllocator::round(files[idx].size));
+generations[idx]++;
 }
-};
-class BrainfuckIDE {
-private:
-VGATerminal& term;
-FileSystem& fs;
-char code[2048];
-int cursor;
-bool active;
-bool running;
-bool input_mode;
-char input_buffer[256];
-int input_pos;
-int saved_x, saved_y;
-uint8_t saved_color;
-int find_match(const char* prog, int pos, char open, char close, bool forward) {
-int depth = 1;
-while (true) {
-if (forward) pos++; else pos--;
-if (pos < 0 || prog[pos] == 0) return -1;
-if (prog[pos] == open) depth++;
-else if (prog[pos] == close) depth--;
-if (depth == 0) return pos;
+
+bool claim(int idx, uint16_t dir, const char* name, bool read_only) {
+memset(files[idx].name, 0, 13);
+strncpy(files[idx].name, name, 12);
+files[idx].size = 0;
+files[idx].data_offset = 0;
+files[idx].used = true;
+files[idx].read_only = read_only;
+files[idx].directory = false;
+files[idx].parent = dir;
+generations[idx]++;
+serials[idx]++;
+if (!index.insert(idx)) {
+files[idx].used = false;
+index.rebuild();
+return false;
 }
+file_count++;
+return true;
 }
 
-void run_program() {
-running = true;
-input_mode = false;
+bool grow(int idx, uint32_t size, bool keep) {
+FileEntry& file = files[idx];
+uint32_t need = ExtentAllocator::round(size);
+uint32_t have = ExtentAllocator::round(file.size);
+if (need <= have) return true;
+if (have > 0 && extents.reserve(file.data_offset + have, need - have)) return true;
+uint32_t offset = extents.alloc(need);
+if (offset == FS_NO_SPACE) {
+if (extents.get_free() + have < need) return false;
+if (keep) {
+while (compact_step()) {}
+if (have > 0 && extents.reserve(file.data_offset + have, need - have)) return true;
+offset = extents.alloc(need);
+if (offset == FS_NO_SPACE) return false;
+} else {
+release(idx);
+file.used = false;
+offset = allocate(need);
+file.used = true;
+if (offset == FS_NO_SPACE) {
+file.size = 0;
+file.data_offset = 0;
+save_metadata(idx);
+return false;
+}
+file.data_offset = offset;
+return true;
+}
+}
+if (keep && file.size > 0) {
+memcpy(fs_buffer + FS_METADATA_SIZE + offset, fs_buffer + FS_METADATA_SIZE + file.data_offset, file.size);
+if (!flush(FS_METADATA_SIZE + offset, file.size)) {
+extents.release(offset, need);
+return false;
+}
+}
+release(idx);
+file.data_offset = offset;
+return !keep || save_metadata(idx);
+}
 
-term.save_state(saved_x, saved_y, saved_color);
-term.set_color(0x0F, 0x00);
-term.clear();
+bool valid(const FileHandle& handle) {
+return handle.index >= 0 && handle.index < MAX_FILES && files[handle.index].used && serials[handle.index] == handle.serial;
+}
 
-term.write("Brainfuck Program Output\n");
-term.write("========================\n");
-term.write("Press F10 to stop\n\n");
+void bind(FileHandle& handle, int idx, bool writable) {
+handle.index = idx;
+handle.serial = serials[idx];
+handle.position = 0;
+handle.writable = writable;
+}
 
-uint8_t memory[30000];
-for (int i = 0; i < 30000; i++) memory[i] = 0;
-int ptr = 0;
-int pc = 0;
-int steps = 0;
-const int MAX_STEPS = 100000;
+int store(FileHandle& handle, uint32_t offset, const void* buffer, uint32_t length) {
+FileEntry& file = files[handle.index];
+uint32_t end = offset + length;
+if (end < offset || end > FS_TOTAL_SIZE - FS_METADATA_SIZE) return -1;
+uint32_t start = offset;
+bool extended = end > file.size;
+if (extended) {
+if (!grow(handle.index, end, true)) return -1;
+if (offset > file.size) {
+memset(fs_buffer + FS_METADATA_SIZE + file.data_offset + file.size, 0, offset - file.size);
+start = file.size;
+}
+}
+memcpy(fs_buffer + FS_METADATA_SIZE + file.data_offset + offset, buffer, length);
+generations[handle.index]++;
+if (!flush(FS_METADATA_SIZE + file.data_offset + start, end - start)) return -1;
+if (!extended) return length;
+file.size = end;
+return save_metadata(handle.index) ? (int)length : -1;
+}
 
-while (code[pc] && steps < MAX_STEPS && running) {
-char c = code[pc];
-steps++;
+bool compact_step() {
+if (extents.get_count() == 0 || !extents.is_fragmented()) return false;
+Extent hole = extents.get(0);
+int idx = -1;
+int next = -1;
+for (int i = 0; i < MAX_FILES; i++) {
+if (!files[i].used || files[i].size == 0 || files[i].data_offset < hole.offset) continue;
+if (files[i].data_offset == hole.offset + hole.size) next = i;
+if (ExtentAllocator::round(files[i].size) <= hole.size && (idx < 0 || files[i].data_offset > files[idx].data_offset)) idx = i;
+}
+if (idx < 0) idx = next;
+if (idx < 0) return false;
+uint32_t size = ExtentAllocator::round(files[idx].size);
+memmove(fs_buffer + FS_METADATA_SIZE + hole.offset, fs_buffer + FS_METADATA_SIZE + files[idx].data_offset, files[idx].size);
+extents.release(files[idx].data_offset, size);
+extents.reserve(hole.offset, size);
+files[idx].data_offset = hole.offset;
+generations[idx]++;
+if (!flush(FS_METADATA_SIZE + hole.offset, files[idx].size) || !save_metadata(idx)) return false;
+compact_moves++;
+compact_bytes += files[idx].size;
+return true;
+}
 
-switch (c) {
-case '>': ptr = (ptr + 1) % 30000; break;
-case '<': ptr = (ptr == 0) ? 29999 : ptr - 1; break;
-case '+': memory[ptr]++; break;
-case '-': memory[ptr]--; break;
+static void on_compact(void* arg) {
+FileSystem* fs = (FileSystem*)arg;
+if (EventQueue::get_pending() > 0) {
+TimerWheel::start(fs->compactor, FS_COMPACT_MS);
+return;
+}
+WriteGuard guard(fs->lock);
+if (fs->compact_step()) TimerWheel::start(fs->compactor, FS_COMPACT_MS);
+}
+public:
+FileSystem() : files(0), generations((uint32_t*)FS_GENERATIONS), serials((uint32_t*)FS_SERIALS), cwd(FS_ROOT), file_count(0), fs_buffer((uint8_t*)FS_START), lock("filesystem"), backend(FS_RAM), compact_moves(0), compact_bytes(0),
+journal_seq(1), journal_count(0), table_dirty(0), journal_writes(0), checkpoints(0) {
+TimerWheel::setup(compactor, on_compact, this, TIMER_UI);
+TimerWheel::setup(checkpointer, on_checkpoint, this, TIMER_UI);
+uint8_t device = ATA::is_present() ? FS_ATA : Floppy::is_present() ? FS_FLOPPY : FS_RAM;
+BlockCache::init(device);
+if (device != FS_RAM && BlockCache::read(FS_DISK_LBA, FS_TOTAL_SIZE / 512, fs_buffer)) backend = device;
+load_metadata();
+create_default_files();
+}
+void create_default_files() {
+if (find_file("README.TXT") == -1) {
+create_file("README.TXT",
+"EH-DSB v0.01 - Commands\n"
+"==========================\n"
+"help/?       - Show help\n"
+"ls/dir [dir] - List a directory\n"
+"cd [dir]/pwd - Change/show directory\n"
+"mkdir <dir>  - Create directory\n"
+"rmdir <dir>  - Remove empty directory\n"
+"cat <file>   - View file\n"
+"edit <file>  - Edit file\n"
+"rm <file>    - Delete file\n"
+"append <file> <text> - Append a line\n"
+"mv <old> <new> - Rename or move\n"
+"time         - Show time\n"
+"time <cmd>   - Time a command\n"
+"clear/cls    - Clear screen\n"
+"about        - info\n"
+"history      - Command history\n"
+"reboot       - Reboot system\n"
+"echo <text>  - Print text\n"
+"mem          - Memory info\n"
+"compact      - Defragment file data\n"
+"bench mem    - Memory benchmark\n"
+"bench fs     - File name lookup benchmark\n"
+"prof dump|reset - Profile zones\n"
+"perf top|reset  - Sampling profiler\n"
+"latency [reset] - Main loop latency\n"
+"ps           - Threads and CPU time\n"
+"cpus         - Processors and APIC state\n"
+"disk [bench] - ATA disk info/throughput\n"
+"floppy       - Floppy drive and track cache\n"
+"sync         - Write back cached blocks\n"
+"cache [delay <ms>|test] - Block cache stats\n"
+"jobs [crc|bench] - Job system stats/workloads\n"
+"jobs bf <file> [n] - Run a BF program n times\n"
+"jobs crc async - CRC files in the background\n"
+"stress queues - MPSC/SPSC queue stress test\n"
+"quantum <ms> - Set scheduler time slice\n"
+"serial on|off   - Mirror terminal to COM1\n"
+"trace start|stop|dump - Event trace to COM1\n"
+"info         - Information\n"
+"tz <offset>  - Set timezone (-12 to +12)\n", true);
+}
+if (find_file("HELLO.BF") == -1) {
+create_file("HELLO.BF",
+"++++++++++[>+++++++>++++++++++>+++>+<<<<-]>++.>+.+++++++..+++.>++.<<+++++++++++++++.>.+++.------.--------.>+.>.");
+}
+if (find_file("ECHO.BF") == -1) {
+create_file("ECHO.BF", ",[.,]");
+}
+}
+
+bool create_file(const char* name, const char* content, bool read_only = false) {
+TRACE_SCOPE("FileSystem::create_file");
+WriteGuard guard(lock);
+uint16_t dir;
+char leaf[13];
+if (!target(name, dir, leaf)) return false;
+int idx = find_free_file();
+if (idx == -1) return false;
+uint32_t size = content ? strlen(content) : 0;
+uint32_t offset = allocate(ExtentAllocator::round(size));
+if (offset == FS_NO_SPACE) return false;
+if (!claim(idx, dir, leaf, read_only)) {
+release(offset, ExtentAllocator::round(size));
+return false;
+}
+files[idx].size = size;
+files[idx].data_offset = offset;
+
+bool ok = true;
+if (content) {
+memcpy(fs_buffer + FS_METADATA_SIZE + offset, content, size);
+ok = flush(FS_METADATA_SIZE + offset, size);
+}
+
+return save_metadata(idx) && ok;
+}
+
+bool save_file(const char* name, const char* content, uint32_t size) {
+TRACE_SCOPE("FileSystem::save_file");
+WriteGuard guard(lock);
+int idx = find_file(name);
+uint32_t need = ExtentAllocator::round(size);
+if (idx == -1) {
+uint16_t dir;
+char leaf[13];
+if (!target(name, dir, leaf)) return false;
+idx = find_free_file();
+if (idx == -1) return false;
+uint32_t offset = allocate(need);
+if (offset == FS_NO_SPACE) return false;
+if (!claim(idx, dir, leaf, false)) {
+release(offset, need);
+return false;
+}
+files[idx].data_offset = offset;
+} else {
+if (files[idx].read_only || files[idx].directory) return false;
+uint32_t have = ExtentAllocator::round(files[idx].size);
+if (need <= have) {
+release(files[idx].data_offset + need, have - need);
+} else if (!grow(idx, size, false)) {
+return false;
+}
+}
+
+files[idx].size = size;
+generations[idx]++;
+
+memcpy(fs_buffer + FS_METADATA_SIZE + files[idx].data_offset, content, size);
+bool ok = flush(FS_METADATA_SIZE + files[idx].data_offset, size);
+return save_metadata(idx) && ok;
+}
+
+bool load_file(const char* name, char* buffer, uint32_t &size, uint32_t capacity = MAX_FILE_SIZE) {
+TRACE_SCOPE("FileSystem::load_file");
+ReadGuard guard(lock);
+int idx = find_file(name);
+if (idx == -1 || files[idx].directory) return false;
+
+size = files[idx].size;
+if (size > capacity - 1) size = capacity - 1;
+
+memcpy(buffer, fs_buffer + FS_METADATA_SIZE + files[idx].data_offset, size);
+buffer[size] = 0;
+
+return true;
+}
+
+bool open(const char* name, uint8_t mode, FileHandle& handle) {
+TRACE_SCOPE("FileSystem::open");
+handle.index = -1;
+if (!(mode & (FILE_WRITE | FILE_CREATE))) {
+ReadGuard guard(lock);
+int idx = find_file(name);
+if (idx == -1 || files[idx].directory) return false;
+bind(handle, idx, false);
+return true;
+}
+WriteGuard guard(lock);
+int idx = find_file(name);
+if (idx == -1) {
+uint16_t dir;
+char leaf[13];
+if (!(mode & FILE_CREATE) || !target(name, dir, leaf)) return false;
+idx = find_free_file();
+if (idx == -1) return false;
+if (!claim(idx, dir, leaf, false) || !save_metadata(idx)) return false;
+} else if (files[idx].directory || ((mode & FILE_WRITE) && files[idx].read_only)) {
+return false;
+}
+if ((mode & FILE_WRITE) && (mode & FILE_TRUNCATE) && files[idx].size > 0) {
+release(idx);
+files[idx].size = 0;
+files[idx].data_offset = 0;
+if (!save_metadata(idx)) return false;
+}
+bind(handle, idx, (mode & FILE_WRITE) != 0);
+return true;
+}
+
+bool close(FileHandle& handle) {
+handle.index = -1;
+return true;
+}
+
+int read(FileHandle& handle, uint32_t offset, void* buffer, uint32_t length) {
+ReadGuard guard(lock);
+if (!valid(handle)) return -1;
+FileEntry& file = files[handle.index];
+if (offset >= file.size) return 0;
+if (length > file.size - offset) length = file.size - offset;
+memcpy(buffer, fs_buffer + FS_METADATA_SIZE + file.data_offset + offset, length);
+return length;
+}
+
+int read(FileHandle& handle, void* buffer, uint32_t length) {
+int n = read(handle, handle.position, buffer, length);
+if (n > 0) handle.position += n;
+return n;
+}
+
+int write(FileHandle& handle, uint32_t offset, const void* buffer, uint32_t length) {
+TRACE_SCOPE("FileSystem::write");
+WriteGuard guard(lock);
+if (!valid(handle) || !handle.writable) return -1;
+return store(handle, offset, buffer, length);
+}
+
+int write(FileHandle& handle, const void* buffer, uint32_t length) {
+int n = write(handle, handle.position, buffer, length);
+if (n > 0) handle.position += n;
+return n;
+}
+
+int append(FileHandle& handle, const void* buffer, uint32_t length) {
+TRACE_SCOPE("FileSystem::append");
+WriteGuard guard(lock);
+if (!valid(handle) || !handle.writable) return -1;
+uint32_t offset = files[handle.index].size;
+int n = store(handle, offset, buffer, length);
+if (n > 0) handle.position = offset + n;
+return n;
+}
+
+bool seek(FileHandle& handle, uint32_t position) {
+ReadGuard guard(lock);
+if (!valid(handle) || position > files[handle.index].size) return false;
+handle.position = position;
+return true;
+}
+
+uint32_t size(const FileHandle& handle) {
+ReadGuard guard(lock);
+return valid(handle) ? files[handle.index].size : 0;
+}
+
+bool view(const char* name, FileView& out) {
+ReadGuard guard(lock);
+int idx = find_file(name);
+if (idx == -1 || files[idx].directory) return false;
+out.data = fs_buffer + FS_METADATA_SIZE + files[idx].data_offset;
+out.size = files[idx].size;
+out.index = idx;
+out.generation = generations[idx];
+return true;
+}
+
+bool is_current(const FileView& view) {
+return view.index >= 0 && view.index < MAX_FILES && files[view.index].used && generations[view.index] == view.generation;
+}
+
+uint32_t file_size(const char* name) {
+ReadGuard guard(lock);
+int idx = find_file(name);
+return idx == -1 ? 0 : files[idx].size;
+}
+
+bool delete_file(const char* name) {
+TRACE_SCOPE("FileSystem::delete_file");
+WriteGuard guard(lock);
+int idx = find_file(name);
+if (idx == -1) return false;
+if (files[idx].read_only || files[idx].directory) return false;
+
+index.remove(idx);
+release(idx);
+files[idx].used = false;
+serials[idx]++;
+file_count--;
+return save_metadata(idx);
+}
+
+bool rename_file(const char* old_name, const char* new_name) {
+TRACE_SCOPE("FileSystem::rename_file");
+WriteGuard guard(lock);
+int idx = find_file(old_name);
+if (idx == -1) return false;
+if (files[idx].read_only) return false;
+uint16_t dir;
+char leaf[13];
+int into = find_dir(new_name);
+if (into != -1) {
+dir = into;
+strcpy(leaf, files[idx].name);
+if (index.find(dir, leaf) != -1) return false;
+} else if (!target(new_name, dir, leaf)) {
+return false;
+}
+if (files[idx].directory && inside(dir, idx)) return false;
+
+FileEntry old = files[idx];
+index.remove(idx);
+memset(files[idx].name, 0, 13);
+strncpy(files[idx].name, leaf, 12);
+files[idx].parent = dir;
+if (!index.insert(idx)) {
+files[idx] = old;
+index.rebuild();
+return false;
+}
+return save_metadata(idx);
+}
+
+bool make_dir(const char* path) {
+TRACE_SCOPE("FileSystem::make_dir");
+WriteGuard guard(lock);
+uint16_t dir;
+char leaf[13];
+if (!target(path, dir, leaf)) return false;
+int idx = find_free_file();
+if (idx == -1 || !claim(idx, dir, leaf, false)) return false;
+files[idx].directory = true;
+return save_metadata(idx);
+}
+
+bool remove_dir(const char* path) {
+TRACE_SCOPE("FileSystem::remove_dir");
+WriteGuard guard(lock);
+int idx = find_file(path);
+if (idx == -1 || !files[idx].directory || files[idx].read_only) return false;
+if (inside(cwd, idx) || list_dir(idx, 0, 0, 1) > 0) return false;
+
+index.remove(idx);
+files[idx].used = false;
+generations[idx]++;
+serials[idx]++;
+file_count--;
+return save_metadata(idx);
+}
+
+bool change_dir(const char* path) {
+WriteGuard guard(lock);
+int dir = find_dir(path);
+if (dir == -1) return false;
+cwd = dir;
+return true;
+}
+
+void get_cwd(char* out, int size) {
+ReadGuard guard(lock);
+int start = size - 1;
+out[start] = 0;
+uint16_t dir = cwd;
+for (int depth = 0; dir != FS_ROOT && depth < MAX_FILES; depth++) {
+const char* name = files[dir].name;
+int n = strlen(name);
+if (start < n + 1) break;
+start -= n;
+memcpy(out + start, name, n);
+out[--start] = '/';
+dir = files[dir].parent;
+}
+if (dir != FS_ROOT && start >= 3) memcpy(out + (start -= 3), "...", 3);
+if (start == size - 1) out[--start] = '/';
+memmove(out, out + start, size - start);
+}
+
+int list(const char* path, int start, FileEntry** out, int max) {
+ReadGuard guard(lock);
+int dir = find_dir(path);
+return dir == -1 ? -1 : list_dir(dir, start, out, max);
+}
+
+bool toggle_readonly(const char* name) {
+TRACE_SCOPE("FileSystem::toggle_readonly");
+WriteGuard guard(lock);
+int idx = find_file(name);
+if (idx == -1) return false;
+if (files[idx].parent == FS_ROOT && strcmp(files[idx].name, "README.TXT") == 0) return false;
+
+files[idx].read_only = !files[idx].read_only;
+return save_metadata(idx);
+}
+
+bool is_disk_backed() { return backend != FS_RAM; }
+uint8_t get_backend() { return backend; }
+
+int get_file_count() {
+return file_count;
+}
+
+uint32_t get_index_probes() {
+return index.get_probes();
+}
+
+int list_files(FileEntry** out, int max) {
+ReadGuard guard(lock);
+DirCursor cursor;
+index.first(cursor);
+int count = 0;
+int idx;
+while (count < max && (idx = index.next(cursor)) >= 0) out[count++] = &files[idx];
+return count;
+}
+
+uint32_t checksum(const FileEntry* file) {
+ReadGuard guard(lock);
+return file->used ? CRC32::update(0, file_data(file), file->size) : 0;
+}
+
+const uint8_t* file_data(const FileEntry* file) {
+return fs_buffer + FS_METADATA_SIZE + file->data_offset;
+}
+
+uint32_t get_fs_size() {
+uint32_t total = 0;
+for (int i = 0; i < MAX_FILES; i++) {
+if (files[i].used) total += files[i].size;
+}
+return total;
+}
+
+uint32_t get_free_space() {
+return extents.get_free();
+}
+
+uint32_t get_largest_free() {
+return extents.get_largest();
+}
+
+int get_free_extents() {
+return extents.get_count();
+}
+
+uint32_t get_compact_moves() {
+return compact_moves;
+}
+
+uint64_t get_compact_bytes() {
+return compact_bytes;
+}
+
+void compact() {
+WriteGuard guard(lock);
+while (compact_step()) {}
+}
+
+bool sync() {
+bool ok = true;
+{
+WriteGuard guard(lock);
+if (journal_count > 0) ok = checkpoint();
+}
+return BlockCache::sync() && ok;
+}
+
+uint32_t get_journal_writes() {
+return journal_writes;
+}
+
+uint32_t get_checkpoints() {
+return checkpoints;
+}
+
+int get_journal_pending() {
+return journal_count;
+}
+};
+struct WallTime {
+uint16_t year;
+uint8_t month;
+uint8_t day;
+uint8_t hour;
+uint8_t minute;
+uint8_t second;
+};
+class RTC {
+private:
+static uint8_t bcd_to_bin(uint8_t bcd) {
+return (bcd >> 4) * 10 + (bcd & 0x0F);
+}
+static uint8_t read_register(uint8_t reg) {
+outb(0x70, reg);
+return inb(0x71);
+}
+static int timezone_offset;
+static WallTime snapshot;
+static uint64_t snapshot_tsc;
+static SeqLock lock;
+static void read_clock(WallTime& out) {
+uint8_t registerB = read_register(0x0B);
+uint8_t second = read_register(0x00);
+uint8_t minute = read_register(0x02);
+uint8_t hour = read_register(0x04);
+uint8_t day = read_register(0x07);
+uint8_t month = read_register(0x08);
+uint8_t year = read_register(0x09);
+uint8_t century = read_register(0x32);
+bool pm = hour & 0x80;
+hour &= 0x7F;
+if (!(registerB & 0x04)) {
+second = bcd_to_bin(second);
+minute = bcd_to_bin(minute);
+hour = bcd_to_bin(hour);
+day = bcd_to_bin(day);
+month = bcd_to_bin(month);
+year = bcd_to_bin(year);
+century = bcd_to_bin(century);
+}
+if (!(registerB & 0x02)) {
+if (hour == 12) hour = 0;
+if (pm) hour += 12;
+}
+out.second = second;
+out.minute = minute;
+out.hour = hour;
+out.day = day;
+out.month = month;
+out.year = (century ? century : 20) * 100 + year;
+}
+
+static void publish(const WallTime& time) {
+lock.write_begin();
+snapshot = time;
+snapshot_tsc = Clock::cycles();
+lock.write_end();
+}
+
+static void on_irq(InterruptFrame*) {
+if (!(read_register(0x0C) & 0x10)) return;
+WallTime time;
+read_clock(time);
+publish(time);
+}
+public:
+static void init() {
+timezone_offset = 3;
+WallTime first, second;
+do {
+while (read_register(0x0A) & 0x80) {}
+read_clock(first);
+read_clock(second);
+} while (first.second != second.second || first.minute != second.minute || first.hour != second.hour);
+publish(first);
+uint32_t flags = Interrupts::save();
+Interrupts::disable();
+uint8_t registerB = read_register(0x0B);
+outb(0x70, 0x0B);
+outb(0x71, registerB | 0x10);
+read_register(0x0C);
+Interrupts::set_handler(IRQ_BASE + 8, on_irq);
+Interrupts::unmask_irq(8);
+Interrupts::restore(flags);
+}
+static void set_timezone(int offset) {
+if (offset >= -12 && offset <= 12) {
+timezone_offset = offset;
+}
+}
+static int get_timezone() {
+return timezone_offset;
+}
+static void get_utc(WallTime& time, uint32_t& ms) {
+uint64_t tsc;
+uint32_t seq;
+do {
+seq = lock.read_begin();
+time = snapshot;
+tsc = snapshot_tsc;
+} while (lock.read_retry(seq));
+uint64_t elapsed = Clock::cycles_to_ns(Clock::cycles() - tsc) / 1000000;
+ms = elapsed > 999 ? 999 : (uint32_t)elapsed;
+}
+static void get_time(uint8_t& hour, uint8_t& minute, uint8_t& second, uint32_t& ms) {
+WallTime time;
+get_utc(time, ms);
+int temp_hour = (int)time.hour + timezone_offset;
+while (temp_hour >= 24) temp_hour -= 24;
+while (temp_hour < 0) temp_hour += 24;
+hour = (uint8_t)temp_hour;
+minute = time.minute;
+second = time.second;
+}
+static void get_time(uint8_t& hour, uint8_t& minute, uint8_t& second) {
+uint32_t ms;
+get_time(hour, minute, second, ms);
+}
+};
+int RTC::timezone_offset = 3;
+WallTime RTC::snapshot;
+uint64_t RTC::snapshot_tsc = 0;
+SeqLock RTC::lock("rtc");
+class Mouse {
+private:
+static int mouse_x;
+static int mouse_y;
+static bool mouse_left;
+static bool mouse_right;
+static bool mouse_middle;
+static bool mouse_enabled;
+static uint8_t mouse_packet[3];
+static int mouse_byte;
+static int mouse_remainder_x;
+static int mouse_remainder_y;
+static uint8_t mouse_buttons;
+static SeqLock state_lock;
+static void wait_write() {
+Timeout timeout(MOUSE_TIMEOUT_MS);
+while (!timeout.expired()) {
+if ((inb(0x64) & 2) == 0) return;
+io_wait();
+}
+}
+
+static void wait_read() {
+Timeout timeout(MOUSE_TIMEOUT_MS);
+while (!timeout.expired()) {
+if (inb(0x64) & 1) return;
+io_wait();
+}
+}
+
+static void write_mouse(uint8_t value) {
+wait_write();
+outb(0x64, 0xD4);
+wait_write();
+outb(0x60, value);
+for (int i = 0; i < 1000; i++) io_wait();
+}
+
+static bool wait_ack() {
+Timeout timeout(MOUSE_TIMEOUT_MS);
+while (!timeout.expired()) {
+if (inb(0x64) & 1) {
+uint8_t b = inb(0x60);
+if (b == 0xFA) return true;
+if (b == 0xFE) return false;
+}
+io_wait();
+}
+return false;
+}
+
+static void clear_buffer() {
+for (int i = 0; i < 20; i++) {
+if (inb(0x64) & 1) {
+inb(0x60);
+}
+io_wait();
+}
+}
+public:
+static void init() {
+mouse_x = 40;
+mouse_y = 12;
+mouse_left = false;
+mouse_right = false;
+mouse_middle = false;
+mouse_enabled = false;
+mouse_byte = 0;
+mouse_remainder_x = 0;
+mouse_remainder_y = 0;
+mouse_buttons = 0;
+mouse_packet[0] = 0;
+mouse_packet[1] = 0;
+mouse_packet[2] = 0;
+for (int i = 0; i < 10000; i++) io_wait();
+clear_buffer();
+wait_write();
+outb(0x64, 0xA8);
+for (int i = 0; i < 1000; i++) io_wait();
+
+wait_write();
+outb(0x64, 0x20);
+for (int i = 0; i < 1000; i++) io_wait();
+wait_read();
+uint8_t status = inb(0x60);
+for (int i = 0; i < 100; i++) io_wait();
+
+status |= 3;
+
+wait_write();
+outb(0x64, 0x60);
+for (int i = 0; i < 1000; i++) io_wait();
+wait_write();
+outb(0x60, status);
+for (int i = 0; i < 1000; i++) io_wait();
+
+clear_buffer();
+
+write_mouse(0xFF);
+for (int i = 0; i < 50000; i++) io_wait();
+clear_buffer();
+if (inb(0x64) & 1) inb(0x60);
+if (inb(0x64) & 1) inb(0x60);
+
+write_mouse(0xF6);
+if (!wait_ack()) {
+clear_buffer();
+return;
+}
+if (inb(0x64) & 1) inb(0x60);
+
+write_mouse(0xF4);
+if (!wait_ack()) {
+clear_buffer();
+return;
+}
+
+clear_buffer();
+for (int i = 0; i < 10000; i++) io_wait();
+
+mouse_enabled = true;
+Interrupts::set_handler(IRQ_BASE + 12, on_irq);
+Interrupts::unmask_irq(12);
+}
+
+static void handle_packet() {
+if (!mouse_enabled) return;
+
+uint8_t buttons = mouse_packet[0];
+
+if ((buttons & 0x08) == 0) {
+mouse_byte = 0;
+return;
+}
+
+int8_t dx = (int8_t)mouse_packet[1];
+int8_t dy = (int8_t)mouse_packet[2];
+
+if (buttons & 0x10) dx = (int8_t)(dx | 0xC0);
+if (buttons & 0x20) dy = (int8_t)(dy | 0xC0);
+
+mouse_remainder_x += dx;
+mouse_remainder_y += dy;
+
+int move_x = mouse_remainder_x / 4;
+int move_y = mouse_remainder_y / 4;
+
+mouse_remainder_x %= 4;
+mouse_remainder_y %= 4;
+
+state_lock.write_begin();
+mouse_x += move_x;
+mouse_y -= move_y;
+
+if (mouse_x < 0) mouse_x = 0;
+if (mouse_x > 79) mouse_x = 79;
+if (mouse_y < 0) mouse_y = 0;
+if (mouse_y > 24) mouse_y = 24;
+
+mouse_left = (buttons & 1) != 0;
+mouse_right = (buttons & 2) != 0;
+mouse_middle = (buttons & 4) != 0;
+state_lock.write_end();
+
+uint8_t state = buttons & 0x07;
+if (move_x == 0 && move_y == 0 && state == mouse_buttons) return;
+Event event;
+memset(&event, 0, sizeof(event));
+event.type = EVENT_MOUSE;
+event.buttons = state;
+event.pressed = state & ~mouse_buttons;
+event.x = mouse_x;
+event.y = mouse_y;
+mouse_buttons = state;
+EventQueue::push_input(event);
+}
+
+static void update(uint8_t byte) {
+if (!mouse_enabled) return;
+PROFILE_ZONE("Mouse::update");
+
+if (mouse_byte == 0) {
+if ((byte & 0x08) == 0 || (byte & 0xC0) != 0) {
+return;
+}
+}
+
+mouse_packet[mouse_byte] = byte;
+mouse_byte++;
+
+if (mouse_byte >= 3) {
+mouse_byte = 0;
+handle_packet();
+}
+}
+
+static void on_irq(InterruptFrame*) {
+if (inb(0x64) & 1) update(inb(0x60));
+}
+
+static int get_x() { return mouse_x; }
+static int get_y() { return mouse_y; }
+static void get_position(int& x, int& y) {
+uint32_t seq;
+do {
+seq = state_lock.read_begin();
+x = mouse_x;
+y = mouse_y;
+} while (state_lock.read_retry(seq));
+}
+static bool is_left_clicked() { return mouse_left; }
+static bool is_right_clicked() { return mouse_right; }
+static bool is_middle_clicked() { return mouse_middle; }
+static bool is_enabled() { return mouse_enabled; }
+
+static void reset_clicks() {
+mouse_left = false;
+mouse_right = false;
+mouse_middle = false;
+}
+};
+int Mouse::mouse_x = 40;
+int Mouse::mouse_y = 12;
+bool Mouse::mouse_left = false;
+bool Mouse::mouse_right = false;
+bool Mouse::mouse_middle = false;
+bool Mouse::mouse_enabled = false;
+uint8_t Mouse::mouse_packet[3] = {0, 0, 0};
+int Mouse::mouse_byte = 0;
+int Mouse::mouse_remainder_x = 0;
+int Mouse::mouse_remainder_y = 0;
+uint8_t Mouse::mouse_buttons = 0;
+SeqLock Mouse::state_lock("mouse");
+class Keyboard {
+private:
+static bool left_shift, right_shift, caps_lock;
+static void on_irq(InterruptFrame*) {
+uint8_t status = inb(0x64);
+if (!(status & 0x01)) return;
+if (status & 0x20) {
+Mouse::update(inb(0x60));
+return;
+}
+char c = translate(inb(0x60));
+if (!c) return;
+Event event;
+memset(&event, 0, sizeof(event));
+event.type = EVENT_KEY;
+event.key = c;
+EventQueue::push_input(event);
+}
+public:
+static void init() {
+while (inb(0x64) & 0x01) inb(0x60);
+Interrupts::set_handler(IRQ_BASE + 1, on_irq);
+Interrupts::unmask_irq(1);
+}
+static char translate(uint8_t sc) {
+if (sc == 0x2A) { left_shift = true; return 0; }
+if (sc == 0xAA) { left_shift = false; return 0; }
+if (sc == 0x36) { right_shift = true; return 0; }
+if (sc == 0xB6) { right_shift = false; return 0; }
+if (sc == 0x3A) { caps_lock = !caps_lock; return 0; }
+if (sc & 0x80) return 0;
+
+bool is_shifted = (left_shift || right_shift) ^ caps_lock;
+
+static const char normal[58] = {
+0, 0,
+'1','2','3','4','5','6','7','8','9','0','-','=',
+'\b','\t','q','w','e','r','t','y','u','i','o','p','[',']','\n',
+0, 'a','s','d','f','g','h','j','k','l',';','\'','`',
+0, '\\','z','x','c','v','b','n','m',',','.','/',
+0, '*', 0, ' '
+};
+static const char shifted[58] = {
+0, 0,
+'!','@','#','$','%','^','&','*','(',')','_','+',
+'\b','\t','Q','W','E','R','T','Y','U','I','O','P','{','}','\n',
+0, 'A','S','D','F','G','H','J','K','L',':','"','~',
+0, '|','Z','X','C','V','B','N','M','<','>','?',
+0, '*', 0, ' '
+};
+
+if (sc == 0x3B) return (char)0xF1;
+if (sc == 0x3C) return (char)0xF2;
+if (sc == 0x3D) return (char)0xF3;
+if (sc == 0x3E) return (char)0xF4;
+if (sc == 0x3F) return (char)0xF5;
+if (sc == 0x40) return (char)0xF6;
+if (sc == 0x41) return (char)0xF7;
+if (sc == 0x42) return (char)0xF8;
+if (sc == 0x43) return (char)0xF9;
+if (sc == 0x44) return (char)0xFA;
+if (sc == 0x48) return (char)0x10;
+if (sc == 0x50) return (char)0x11;
+
+if (sc < 58) {
+if (is_shifted && shifted[sc]) return shifted[sc];
+return normal[sc];
+}
+return 0;
+}
+};
+bool Keyboard::left_shift = false;
+bool Keyboard::right_shift = false;
+bool Keyboard::caps_lock = false;
+class VGATerminal {
+private:
+uint8_t color;
+int cursor_x, cursor_y;
+int mouse_x, mouse_y;
+bool mouse_visible;
+uint16_t mouse_orig_val;
+int last_mouse_x, last_mouse_y;
+bool mouse_orig_valid;
+bool serial_mirror;
+IrqSpinLock lock;
+void clear_mouse_cursor() {
+if (!mouse_visible || !mouse_orig_valid) return;
+if (last_mouse_x >= 0 && last_mouse_x < VGA_WIDTH &&
+last_mouse_y >= 0 && last_mouse_y < VGA_HEIGHT) {
+vga_buffer[last_mouse_y * VGA_WIDTH + last_mouse_x] = mouse_orig_val;
+}
+mouse_orig_valid = false;
+}
+
+void save_mouse_char() {
+if (!mouse_visible || mouse_x < 0 || mouse_x >= VGA_WIDTH ||
+mouse_y < 0 || mouse_y >= VGA_HEIGHT) return;
+
+int idx = mouse_y * VGA_WIDTH + mouse_x;
+mouse_orig_val = vga_buffer[idx];
+mouse_orig_valid = true;
+
+last_mouse_x = mouse_x;
+last_mouse_y = mouse_y;
+}
+
+void draw_mouse_cursor() {
+if (!mouse_visible) return;
+if (mouse_x < 0 || mouse_x >= VGA_WIDTH ||
+mouse_y < 0 || mouse_y >= VGA_HEIGHT) return;
+
+int idx = mouse_y * VGA_WIDTH + mouse_x;
+vga_buffer[idx] = (0x0F << 8) | 0xDB;
+}
+
+void update_mouse_position() {
+if (!Mouse::is_enabled()) return;
+
+int new_x, new_y;
+Mouse::get_position(new_x, new_y);
+
+if (new_x != mouse_x || new_y != mouse_y) {
+clear_mouse_cursor();
+mouse_x = new_x;
+mouse_y = new_y;
+save_mouse_char();
+draw_mouse_cursor();
+}
+}
+
+void scroll() {
+TRACE_SCOPE("VGATerminal::scroll");
+clear_mouse_cursor();
+memmove(vga_buffer, vga_buffer + VGA_WIDTH, (VGA_HEIGHT - 1) * VGA_WIDTH * 2);
+for (int x = 0; x < VGA_WIDTH; x++) {
+vga_buffer[(VGA_HEIGHT - 1) * VGA_WIDTH + x] = (color << 8) | ' ';
+}
+if (cursor_y > 0) cursor_y--;
+mouse_orig_valid = false;
+save_mouse_char();
+draw_mouse_cursor();
+}
+void put(char c) {
+PROFILE_ZONE("VGATerminal::putchar");
+if (serial_mirror) Serial::putchar(c);
+clear_mouse_cursor();
+if (c == '\n') {
+cursor_x = 0;
+cursor_y++;
+if (cursor_y >= VGA_HEIGHT) scroll();
+} else if (c == '\r') {
+cursor_x = 0;
+} else if (c == '\t') {
+cursor_x = (cursor_x + 8) & ~7;
+} else if (c == '\b') {
+if (cursor_x > 0) {
+cursor_x--;
+vga_buffer[cursor_y * VGA_WIDTH + cursor_x] = (color << 8) | ' ';
+}
+} else if (c >= 32 && c <= 126) {
+if (cursor_x >= VGA_WIDTH) {
+cursor_x = 0;
+cursor_y++;
+if (cursor_y >= VGA_HEIGHT) scroll();
+}
+if (cursor_y < VGA_HEIGHT) {
+vga_buffer[cursor_y * VGA_WIDTH + cursor_x] = (color << 8) | c;
+cursor_x++;
+}
+}
+mouse_orig_valid = false;
+save_mouse_char();
+draw_mouse_cursor();
+}
+
+void draw_text(int x, int y, const char* str, uint8_t text_color) {
+PROFILE_ZONE("VGATerminal::write_at");
+if (x < 0 || x >= VGA_WIDTH || y < 0 || y >= VGA_HEIGHT) return;
+clear_mouse_cursor();
+uint8_t old_color = color;
+color = text_color;
+int pos = 0;
+while (str[pos] && x + pos < VGA_WIDTH) {
+vga_buffer[y * VGA_WIDTH + x + pos] = (color << 8) | str[pos];
+pos++;
+}
+color = old_color;
+mouse_orig_valid = false;
+save_mouse_char();
+draw_mouse_cursor();
+}
+public:
+VGATerminal() : color(0x07), cursor_x(0), cursor_y(0),
+mouse_x(40), mouse_y(12), mouse_visible(true),
+mouse_orig_val(0), last_mouse_x(-1), last_mouse_y(-1),
+mouse_orig_valid(false), serial_mirror(false), lock("terminal") {}
+void set_color(uint8_t fg, uint8_t bg) {
+color = (bg << 4) | fg;
+}
+
+void set_mouse_visible(bool v) {
+mouse_visible = v;
+}
+
+void set_serial_mirror(bool mirror) {
+serial_mirror = mirror;
+}
+
+void clear() {
+LockGuard<IrqSpinLock> guard(lock);
+clear_mouse_cursor();
+TRACE_SCOPE("VGATerminal::clear");
+for (int i = 0; i < VGA_WIDTH * VGA_HEIGHT; i++) {
+vga_buffer[i] = (color << 8) | ' ';
+}
+cursor_x = cursor_y = 0;
+mouse_orig_valid = false;
+last_mouse_x = -1;
+last_mouse_y = -1;
+save_mouse_char();
+draw_mouse_cursor();
+}
+
+void clear_area(int x, int y, int w, int h) {
+LockGuard<IrqSpinLock> guard(lock);
+clear_mouse_cursor();
+for (int row = y; row < y + h && row < VGA_HEIGHT; row++) {
+for (int col = x; col < x + w && col < VGA_WIDTH; col++) {
+vga_buffer[row * VGA_WIDTH + col] = (color << 8) | ' ';
+}
+}
+mouse_orig_valid = false;
+save_mouse_char();
+draw_mouse_cursor();
+}
+
+void putchar(char c) {
+LockGuard<IrqSpinLock> guard(lock);
+put(c);
+}
+
+void write(const char* str) {
+LockGuard<IrqSpinLock> guard(lock);
+for (int i = 0; str[i]; i++) {
+put(str[i]);
+}
+}
+
+void write(const char* str, uint32_t length) {
+LockGuard<IrqSpinLock> guard(lock);
+for (uint32_t i = 0; i < length; i++) {
+put(str[i]);
+}
+}
+
+void write_at(int x, int y, const char* str, uint8_t text_color) {
+LockGuard<IrqSpinLock> guard(lock);
+draw_text(x, y, str, text_color);
+}
+
+void draw_box(int x, int y, int w, int h, uint8_t box_color) {
+if (w < 2 || h < 2) return;
+LockGuard<IrqSpinLock> guard(lock);
+char buf[2] = {0, 0};
+clear_mouse_cursor();
+buf[0] = 0xC9; draw_text(x, y, buf, box_color);
+buf[0] = 0xBB; draw_text(x + w - 1, y, buf, box_color);
+buf[0] = 0xC8; draw_text(x, y + h - 1, buf, box_color);
+buf[0] = 0xBC; draw_text(x + w - 1, y + h - 1, buf, box_color);
+
+for (int i = x + 1; i < x + w - 1; i++) {
+buf[0] = 0xCD; draw_text(i, y, buf, box_color);
+draw_text(i, y + h - 1, buf, box_color);
+}
+for (int i = y + 1; i < y + h - 1; i++) {
+buf[0] = 0xBA; draw_text(x, i, buf, box_color);
+draw_text(x + w - 1, i, buf, box_color);
+}
+save_mouse_char();
+draw_mouse_cursor();
+}
+
+void fill_rect(int x, int y, int w, int h, uint8_t rect_color, char fill_char) {
+TRACE_SCOPE("VGATerminal::fill_rect");
+LockGuard<IrqSpinLock> guard(lock);
+clear_mouse_cursor();
+uint8_t old_color = color;
+color = rect_color;
+for (int row = y; row < y + h && row < VGA_HEIGHT; row++) {
+for (int col = x; col < x + w && col < VGA_WIDTH; col++) {
+vga_buffer[row * VGA_WIDTH + col] = (color << 8) | fill_char;
+}
+}
+color = old_color;
+mouse_orig_valid = false;
+save_mouse_char();
+draw_mouse_cursor();
+}
+
+void set_cursor(int x, int y) {
+if (x >= 0 && x < VGA_WIDTH) cursor_x = x;
+if (y >= 0 && y < VGA_HEIGHT) cursor_y = y;
+}
+
+int get_cursor_x() { return cursor_x; }
+int get_cursor_y() { return cursor_y; }
+
+void save_state(int &x, int &y, uint8_t &c) {
+x = cursor_x;
+y = cursor_y;
+c = color;
+}
+
+void restore_state(int x, int y, uint8_t c) {
+LockGuard<IrqSpinLock> guard(lock);
+clear_mouse_cursor();
+cursor_x = x;
+cursor_y = y;
+color = c;
+mouse_orig_valid = false;
+save_mouse_char();
+draw_mouse_cursor();
+}
+
+void update_mouse() {
+LockGuard<IrqSpinLock> guard(lock);
+update_mouse_position();
+}
+
+bool is_mouse_over(int x, int y, int w, int h) {
+int mx, my;
+Mouse::get_position(mx, my);
+return (mx >= x && mx < x + w && my >= y && my < y + h);
+}
+};
+class App {
+public:
+virtual bool is_active() = 0;
+virtual void on_key(char c) = 0;
+virtual void on_mouse(const Event&) {}
+virtual void on_paint() = 0;
+};
+class SystemMonitor : public App {
+private:
+VGATerminal& term;
+FileSystem& fs;
+bool active;
+bool show_profile;
+bool show_locks;
+TimerCallback refresh;
+static void on_refresh(void* arg) {
+SystemMonitor* monitor = (SystemMonitor*)arg;
+if (monitor->active) monitor->draw_ui();
+}
+
+void draw_locks() {
+term.draw_box(1, 5, 78, 17, 0x2F);
+term.write_at(34, 6, "Lock Contention  ", 0x2F);
+term.write_at(3, 8, "Lock", 0x0E);
+term.write_at(18, 8, "Acquires", 0x0E);
+term.write_at(30, 8, "Contended", 0x0E);
+term.write_at(43, 8, "Spin", 0x0E);
+term.write_at(58, 8, "Max hold", 0x0E);
+
+for (int i = 0; i < Locks::get_count() && i < 12; i++) {
+LockStats* stats = Locks::get(i);
+if (!stats) continue;
+char buffer[24];
+int y = 9 + i;
+term.write_at(3, y, stats->name, 0x0F);
+u64_to_str(stats->acquires, buffer);
+term.write_at(18, y, buffer, 0x0F);
+u64_to_str(stats->contended, buffer);
+term.write_at(30, y, buffer, stats->contended ? 0x0E : 0x0F);
+format_ns(Clock::cycles_to_ns(stats->spin_cycles), buffer);
+term.write_at(43, y, buffer, 0x0F);
+format_ns(Clock::cycles_to_ns(stats->max_hold), buffer);
+term.write_at(58, y, buffer, 0x0F);
+}
+term.write_at(3, 20, "R:Reset counters", 0x07);
+}
+
+void draw_profile() {
+term.draw_box(1, 5, 78, 17, 0x2F);
+term.write_at(36, 6, "Profile  ", 0x2F);
+#ifndef EHDSB_PROFILE
+term.write_at(3, 8, "Profiling disabled (build with PROFILE=1)  ", 0x0E);
+return;
+#endif
+term.write_at(3, 8, "Zone", 0x0E);
+term.write_at(30, 8, "Calls", 0x0E);
+term.write_at(42, 8, "Total", 0x0E);
+term.write_at(56, 8, "Max cycles", 0x0E);
+
+ProfileZone* top[12];
+int count = Profiler::sorted(top, 12);
+for (int i = 0; i < count; i++) {
+char buffer[24];
+int y = 9 + i;
+term.write_at(3, y, top[i]->name, 0x0F);
+u64_to_str(top[i]->calls, buffer);
+term.write_at(30, y, buffer, 0x0F);
+format_ns(Clock::cycles_to_ns(top[i]->total_cycles), buffer);
+term.write_at(42, y, buffer, 0x0F);
+u64_to_str(top[i]->max_cycles, buffer);
+term.write_at(56, y, buffer, 0x0F);
+}
+}
+
+void draw_ui() {
+term.set_color(0x0F, 0x01);
+term.fill_rect(0, 0, 80, 25, 0x01, ' ');
+
+term.draw_box(1, 1, 78, 3, 0x3F);
+term.write_at(30, 2, "SYSTEM MONITOR  ", 0x3F);
+term.write_at(4, 2, "L:Locks  ", 0x3F);
+term.write_at(47, 2, "P:Profile  ", 0x3F);
+term.write_at(60, 2, "F10:Exit  ", 0x3F);
+
+if (show_locks) {
+draw_locks();
+term.fill_rect(2, 23, 3, 1, 0x4F, ' ');
+term.write_at(2, 23, "[X] ", 0x0F);
+return;
+}
+
+if (show_profile) {
+draw_profile();
+term.fill_rect(2, 23, 3, 1, 0x4F, ' ');
+term.write_at(2, 23, "[X] ", 0x0F);
+return;
+}
+
+term.draw_box(1, 5, 38, 8, 0x2F);
+term.write_at(15, 6, "File System  ", 0x2F);
+
+char buffer[32];
+int_to_str(fs.get_file_count(), buffer);
+term.write_at(3, 8, "Files:  ", 0x0F);
+term.write_at(15, 8, buffer, 0x0F);
+
+int_to_str(fs.get_fs_size(), buffer);
+term.write_at(3, 9, "Used:  ", 0x0F);
+term.write_at(15, 9, buffer, 0x0F);
+term.write_at(25, 9, "bytes  ", 0x0F);
+
+int_to_str(fs.get_free_space(), buffer);
+term.write_at(3, 10, "Free:  ", 0x0F);
+term.write_at(15, 10, buffer, 0x0F);
+term.write_at(25, 10, "bytes  ", 0x0F);
+
+term.draw_box(41, 5, 38, 8, 0x2F);
+term.write_at(55, 6, "Memory  ", 0x2F);
+
+term.write_at(43, 8, "Kernel:  ", 0x0F);
+term.write_at(60, 8, "64 KB  ", 0x0F);
+term.write_at(43, 9, "Stack:  ", 0x0F);
+term.write_at(60, 9, "32 KB  ", 0x0F);
+term.write_at(43, 10, "Heap:  ", 0x0F);
+term.write_at(60, 10, "128 KB  ", 0x0F);
+term.write_at(43, 11, "FS:  ", 0x0F);
+term.write_at(60, 11, "256 KB  ", 0x0F);
+
+term.draw_box(1, 14, 78, 8, 0x2F);
+term.write_at(35, 15, "System Status  ", 0x2F);
+
+uint8_t hour, minute, second;
+RTC::get_time(hour, minute, second);
+char time_str[9];
+time_str[0] = '0' + (hour / 10);
+time_str[1] = '0' + (hour % 10);
+time_str[2] = ':';
+time_str[3] = '0' + (minute / 10);
+time_str[4] = '0' + (minute % 10);
+time_str[5] = ':';
+time_str[6] = '0' + (second / 10);
+time_str[7] = '0' + (second % 10);
+time_str[8] = 0;
+
+term.write_at(3, 17, "Current Time:  ", 0x0F);
+term.write_at(25, 17, time_str, 0x0A);
+term.write_at(3, 18, "System:  ", 0x0F);
+term.write_at(25, 18, "EH-DSB v0.01  ", 0x0A);
+int_to_str(TimerWheel::get_pending(), buffer);
+term.write_at(3, 19, "Timers:  ", 0x0F);
+term.write_at(25, 19, buffer, 0x0A);
+int_to_str(BlockCache::get_hit_rate(), buffer);
+strcat(buffer, "%  ");
+term.write_at(3, 20, "Cache hits:  ", 0x0F);
+term.write_at(25, 20, buffer, 0x0A);
+int_to_str(BlockCache::get_writebacks(), buffer);
+term.write_at(41, 20, "Writebacks:  ", 0x0F);
+term.write_at(55, 20, buffer, 0x0A);
+
+term.fill_rect(2, 23, 3, 1, 0x4F, ' ');
+term.write_at(2, 23, "[X] ", 0x0F);
+}
+public:
+SystemMonitor(VGATerminal& t, FileSystem& f) : term(t), fs(f), active(false), show_profile(false), show_locks(false) {
+TimerWheel::setup(refresh, on_refresh, this, TIMER_UI);
+}
+void open() {
+active = true;
+TimerWheel::start(refresh, 1000, 1000);
+term.set_color(0x0F, 0x01);
+term.clear();
+on_paint();
+}
+
+void close() {
+active = false;
+TimerWheel::cancel(refresh);
+}
+
+bool is_active() { return active; }
+
+void on_key(char c) {
+if (!active) return;
+if (c == (char)0xFA) {
+close();
+return;
+}
+if (c == 'p' || c == 'P') {
+show_profile = !show_profile;
+show_locks = false;
+draw_ui();
+}
+if (c == 'l' || c == 'L') {
+show_locks = !show_locks;
+show_profile = false;
+draw_ui();
+}
+if ((c == 'r' || c == 'R') && show_locks) {
+Locks::reset();
+draw_ui();
+}
+}
+
+void on_mouse(const Event& event) {
+if (!active) return;
+TRACE_SCOPE("SystemMonitor::on_mouse");
+if (event.clicked(60, 2, 8, 1)) {
+close();
+return;
+}
+if (event.clicked(47, 2, 9, 1)) {
+show_profile = !show_profile;
+show_locks = false;
+draw_ui();
+return;
+}
+if (event.clicked(4, 2, 7, 1)) {
+show_locks = !show_locks;
+show_profile = false;
+draw_ui();
+return;
+}
+if (event.clicked(2, 23, 3, 1)) {
+close();
+return;
+}
+}
+
+void on_paint() { draw_ui(); }
+};
+class TextEditor : public App {
+private:
+VGATerminal& term;
+FileSystem& fs;
+char buffer[MAX_FILE_SIZE];
+int cursor;
+int cursor_line;
+int cursor_col;
+int scroll_y;
+bool active;
+char current_filename[MAX_PATH];
+bool modified;
+bool truncated;
+bool cursor_shown;
+bool modal;
+TimerCallback autosave;
+TimerCallback blink;
+TimerCallback status;
+static void on_status(void* arg) {
+TextEditor* editor = (TextEditor*)arg;
+if (editor->active && !editor->modal) editor->on_paint();
+}
+
+void show_status(const char* text, uint8_t color) {
+term.write_at(60, 21, text, color);
+TimerWheel::start(status, STATUS_MS);
+}
+
+static void on_autosave(void* arg) {
+TextEditor* editor = (TextEditor*)arg;
+if (!editor->active || !editor->modified || editor->truncated || !editor->current_filename[0]) return;
+if (editor->fs.save_file(editor->current_filename, editor->buffer, strlen(editor->buffer))) {
+editor->modified = false;
+editor->draw_ui();
+editor->term.write_at(60, 21, "Autosaved ", 0x0A);
+} else {
+editor->term.write_at(60, 21, "Autosave failed ", 0x0C);
+}
+}
+
+static void on_blink(void* arg) {
+TextEditor* editor = (TextEditor*)arg;
+if (!editor->active || editor->modal) return;
+editor->cursor_shown = !editor->cursor_shown;
+editor->draw_cursor();
+}
+
+void mark_modified() {
+modified = true;
+if (!autosave.pending) TimerWheel::start(autosave, AUTOSAVE_MS);
+}
+
+void draw_cursor() {
+int disp_line = cursor_line - scroll_y + 4;
+int disp_col = cursor_col + 5;
+if (disp_line < 4 || disp_line >= 20 || disp_col >= 77) return;
+char ch[2] = {'_', 0};
+if (!cursor_shown) ch[0] = buffer[cursor] >= 32 && buffer[cursor] <= 126 ? buffer[cursor] : ' ';
+term.write_at(disp_col, disp_line, ch, 0x0F);
+}
+
+void update_cursor_pos() {
+cursor_line = 0;
+cursor_col = 0;
+for (int i = 0; i < cursor && buffer[i]; i++) {
+if (buffer[i] == '\n') {
+cursor_line++;
+cursor_col = 0;
+} else {
+cursor_col++;
+}
+}
+if (cursor_line < scroll_y) scroll_y = cursor_line;
+if (cursor_line >= scroll_y + 16) scroll_y = cursor_line - 15;
+}
+
+void draw_content() {
+PROFILE_ZONE("TextEditor::draw_content");
+term.fill_rect(3, 4, 74, 16, 0x17, ' ');
+
+int line = scroll_y;
+int screen_line = 4;
+int buf_pos = 0;
+int cur_line = 0;
+
+while (cur_line < scroll_y && buffer[buf_pos]) {
+if (buffer[buf_pos] == '\n') cur_line++;
+buf_pos++;
+}
+
+while (screen_line < 20 && buffer[buf_pos] && line < scroll_y + 16) {
+char num[4];
+int_to_str(line + 1, num);
+if (line + 1 < 10) {
+term.write_at(2, screen_line, "    ", 0x08);
+term.write_at(3, screen_line, num, 0x08);
+} else {
+term.write_at(2, screen_line, num, 0x08);
+}
+
+int col = 5;
+while (buffer[buf_pos] && buffer[buf_pos] != '\n' && screen_line < 20) {
+if (col < 77) {
+if (buffer[buf_pos] >= 32 && buffer[buf_pos] <= 126) {
+char ch[2] = {buffer[buf_pos], 0};
+term.write_at(col, screen_line, ch, 0x0F);
+col++;
+} else if (buffer[buf_pos] == '\t') {
+term.write_at(col, screen_line, "        ", 0x0F);
+col += 8;
+}
+}
+buf_pos++;
+}
+
+if (buffer[buf_pos] == '\n') buf_pos++;
+screen_line++;
+line++;
+}
+
+int disp_line = cursor_line - scroll_y + 4;
+int disp_col = cursor_col + 5;
+if (disp_line >= 4 && disp_line < 20 && disp_col < 77) {
+term.write_at(disp_col, disp_line, "_  ", 0x0F);
+}
+cursor_shown = true;
+
+char info[32];
+int_to_str(cursor_line + 1, info);
+term.write_at(3, 21, "Line:  ", 0x0F);
+term.write_at(9, 21, info, 0x0F);
+term.write_at(15, 21, "Col:  ", 0x0F);
+int_to_str(cursor_col + 1, info);
+term.write_at(20, 21, info, 0x0F);
+if (modified) term.write_at(60, 21, "Modified  ", 0x0E);
+if (truncated) term.write_at(44, 21, "Truncated ", 0x0C);
+}
+public:
+TextEditor(VGATerminal& t, FileSystem& f) : term(t), fs(f), cursor(0), cursor_line(0), cursor_col(0), scroll_y(0), active(false), modified(false), truncated(false), cursor_shown(true), modal(false) {
+current_filename[0] = 0;
+buffer[0] = 0;
+TimerWheel::setup(autosave, on_autosave, this, TIMER_UI);
+TimerWheel::setup(blink, on_blink, this, TIMER_UI);
+TimerWheel::setup(status, on_status, this, TIMER_UI);
+}
+void open(const char* filename = 0) {
+active = true;
+cursor = 0;
+cursor_line = 0;
+cursor_col = 0;
+scroll_y = 0;
+buffer[0] = 0;
+modified = false;
+truncated = false;
+
+if (filename && filename[0]) {
+strncpy(current_filename, filename, MAX_PATH - 1);
+uint32_t size;
+if (fs.load_file(filename, buffer, size)) {
+cursor = size;
+truncated = fs.file_size(filename) > size;
+update_cursor_pos();
+}
+} else {
+current_filename[0] = 0;
+}
+
+term.set_color(0x0F, 0x01);
+term.clear();
+on_paint();
+TimerWheel::start(blink, CURSOR_BLINK_MS, CURSOR_BLINK_MS);
+}
+
+void close() {
+if (modified && current_filename[0]) save_file();
+active = false;
+TimerWheel::cancel(autosave);
+TimerWheel::cancel(blink);
+TimerWheel::cancel(status);
+}
+
+bool is_active() { return active; }
+
+void on_key(char c) {
+if (!active) return;
+
+if (c == (char)0xF1) {
+close();
+return;
+}
+
+if (c == (char)0xF4) {
+save_file();
+return;
+}
+
+if (c == (char)0xF8) {
+if (scroll_y > 0) scroll_y--;
+draw_content();
+return;
+}
+
+if (c == (char)0xF9) {
+scroll_y++;
+draw_content();
+return;
+}
+
+if (c == '\b') {
+if (cursor > 0) {
+cursor--;
+memmove(buffer + cursor, buffer + cursor + 1, strlen(buffer + cursor + 1) + 1);
+mark_modified();
+update_cursor_pos();
+draw_content();
+}
+} else if (c == '\n') {
+if (cursor < MAX_FILE_SIZE - 2) {
+memmove(buffer + cursor + 1, buffer + cursor, strlen(buffer + cursor) + 1);
+buffer[cursor] = '\n';
+cursor++;
+mark_modified();
+update_cursor_pos();
+draw_content();
+}
+} else if (c >= 32 && c <= 126 && cursor < MAX_FILE_SIZE - 2) {
+memmove(buffer + cursor + 1, buffer + cursor, strlen(buffer + cursor) + 1);
+buffer[cursor] = c;
+cursor++;
+mark_modified();
+update_cursor_pos();
+draw_content();
+} else if (c == (char)0xF6) {
+if (cursor_line > 0) {
+int new_cursor = 0;
+int line = 0;
+for (int i = 0; i < cursor && buffer[i]; i++) {
+if (buffer[i] == '\n') line++;
+}
+for (int i = 0; buffer[i] && line > 0; i++) {
+if (buffer[i] == '\n') line--;
+new_cursor = i + 1;
+}
+cursor = new_cursor;
+update_cursor_pos();
+draw_content();
+}
+} else if (c == (char)0xF7) {
+int new_cursor = cursor;
+while (buffer[new_cursor] && buffer[new_cursor] != '\n') new_cursor++;
+if (buffer[new_cursor] == '\n') new_cursor++;
+cursor = new_cursor;
+update_cursor_pos();
+draw_content();
+}
+}
+
+void save_file() {
+if (current_filename[0] == 0) {
+term.fill_rect(20, 10, 40, 5, 0x17, ' ');
+term.draw_box(20, 10, 40, 5, 0x2F);
+term.write_at(22, 11, "Filename:  ", 0x2F);
+term.write_at(22, 12, "  >   ", 0x0F);
+
+char filename[13] = {0};
+int pos = 0;
+modal = true;
+
+while (true) {
+char ch = EventQueue::wait_key();
+if (ch == '\n') {
+filename[pos] = 0;
+modal = false;
+break;
+} else if (ch == '\b') {
+if (pos > 0) {
+pos--;
+term.write_at(24 + pos, 12, "     ", 0x0F);
+}
+} else if (ch >= 32 && ch <= 126 && pos < 12) {
+filename[pos] = ch;
+pos++;
+char ch_str[2] = {ch, 0};
+term.write_at(24 + pos - 1, 12, ch_str, 0x0F);
+} else if (ch == (char)0xFA) {
+modal = false;
+on_paint();
+return;
+}
+}
+
+if (filename[0]) {
+strncpy(current_filename, filename, 12);
+} else {
+on_paint();
+return;
+}
+}
+
+const char* failed = 0;
+if (truncated) {
+failed = "Too large to save";
+} else if (fs.save_file(current_filename, buffer, strlen(buffer))) {
+modified = false;
+} else {
+failed = "Save failed ";
+}
+
+on_paint();
+if (failed) show_status(failed, 0x0C);
+else show_status("Saved!", 0x0A);
+}
+
+void draw_ui() {
+term.set_color(0x0F, 0x01);
+term.draw_box(1, 1, 78, 21, 0x3F);
+
+char title[MAX_PATH + 16];
+if (current_filename[0]) {
+strcpy(title, "Editor - ");
+strcat(title, current_filename);
+} else {
+strcpy(title, "Editor - New File ");
+}
+if (modified) strcat(title, " * ");
+
+term.write_at(5, 2, title, 0x3F);
+term.write_at(45, 2, "F1:Exit F4:Save  ", 0x3F);
+term.write_at(45, 3, "F8:Up F9:Dn  ", 0x3F);
+term.fill_rect(2, 23, 3, 1, 0x4F, ' ');
+term.write_at(2, 23, "[X] ", 0x0F);
+}
+
+void on_mouse(const Event& event) {
+if (!active) return;
+TRACE_SCOPE("TextEditor::on_mouse");
+if (event.clicked(2, 23, 3, 1)) {
+close();
+return;
+}
+}
+
+void on_paint() {
+draw_ui();
+draw_content();
+}
+
+const char* get_current_filename() {
+return current_filename;
+}
+
+bool is_modified() {
+return modified;
+}
+};
+class Calculator : public App {
+private:
+VGATerminal& term;
+char display[16];
+int value;
+char operation;
+int operand;
+bool active;
+bool new_input;
+public:
+Calculator(VGATerminal& t) : term(t), value(0), operation(0), operand(0), active(false), new_input(true) {
+display[0] = '0';
+display[1] = 0;
+}
+void open() {
+active = true;
+value = 0;
+operation = 0;
+operand = 0;
+new_input = true;
+display[0] = '0';
+display[1] = 0;
+term.set_color(0x0F, 0x01);
+term.clear();
+on_paint();
+}
+
+void close() { active = false; }
+bool is_active() { return active; }
+
+void on_key(char c) {
+if (!active) return;
+
+if (c == (char)0xF2) {
+close();
+return;
+}
+
+if (c == 'c' || c == 'C') {
+value = 0;
+operand = 0;
+operation = 0;
+new_input = true;
+display[0] = '0';
+display[1] = 0;
+} else if (c >= '0' && c <= '9') {
+if (new_input || (display[0] == '0' && display[1] == 0)) {
+display[0] = c;
+display[1] = 0;
+new_input = false;
+} else {
+int len = strlen(display);
+if (len < 14) {
+display[len] = c;
+display[len + 1] = 0;
+}
+}
+value = 0;
+for (int i = 0; display[i]; i++) {
+value = value * 10 + (display[i] - '0');
+}
+} else if (c == '+' || c == '-' || c == '*' || c == '/') {
+if (operation != 0) calculate();
+operation = c;
+operand = value;
+new_input = true;
+} else if (c == '=' || c == '\n') {
+calculate();
+operation = 0;
+new_input = true;
+}
+draw_display();
+draw_buttons();
+}
+
+void calculate() {
+switch (operation) {
+case '+': value = operand + value; break;
+case '-': value = operand - value; break;
+case '*': value = operand * value; break;
+case '/': if (value != 0) value = operand / value; break;
+}
+int_to_str(value, display);
+}
+
+void draw_ui() {
+term.draw_box(10, 5, 60, 15, 0x2F);
+term.write_at(15, 6, "Calculator - F2:Exit  ", 0x2F);
+draw_display();
+draw_buttons();
+term.fill_rect(11, 23, 3, 1, 0x4F, ' ');
+term.write_at(11, 23, "[X] ", 0x0F);
+}
+
+void draw_display() {
+term.fill_rect(12, 8, 56, 3, 0x70, ' ');
+term.write_at(13, 9, display, 0x0F);
+}
+
+void draw_buttons() {
+const char* buttons = "789/456*123-0C=+";
+for (int row = 0; row < 4; row++) {
+for (int col = 0; col < 4; col++) {
+int x = 12 + col * 14;
+int y = 12 + row * 2;
+term.draw_box(x, y, 12, 1, 0x70);
+char button[2] = {buttons[row * 4 + col], 0};
+term.write_at(x + 5, y, button, 0x0F);
+}
+}
+}
+
+void on_mouse(const Event& event) {
+if (!active) return;
+TRACE_SCOPE("Calculator::on_mouse");
+if (event.clicked(11, 23, 3, 1)) {
+close();
+return;
+}
+for (int row = 0; row < 4; row++) {
+for (int col = 0; col < 4; col++) {
+int x = 12 + col * 14;
+int y = 12 + row * 2;
+if (event.clicked(x, y, 12, 1)) {
+const char* buttons = "789/456*123-0C=+";
+char c = buttons[row * 4 + col];
+on_key(c);
+return;
+}
+}
+}
+}
+
+void on_paint() { draw_ui(); }
+};
+class FileManager : public App {
+private:
+VGATerminal& term;
+FileSystem& fs;
+TextEditor* editor;
+int selected;
+int page;
+bool active;
+bool delete_confirm;
+bool rename_mode;
+bool mkdir_mode;
+bool filter_mode;
+bool edit_mode;
+char filter[32];
+char new_name[13];
+int filter_pos;
+uint16_t* screen_backup;
+bool modal;
+TimerCallback notice;
+static void on_notice(void* arg) {
+FileManager* manager = (FileManager*)arg;
+if (manager->active && !manager->modal) manager->draw_ui();
+}
+
+void show_notice(const char* text) {
+term.fill_rect(20, 10, 40, 3, 0x17, ' ');
+term.draw_box(20, 10, 40, 3, 0x2F);
+term.write_at(22, 11, text, 0x0C);
+TimerWheel::start(notice, STATUS_MS);
+}
+
+int list_visible(int start, FileEntry** out, int max, int* total) {
+FileEntry* chunk[32];
+int matched = 0;
+int filled = 0;
+for (int offset = 0;; offset += 32) {
+int n = fs.list(".", offset, chunk, 32);
+for (int i = 0; i < n; i++) {
+if (filter[0] && !strstr(chunk[i]->name, filter)) continue;
+if (matched >= start && filled < max) out[filled++] = chunk[i];
+matched++;
+}
+if (n < 32 || (!total && filled == max)) break;
+}
+if (total) *total = matched;
+return filled;
+}
+
+FileEntry* selected_file() {
+FileEntry* file;
+return list_visible(selected + page * 14, &file, 1, 0) == 1 ? file : 0;
+}
+
+int visible_count() {
+int total;
+list_visible(0, 0, 0, &total);
+return total;
+}
+
+void backup_screen() {
+if (!screen_backup) {
+screen_backup = (uint16_t*)SCREEN_BACKUP;
+}
+memcpy(screen_backup, vga_buffer, VGA_WIDTH * VGA_HEIGHT * 2);
+}
+
+void restore_screen() {
+if (screen_backup) {
+memcpy(vga_buffer, screen_backup, VGA_WIDTH * VGA_HEIGHT * 2);
+}
+}
+
+void draw_ui() {
+term.set_color(0x0F, 0x01);
+term.clear();
+term.draw_box(1, 1, 78, 21, 0x6F);
+term.write_at(5, 2, "File Manager - F3:Exit  ", 0x6F);
+char path[MAX_PATH];
+fs.get_cwd(path, 44);
+term.write_at(32, 2, path, 0x6F);
+term.write_at(3, 4, "Name  ", 0x6F);
+term.write_at(40, 4, "Size  ", 0x6F);
+term.write_at(60, 4, "Type  ", 0x6F);
+term.fill_rect(3, 6, 74, 14, 0x17, ' ');
+
+int items_per_page = 14;
+int count = 0;
+int file_count;
+FileEntry* entries[14];
+int fetched = list_visible(page * items_per_page, entries, items_per_page, &file_count);
+
+for (int i = 0; i < fetched; i++) {
+FileEntry* file = entries[i];
+
+int y = 6 + count;
+uint8_t color = (count == selected) ? 0x70 : 0x0F;
+
+char line[40];
+strcpy(line, file->name);
+if (file->read_only) strcat(line, " [RO]");
+term.write_at(5, y, line, color);
+
+char size_str[16];
+int_to_str(file->size, size_str);
+if (!file->directory) term.write_at(40, y, size_str, color);
+
+const char* ext = strstr(file->name, ".");
+if (file->directory) {
+term.write_at(60, y, "Dir  ", color);
+} else if (ext && (strcmp(ext, ".TXT") == 0 || strcmp(ext, ".txt") == 0)) {
+term.write_at(60, y, "Text  ", color);
+} else if (ext && (strcmp(ext, ".BF") == 0 || strcmp(ext, ".bf") == 0)) {
+term.write_at(60, y, "BF  ", color);
+} else {
+term.write_at(60, y, "File  ", color);
+}
+
+if (count == selected) term.write_at(3, y, " >", color);
+count++;
+}
+
+char info[32];
+int_to_str(page + 1, info);
+strcat(info, "/");
+int total_pages = (file_count + 13) / 14;
+if (total_pages == 0) total_pages = 1;
+char pages[8];
+int_to_str(total_pages, pages);
+strcat(info, pages);
+term.write_at(3, 20, "Page:  ", 0x0F);
+term.write_at(9, 20, info, 0x0F);
+
+if (delete_confirm) {
+term.write_at(3, 21, "Delete? (Y/N)  ", 0x0C);
+} else if (rename_mode || mkdir_mode) {
+term.write_at(3, 21, rename_mode ? "New name:  " : "Dir name:  ", 0x0E);
+term.write_at(13, 21, new_name, 0x0E);
+term.write_at(13 + strlen(new_name), 21, "_  ", 0x0E);
+} else if (filter_mode) {
+term.write_at(3, 21, "Filter:  ", 0x0E);
+term.write_at(11, 21, filter, 0x0E);
+term.write_at(11 + strlen(filter), 21, "_  ", 0x0E);
+} else {
+term.write_at(3, 21, "j/k:Move Space:Page Enter:Open d:Del r:Rename t:RO /:Filter n:Dir Bksp:Up", 0x0F);
+}
+term.write_at(50, 20, "Open ", 0x0F);
+term.write_at(59, 20, "Edit ", 0x0F);
+term.write_at(68, 20, "Del ", 0x0F);
+}
+
+void enter_dir(const char* path) {
+if (fs.change_dir(path)) {
+selected = 0;
+page = 0;
+}
+draw_ui();
+}
+
+void open_selected() {
+FileEntry* file = selected_file();
+if (!file) return;
+if (file->directory) {
+enter_dir(file->name);
+return;
+}
+
+TimerWheel::cancel(notice);
+modal = true;
+backup_screen();
+term.clear();
+term.draw_box(0, 0, 80, 23, 0x6F);
+term.write_at(2, 1, "File:  ", 0x6F);
+term.write_at(8, 1, file->name, 0x6F);
+term.write_at(60, 1, "F10:Exit  ", 0x6F);
+
+FileView view;
+if (fs.view(file->name, view)) {
+int line = 3;
+int col = 2;
+for (uint32_t i = 0; i < view.size && line < 22; i++) {
+char c = view.data[i];
+if (c == '\n') {
+line++;
+col = 2;
+continue;
+}
+if (col >= 78) {
+line++;
+col = 2;
+if (line >= 22) break;
+}
+if (c >= 32 && c <= 126) {
+char ch_str[2] = {c, 0};
+term.write_at(col, line, ch_str, 0x0F);
+col++;
+}
+}
+}
+
+Event event;
+while (true) {
+EventQueue::wait(event);
+if (event.type == EVENT_KEY && (event.key == (char)0xFA || event.key == '\n')) break;
+}
+
+modal = false;
+restore_screen();
+draw_ui();
+}
+
+void edit_selected() {
+FileEntry* file = selected_file();
+if (!file || file->directory) return;
+if (file->read_only) {
+show_notice("File is read-only!");
+return;
+}
+
+if (editor) {
+editor->open(file->name);
+edit_mode = true;
+}
+}
+
+void toggle_readonly() {
+FileEntry* file = selected_file();
+if (!file) return;
+
+if (strcmp(file->name, "README.TXT") == 0) {
+show_notice("Cannot change README!");
+return;
+}
+
+fs.toggle_readonly(file->name);
+draw_ui();
+}
+public:
+FileManager(VGATerminal& t, FileSystem& f, TextEditor* e = 0) : term(t), fs(f), editor(e), selected(0), page(0), active(false),
+delete_confirm(false), rename_mode(false), mkdir_mode(false), filter_mode(false), edit_mode(false), filter_pos(0), modal(false) {
+filter[0] = 0;
+new_name[0] = 0;
+screen_backup = 0;
+TimerWheel::setup(notice, on_notice, this, TIMER_UI);
+}
+void open() {
+active = true;
+edit_mode = false;
+selected = 0;
+page = 0;
+delete_confirm = false;
+rename_mode = false;
+mkdir_mode = false;
+filter_mode = false;
+filter[0] = 0;
+term.set_color(0x0F, 0x01);
+term.clear();
+on_paint();
+}
+
+void close() {
+active = false;
+TimerWheel::cancel(notice);
+}
+
+bool is_active() { return active; }
+bool is_edit_mode() { return edit_mode; }
+void set_edit_mode(bool mode) { edit_mode = mode; }
+
+void on_key(char c) {
+if (!active) return;
+
+if (c == (char)0xF3) {
+close();
+return;
+}
+
+if (delete_confirm) {
+if (c == 'y' || c == 'Y') {
+FileEntry* file = selected_file();
+if (file && !file->read_only && (file->directory ? fs.remove_dir(file->name) : fs.delete_file(file->name))) {
+if (selected > 0) selected--;
+}
+delete_confirm = false;
+} else if (c == 'n' || c == 'N' || c == (char)0xFA) {
+delete_confirm = false;
+}
+draw_ui();
+return;
+}
+
+if (rename_mode || mkdir_mode) {
+if (c == '\n') {
+FileEntry* file = selected_file();
+if (mkdir_mode && new_name[0]) {
+fs.make_dir(new_name);
+} else if (rename_mode && file && !file->read_only && new_name[0]) {
+fs.rename_file(file->name, new_name);
+}
+rename_mode = false;
+mkdir_mode = false;
+new_name[0] = 0;
+} else if (c == '\b') {
+int len = strlen(new_name);
+if (len > 0) new_name[len - 1] = 0;
+} else if (c >= 32 && c <= 126 && strlen(new_name) < 12) {
+int len = strlen(new_name);
+new_name[len] = c;
+new_name[len + 1] = 0;
+} else if (c == (char)0xFA) {
+rename_mode = false;
+mkdir_mode = false;
+new_name[0] = 0;
+}
+draw_ui();
+return;
+}
+
+if (filter_mode) {
+if (c == '\n') {
+filter_mode = false;
+} else if (c == '\b') {
+if (filter_pos > 0) {
+filter_pos--;
+filter[filter_pos] = 0;
+}
+} else if (c >= 32 && c <= 126 && filter_pos < 31) {
+filter[filter_pos] = c;
+filter_pos++;
+filter[filter_pos] = 0;
+} else if (c == 'c' || c == 'C') {
+filter[0] = 0;
+filter_pos = 0;
+} else if (c == (char)0xFA) {
+filter_mode = false;
+filter[0] = 0;
+filter_pos = 0;
+}
+selected = 0;
+page = 0;
+draw_ui();
+return;
+}
+
+if (c == '\n') {
+open_selected();
+return;
+}
+
+if (c == 'e' || c == 'E') {
+edit_selected();
+return;
+}
+
+if (c == 't' || c == 'T') {
+toggle_readonly();
+return;
+}
+
+if (c == '\b') {
+enter_dir("..");
+return;
+}
+
+if (c == 'j' || c == 'J') {
+int items_per_page = 14;
+int file_count = visible_count();
+if (selected < items_per_page - 1 && selected + page * items_per_page < file_count - 1) {
+selected++;
+}
+} else if (c == 'k' || c == 'K') {
+if (selected > 0) selected--;
+} else if (c == ' ') {
+page++;
+if (page * 14 >= visible_count()) page = 0;
+selected = 0;
+} else if (c == 'd' || c == 'D') {
+FileEntry* file = selected_file();
+if (file && !file->read_only) delete_confirm = true;
+} else if (c == 'r' || c == 'R') {
+FileEntry* file = selected_file();
+if (file && !file->read_only) {
+rename_mode = true;
+strncpy(new_name, file->name, 12);
+}
+} else if (c == 'n' || c == 'N') {
+mkdir_mode = true;
+new_name[0] = 0;
+} else if (c == '/') {
+filter_mode = true;
+filter_pos = 0;
+filter[0] = 0;
+} else if (c == (char)0x1B) {
+filter[0] = 0;
+filter_pos = 0;
+filter_mode = false;
+selected = 0;
+page = 0;
+}
+
+draw_ui();
+}
+
+void on_mouse(const Event& event) {
+if (!active) return;
+TRACE_SCOPE("FileManager::on_mouse");
+if (event.clicked(50, 20, 7, 1)) {
+open_selected();
+return;
+}
+if (event.clicked(59, 20, 7, 1)) {
+edit_selected();
+return;
+}
+if (event.clicked(68, 20, 7, 1)) {
+FileEntry* file = selected_file();
+if (file && !file->read_only) delete_confirm = true;
+draw_ui();
+return;
+}
+int items_per_page = 14;
+for (int i = 0; i < items_per_page; i++) {
+int y = 6 + i;
+if (event.clicked(5, y, 35, 1)) {
+selected = i;
+open_selected();
+return;
+}
+}
+}
+
+void on_paint() { draw_ui(); }
+};
+enum BfState { BF_IDLE, BF_RUNNING, BF_STOPPING, BF_FINISHED };
+class BrainfuckIDE : public App {
+private:
+VGATerminal& term;
+FileSystem& fs;
+char code[2048];
+int cursor;
+bool active;
+volatile uint8_t state;
+int thread;
+bool modal;
+volatile bool input_mode;
+char input_buffer[256];
+int input_pos;
+int input_len;
+WaitQueue input_queue;
+int saved_x, saved_y;
+uint8_t saved_color;
+int find_match(const char* prog, int pos, char open, char close, bool forward) {
+int depth = 1;
+while (true) {
+if (forward) pos++; else pos--;
+if (pos < 0 || prog[pos] == 0) return -1;
+if (prog[pos] == open) depth++;
+else if (prog[pos] == close) depth--;
+if (depth == 0) return pos;
+}
+}
+
+bool read_input() {
+uint32_t flags = Interrupts::save();
+input_len = 0;
+input_mode = true;
+term.write("\n[Input] ");
+while (input_mode && state == BF_RUNNING) Scheduler::wait(input_queue);
+Interrupts::restore(flags);
+return state == BF_RUNNING;
+}
+
+static void program_thread(void* arg) {
+((BrainfuckIDE*)arg)->execute();
+}
+
+bool thread_alive() {
+if (thread < 0) return false;
+uint8_t thread_state = Scheduler::get_thread(thread).state;
+return thread_state != THREAD_FREE && thread_state != THREAD_DEAD;
+}
+
+void execute() {
+PROFILE_ZONE("BrainfuckIDE::run_program");
+uint8_t memory[30000];
+for (int i = 0; i < 30000; i++) memory[i] = 0;
+int ptr = 0;
+int pc = 0;
+uint32_t steps = 0;
+const uint32_t MAX_STEPS = 50000000;
+
+while (code[pc] && steps < MAX_STEPS && state == BF_RUNNING) {
+char c = code[pc];
+steps++;
+
+switch (c) {
+case '>': ptr = (ptr + 1) % 30000; break;
+case '<': ptr = (ptr == 0) ? 29999 : ptr - 1; break;
+case '+': memory[ptr]++; break;
+case '-': memory[ptr]--; break;
 case '.':
 if (memory[ptr] >= 32 && memory[ptr] <= 126) {
 term.putchar(memory[ptr]);
 } else if (memory[ptr] == 10) {
 term.putchar('\n');
 }
-break;
-case ',':
-if (!input_mode) {
-input_mode = true;
-input_pos = 0;
-term.write("\n[Input] ");
-return;
+break;
+case ',':
+if (input_buffer[input_pos] == 0) {
+if (!read_input()) break;
+input_pos = 0;
+}
+memory[ptr] = input_buffer[input_pos++];
+break;
+case '[':
+if (memory[ptr] == 0) {
+int match = find_match(code, pc, '[', ']', true);
+if (match == -1) {
+term.write("\nError: Unmatched [ ");
+state = BF_STOPPING;
+break;
+}
+pc = match;
+}
+break;
+case ']':
+if (memory[ptr] != 0) {
+int match = find_match(code, pc, ']', '[', false);
+if (match == -1) {
+term.write("\nError: Unmatched ] ");
+state = BF_STOPPING;
+break;
+}
+pc = match;
+}
+break;
+}
+pc++;
+}
+
+if (steps >= MAX_STEPS) {
+term.write("\n\nProgram stopped: too many steps ");
+} else if (state == BF_RUNNING) {
+term.write("\n\nProgram finished ");
+} else {
+term.write("\n\nProgram stopped ");
+}
+term.write("\n\nPress any key to return to editor ");
+state = BF_FINISHED;
+}
+
+void run_program() {
+state = BF_RUNNING;
+input_mode = false;
+input_pos = 0;
+input_buffer[0] = 0;
+
+term.save_state(saved_x, saved_y, saved_color);
+term.set_color(0x0F, 0x00);
+term.clear();
+
+term.write("Brainfuck Program Output\n");
+term.write("========================\n");
+term.write("Press F10 to stop\n\n");
+
+thread = Scheduler::spawn("bf", program_thread, this, PRIO_NORMAL);
+if (thread < 0) {
+term.write("No free thread ");
+term.write("\n\nPress any key to return to editor ");
+state = BF_FINISHED;
+}
+}
+
+void on_running_key(char c) {
+if (state == BF_FINISHED) {
+state = BF_IDLE;
+term.restore_state(saved_x, saved_y, saved_color);
+draw_editor();
+return;
+}
+if (state != BF_RUNNING) return;
+if (c == (char)0xFA) {
+state = BF_STOPPING;
+input_mode = false;
+Scheduler::wake_all(input_queue);
+return;
+}
+if (!input_mode) return;
+if (c == '\n') {
+input_buffer[input_len++] = '\n';
+input_buffer[input_len] = 0;
+term.write("\n");
+input_mode = false;
+Scheduler::wake_all(input_queue);
+} else if (c == '\b') {
+if (input_len > 0) {
+input_len--;
+term.write("\b \b");
+}
+} else if (c >= 32 && c <= 126 && input_len < 254) {
+input_buffer[input_len++] = c;
+term.putchar(c);
+}
+}
+
+void draw_editor() {
+term.set_color(0x0F, 0x01);
+term.clear();
+
+term.draw_box(0, 0, 80, 3, 0x4F);
+term.write_at(2, 1, "Brainfuck IDE ", 0x4F);
+term.write_at(30, 1, "F5:Run F7:Save F8:Load F9:Examples F10:Exit ", 0x4F);
+
+term.draw_box(0, 3, 80, 18, 0x3F);
+term.fill_rect(1, 4, 78, 16, 0x17, ' ');
+
+int line = 4;
+int col = 1;
+for (int i = 0; code[i] && line < 20; i++) {
+if (code[i] == '\n') {
+line++;
+col = 1;
+continue;
+}
+if (col >= 79) {
+line++;
+col = 1;
+continue;
+}
+if (code[i] >= 32 && code[i] <= 126) {
+char ch[2] = {code[i], 0};
+term.write_at(col, line, ch, 0x0F);
+col++;
+}
+}
+
+int cursor_line = 4;
+int cursor_col = 1;
+for (int i = 0; i < cursor && code[i]; i++) {
+if (code[i] == '\n') {
+cursor_line++;
+cursor_col = 1;
+} else {
+cursor_col++;
+if (cursor_col >= 79) {
+cursor_line++;
+cursor_col = 1;
+}
+}
+}
+if (cursor_line < 20 && cursor_col < 79) {
+term.write_at(cursor_col, cursor_line, "_ ", 0x0E);
+}
+
+char info[32];
+int_to_str(strlen(code), info);
+term.write_at(2, 21, "Length: ", 0x0F);
+term.write_at(10, 21, info, 0x0F);
+term.write_at(2, 22, "F5:Run F7:Save F8:Load F9:Examples F10:Exit ", 0x70);
+}
+
+bool load_code(const char* name) {
+FileView view;
+if (!fs.view(name, view)) return false;
+uint32_t size = view.size < sizeof(code) - 1 ? view.size : sizeof(code) - 1;
+memcpy(code, view.data, size);
+code[size] = 0;
+cursor = strlen(code);
+return true;
+}
+
+void load_example(int num) {
+if (num == 1) load_code("HELLO.BF");
+else if (num == 2) load_code("ECHO.BF");
+draw_editor();
+}
+public:
+BrainfuckIDE(VGATerminal& t, FileSystem& f) : term(t), fs(f), cursor(0), active(false), state(BF_IDLE), thread(-1), modal(false), input_mode(false),
+input_pos(0), input_len(0) {
+code[0] = 0;
+input_queue.head = -1;
+input_queue.tail = -1;
+}
+void open() {
+active = true;
+input_mode = false;
+cursor = 0;
+code[0] = 0;
+draw_editor();
+}
+
+void close() { active = false; }
+bool is_active() { return active; }
+bool is_running() { return state != BF_IDLE; }
+
+void on_paint() {
+if (state == BF_IDLE && !modal) draw_editor();
+}
+
+void on_key(char c) {
+if (!active) return;
+
+if (state != BF_IDLE) {
+on_running_key(c);
+return;
+}
+
+if (c == (char)0xFA) {
+close();
+return;
+}
+
+if (c == (char)0xF5) {
+if (code[0] != 0 && !thread_alive()) {
+run_program();
+}
+return;
+}
+
+if (c == (char)0xF7) {
+if (fs.save_file("PROGRAM.BF", code, strlen(code))) {
+term.write_at(2, 21, "Saved! ", 0x0A);
+} else {
+term.write_at(2, 21, "Save failed! ", 0x0C);
+}
+return;
+}
+
+if (c == (char)0xF8) {
+if (load_code("PROGRAM.BF")) {
+term.write_at(2, 21, "Loaded! ", 0x0A);
+} else {
+term.write_at(2, 21, "Load failed! ", 0x0C);
+}
+draw_editor();
+return;
+}
+
+if (c == (char)0xF9) {
+term.fill_rect(20, 10, 40, 6, 0x17, ' ');
+term.draw_box(20, 10, 40, 6, 0x5F);
+term.write_at(22, 11, "Examples: ", 0x5F);
+term.write_at(22, 12, "1. Hello World ", 0x0F);
+term.write_at(22, 13, "2. Echo ", 0x0F);
+
+modal = true;
+char ch;
+do {
+ch = EventQueue::wait_key();
+} while (ch != '1' && ch != '2' && ch != (char)0xFA);
+modal = false;
+if (ch != (char)0xFA) load_example(ch - '0');
+draw_editor();
+return;
+}
+
+if (c == '\b') {
+if (cursor > 0) {
+cursor--;
+memmove(code + cursor, code + cursor + 1, strlen(code + cursor + 1) + 1);
+}
+} else if (c == '\n') {
+if (cursor < 2046) {
+memmove(code + cursor + 1, code + cursor, strlen(code + cursor) + 1);
+code[cursor] = '\n';
+cursor++;
+}
+} else if (c >= 32 && c <= 126 && cursor < 2046) {
+memmove(code + cursor + 1, code + cursor, strlen(code + cursor) + 1);
+code[cursor] = c;
+cursor++;
+}
+
+draw_editor();
+}
+};
+struct CrcJob {
+FileSystem* fs;
+FileEntry** files;
+uint32_t* results;
+const uint8_t* data;
+uint32_t chunk;
+};
+struct BfJob {
+const char* code;
+uint32_t code_length;
+char* outputs;
+uint32_t* lengths;
+};
+
+static void crc_file_job(void* arg, uint32_t begin, uint32_t end) {
+CrcJob* job = (CrcJob*)arg;
+for (uint32_t i = begin; i < end; i++) {
+job->results[i] = job->fs->checksum(job->files[i]);
+}
+}
+
+static void crc_chunk_job(void* arg, uint32_t begin, uint32_t end) {
+CrcJob* job = (CrcJob*)arg;
+for (uint32_t i = begin; i < end; i++) {
+job->results[i] = CRC32::update(0, job->data + i * job->chunk, job->chunk);
+}
+}
+
+static uint32_t bf_batch_run(const char* code, uint32_t code_length, char* out, uint32_t max_out) {
+uint8_t tape[4096];
+memset(tape, 0, sizeof(tape));
+uint32_t ptr = 0;
+uint32_t length = 0;
+uint32_t steps = 0;
+for (uint32_t pc = 0; pc < code_length && steps < 10000000; pc++, steps++) {
+char c = code[pc];
+if (c == '>') ptr = (ptr + 1) & 4095;
+else if (c == '<') ptr = (ptr - 1) & 4095;
+else if (c == '+') tape[ptr]++;
+else if (c == '-') tape[ptr]--;
+else if (c == '.') {
+if (length < max_out - 1) out[length++] = tape[ptr];
+} else if (c == '[' && tape[ptr] == 0) {
+int depth = 1;
+while (depth && pc + 1 < code_length) {
+pc++;
+if (code[pc] == '[') depth++;
+else if (code[pc] == ']') depth--;
 }
-memory[ptr] = input_buffer[0];
-input_mode = false;
-break;
-case '[':
-if (memory[ptr] == 0) {
-int match = find_match(code, pc, '[', ']', true);
-if (match == -1) {
-term.write("\nError: Unmatched [ ");
-running = false;
+} else if (c == ']' && tape[ptr] != 0) {
+int depth = 1;
+while (depth && pc > 0) {
+pc--;
+if (code[pc] == ']') depth++;
+else if (code[pc] == '[') depth--;
+}
+}
+}
+out[length] = 0;
+return length;
+}
+
+struct QueueStress {
+MpscQueue<uint32_t, 1024>* mpsc;
+SpscQueue<uint32_t, 1024>* spsc;
+uint32_t items;
+volatile uint32_t full_retries;
+};
+
+static void mpsc_producer(void* arg, uint32_t begin, uint32_t end) {
+QueueStress* stress = (QueueStress*)arg;
+for (uint32_t id = begin; id < end; id++) {
+for (uint32_t seq = 0; seq < stress->items; seq++) {
+while (!stress->mpsc->push((id << 24) | seq)) {
+__sync_fetch_and_add(&stress->full_retries, 1);
+asm volatile("pause");
+}
+}
+}
+}
+
+static void spsc_producer(void* arg, uint32_t, uint32_t) {
+QueueStress* stress = (QueueStress*)arg;
+for (uint32_t seq = 0; seq < stress->items; seq++) {
+while (!stress->spsc->push(seq)) {
+__sync_fetch_and_add(&stress->full_retries, 1);
+asm volatile("pause");
+}
+}
+}
+
+template <class Q>
+static uint32_t drain_stress(Q* queue, uint32_t total, uint32_t* expected, uint32_t& errors) {
+uint32_t values[64];
+uint32_t received = 0;
+uint64_t timeout = (uint64_t)Clock::get_tsc_khz() * 2000;
+uint64_t last_progress = Clock::cycles();
+while (received < total) {
+int count = queue->pop_batch(values, 64);
+if (count == 0) {
+if (Clock::cycles() - last_progress > timeout) break;
+asm volatile("pause");
+continue;
+}
+for (int i = 0; i < count; i++) {
+uint32_t id = values[i] >> 24;
+uint32_t seq = values[i] & 0xFFFFFF;
+if (id >= 8 || seq != expected[id]) errors++;
+else expected[id] = seq + 1;
+}
+received += count;
+last_progress = Clock::cycles();
+}
+return received;
+}
+
+static void bf_job(void* arg, uint32_t begin, uint32_t end) {
+BfJob* job = (BfJob*)arg;
+for (uint32_t i = begin; i < end; i++) {
+job->lengths[i] = bf_batch_run(job->code, job->code_length, job->outputs + i * 256, 256);
+}
+}
+class TerminalShell : public App {
+private:
+VGATerminal& term;
+FileSystem& fs;
+char input_buffer[MAX_INPUT_LEN];
+int cursor;
+char history[MAX_COMMAND_HISTORY][MAX_INPUT_LEN];
+int history_count;
+int history_pos;
+bool command_mode;
+bool history_browsing;
+bool serial_mirror;
+char temp_buffer[MAX_INPUT_LEN];
+WaitGroup crc_group;
+CrcJob crc_async;
+uint32_t crc_results[MAX_FILES];
+FileEntry* crc_files[MAX_FILES];
+uint64_t crc_started;
+int crc_count;
+bool crc_ready;
+bool running_command;
+void add_to_history(const char* cmd) {
+if (!cmd || cmd[0] == 0) return;
+if (history_count > 0 && strcmp(history[history_count - 1], cmd) == 0) return;
+
+if (history_count < MAX_COMMAND_HISTORY) {
+strncpy(history[history_count], cmd, MAX_INPUT_LEN - 1);
+history_count++;
+} else {
+memmove(history[0], history[1], (MAX_COMMAND_HISTORY - 1) * MAX_INPUT_LEN);
+strncpy(history[MAX_COMMAND_HISTORY - 1], cmd, MAX_INPUT_LEN - 1);
+}
+history_pos = history_count;
+}
+
+void list_files(const char* path) {
+while (*path == ' ') path++;
+if (!*path) path = ".";
+int count = fs.list(path, 0, 0, 0);
+if (count < 0) {
+term.write("\nNo such directory.\n");
 return;
 }
-pc = match;
+term.write("\n");
+
+FileEntry* entries[32];
+for (int start = 0; start < count; start += 32) {
+int n = fs.list(path, start, entries, 32);
+for (int i = 0; i < n; i++) {
+FileEntry* file = entries[i];
+
+char line[80];
+strcpy(line, "       ");
+strcat(line, file->name);
+int name_len = strlen(line);
+for (int j = name_len; j < 20; j++) strcat(line, " ");
+
+if (file->directory) {
+strcat(line, "<DIR>");
+} else {
+char size_str[16];
+int_to_str(file->size, size_str);
+strcat(line, size_str);
+for (int j = strlen(size_str); j < 8; j++) strcat(line, " ");
+strcat(line, " bytes ");
 }
-break;
-case ']':
-if (memory[ptr] != 0) {
-int match = find_match(code, pc, ']', '[', false);
-if (match == -1) {
-term.write("\nError: Unmatched ] ");
-running = false;
+if (file->read_only) strcat(line, " [RO] ");
+term.write(line);
+term.write("\n");
+}
+}
+
+char total[32];
+int_to_str(count, total);
+term.write("\nTotal: ");
+term.write(total);
+term.write(" files\n");
+}
+
+void cat_file(const char* filename) {
+if (!filename || strlen(filename) == 0) {
+term.write("Usage: cat <filename>\n");
 return;
 }
-pc = match;
+
+FileView file;
+if (fs.view(filename, file)) {
+term.write("\n");
+term.write((const char*)file.data, file.size);
+if (file.size > 0 && file.data[file.size - 1] != '\n') term.write("\n");
+} else {
+term.write("File '");
+term.write(filename);
+term.write("' not found.\n");
 }
-break;
 }
-pc++;
+
+void append_line(const char* args) {
+char name[MAX_PATH];
+int len = 0;
+while (*args == ' ') args++;
+while (*args && *args != ' ' && len < MAX_PATH - 1) name[len++] = *args++;
+name[len] = 0;
+while (*args == ' ') args++;
+FileHandle file;
+if (len == 0 || !fs.open(name, FILE_WRITE | FILE_CREATE, file)) {
+term.write("\nUsage: append <file> <text>\n");
+return;
+}
+bool ok = fs.append(file, args, strlen(args)) >= 0 && fs.append(file, "\n", 1) >= 0;
+char num[12];
+int_to_str(fs.size(file), num);
+ok = fs.close(file) && ok;
+term.write(ok ? "\nAppended, " : "\nAppend failed, ");
+term.write(num);
+term.write(" bytes.\n");
 }
 
-if (steps >= MAX_STEPS) {
-term.write("\n\nProgram stopped: too many steps ");
-} else if (running) {
-term.write("\n\nProgram finished ");
+void show_help() {
+term.write("\nCommands:\n");
+term.write("  help/?       - Show this help\n");
+term.write("  ls/dir [dir] - List a directory\n");
+term.write("  cd [dir]/pwd - Change/show directory\n");
+term.write("  mkdir <dir>  - Create directory\n");
+term.write("  rmdir <dir>  - Remove empty directory\n");
+term.write("  cat <file>   - View file\n");
+term.write("  rm <file>    - Delete file\n");
+term.write("  append <file> <text> - Append a line\n");
+term.write("  mv <old> <new> - Rename or move\n");
+term.write("  time         - Show time\n");
+term.write("  time <cmd>   - Time a command\n");
+term.write("  clear/cls    - Clear screen\n");
+term.write("  about        - System info\n");
+term.write("  history      - Command history\n");
+term.write("  reboot       - Reboot system\n");
+term.write("  echo <text>  - Print text\n");
+term.write("  mem          - Memory info\n");
+term.write("  compact      - Defragment file data\n");
+term.write("  bench mem    - Memory routine benchmark\n");
+term.write("  bench fs     - File name lookup benchmark\n");
+term.write("  prof dump|reset - Profile zones\n");
+term.write("  perf top|reset  - Sampling profiler\n");
+term.write("  latency [reset] - Main loop latency\n");
+term.write("  ps           - Threads and CPU time\n");
+term.write("  cpus         - Processors and APIC state\n");
+term.write("  disk [bench] - ATA disk info/throughput\n");
+term.write("  floppy       - Floppy drive and track cache\n");
+term.write("  sync         - Write back cached blocks\n");
+term.write("  cache [delay <ms>|test] - Block cache stats\n");
+term.write("  jobs [crc|bench] - Job system stats/workloads\n");
+term.write("  jobs bf <file> [n] - Run a BF program n times\n");
+term.write("  jobs crc async - CRC files in the background\n");
+term.write("  stress queues - MPSC/SPSC queue stress test\n");
+term.write("  quantum <ms> - Set scheduler time slice\n");
+term.write("  serial on|off   - Mirror terminal to COM1\n");
+term.write("  trace start|stop|dump - Event trace to COM1\n");
+term.write("  info         - System information\n");
+term.write("  tz <offset>  - Set timezone (-12 to +12)\n\n");
 }
 
-term.write("\n\nPress any key to return to editor ");
-Keyboard::flush();
-while (!Keyboard::is_key_pressed()) {}
-Keyboard::flush();
+void show_time() {
+uint8_t hour, minute, second;
+uint32_t ms;
+RTC::get_time(hour, minute, second, ms);
+char time_str[16];
+time_str[0] = '0' + (hour / 10);
+time_str[1] = '0' + (hour % 10);
+time_str[2] = ':';
+time_str[3] = '0' + (minute / 10);
+time_str[4] = '0' + (minute % 10);
+time_str[5] = ':';
+time_str[6] = '0' + (second / 10);
+time_str[7] = '0' + (second % 10);
+time_str[8] = '.';
+time_str[9] = '0' + (ms / 100);
+time_str[10] = '0' + (ms / 10 % 10);
+time_str[11] = '0' + (ms % 10);
+time_str[12] = 0;
+term.write("\n");
+term.write(time_str);
+term.write("\n");
 
-running = false;
-input_mode = false;
-term.restore_state(saved_x, saved_y, saved_color);
-draw_editor();
+char tz_str[8];
+int_to_str(RTC::get_timezone(), tz_str);
+term.write("Timezone: UTC");
+if (RTC::get_timezone() >= 0) term.write("+");
+term.write(tz_str);
+term.write("\n");
 }
 
-void draw_editor() {
-term.set_color(0x0F, 0x01);
-term.clear();
+void show_version() {
+term.write("\nEH-DSB v0.01\n");
+term.write("Public Domain (Unlicense)\n");
+term.write("by quik/QUIK1001\n");
+}
 
-term.draw_box(0, 0, 80, 3, 0x4F);
-term.write_at(2, 1, "Brainfuck IDE ", 0x4F);
-term.write_at(30, 1, "F5:Run F7:Save F8:Load F9:Examples F10:Exit ", 0x4F);
+void show_memory_info() {
+char fs_size[16];
+int_to_str(fs.get_fs_size(), fs_size);
+term.write("  FS Used: ");
+term.write(fs_size);
+term.write(" bytes\n");
+char fs_free[16];
+int_to_str(fs.get_free_space(), fs_free);
+term.write("  FS Free: ");
+term.write(fs_free);
+term.write(" bytes in ");
+int_to_str(fs.get_free_extents(), fs_free);
+term.write(fs_free);
+term.write(" extents, largest ");
+int_to_str(fs.get_largest_free(), fs_free);
+term.write(fs_free);
+term.write("\n  Compacted: ");
+int_to_str(fs.get_compact_moves(), fs_free);
+term.write(fs_free);
+term.write(" moves, ");
+u64_to_str(fs.get_compact_bytes(), fs_free);
+term.write(fs_free);
+term.write(" bytes\n  Journal: ");
+int_to_str(fs.get_journal_pending(), fs_free);
+term.write(fs_free);
+term.write(" pending, ");
+int_to_str(fs.get_journal_writes(), fs_free);
+term.write(fs_free);
+term.write(" records, ");
+int_to_str(fs.get_checkpoints(), fs_free);
+term.write(fs_free);
+term.write(" checkpoints\n");
+}
 
-term.draw_box(0, 3, 80, 18, 0x3F);
-term.fill_rect(1, 4, 78, 16, 0x17, ' ');
+void show_system_info() {
+term.write("\nInformation:\n");
+term.write("  EH-DSB v0.01\n");
+term.write("  Public Domain\n");
+term.write("  quik/QUIK1001\n");
+char file_count[8];
+int_to_str(fs.get_file_count(), file_count);
+term.write("  Files: ");
+term.write(file_count);
+term.write("\n");
+term.write("  CPU: ");
+term.write(CPU::vendor);
+if (CPU::has_sse2) term.write(" SSE2");
+if (CPU::has_erms) term.write(" ERMS");
+term.write("\n  Mem ops: ");
+term.write(MemOps::variants[MemOps::selected].name);
+term.write("\n");
+char clock_str[24];
+int_to_str(Clock::get_tsc_khz() / 1000, clock_str);
+term.write("  TSC: ");
+term.write(clock_str);
+term.write(" MHz\n");
+format_ns(Clock::now_ns(), clock_str);
+term.write("  Uptime: ");
+term.write(clock_str);
+term.write("\n");
+uint8_t hour, minute, second;
+RTC::get_time(hour, minute, second);
+char time_str[16];
+time_str[0] = '0' + (hour / 10);
+time_str[1] = '0' + (hour % 10);
+time_str[2] = ':';
+time_str[3] = '0' + (minute / 10);
+time_str[4] = '0' + (minute % 10);
+time_str[5] = ':';
+time_str[6] = '0' + (second / 10);
+time_str[7] = '0' + (second % 10);
+time_str[8] = 0;
+term.write("  Time: ");
+term.write(time_str);
+term.write("\n");
+char tz_str[8];
+int_to_str(RTC::get_timezone(), tz_str);
+term.write("  Timezone: UTC");
+if (RTC::get_timezone() >= 0) term.write("+");
+term.write(tz_str);
+term.write("\n");
+}
 
-int line = 4;
-int col = 1;
-for (int i = 0; code[i] && line < 20; i++) {
-if (code[i] == '\n') {
-line++;
-col = 1;
-continue;
+void do_reboot() {
+term.write("\nRebooting...\n");
+if (!fs.sync()) term.write("Sync failed, recent changes may be lost.\n");
+for (int i = 0; i < 500000; i++);
+outb(0x64, 0xFE);
+while (1) {
+asm volatile("hlt");
 }
-if (col >= 79) {
-line++;
-col = 1;
-continue;
 }
-if (code[i] >= 32 && code[i] <= 126) {
-char ch[2] = {code[i], 0};
-term.write_at(col, line, ch, 0x0F);
-col++;
+
+void set_timezone(const char* arg) {
+while (*arg == ' ') arg++;
+int offset = 0;
+bool negative = false;
+if (*arg == '-') {
+negative = true;
+arg++;
+}
+while (*arg >= '0' && *arg <= '9') {
+offset = offset * 10 + (*arg - '0');
+arg++;
+}
+if (negative) offset = -offset;
+if (offset >= -12 && offset <= 12) {
+RTC::set_timezone(offset);
+char tz_str[8];
+int_to_str(offset, tz_str);
+term.write("\nTimezone set to UTC");
+if (offset >= 0) term.write("+");
+term.write(tz_str);
+term.write("\n");
+} else {
+term.write("\nInvalid timezone. Use -12 to +12\n");
 }
 }
 
-int cursor_line = 4;
-int cursor_col = 1;
-for (int i = 0; i < cursor && code[i]; i++) {
-if (code[i] == '\n') {
-cursor_line++;
-cursor_col = 1;
-} else {
-cursor_col++;
-if (cursor_col >= 79) {
-cursor_line++;
-cursor_col = 1;
+void write_padded(const char* text, int width) {
+term.write(text);
+for (int i = strlen(text); i < width; i++) term.putchar(' ');
 }
+
+uint32_t bench_rate(MemVariant& v, bool fill, uint32_t size) {
+uint8_t* src = (uint8_t*)BENCH_BUFFER;
+uint8_t* dst = src + BENCH_MAX_SIZE;
+uint32_t iterations = (1 << 20) / size;
+uint64_t cycles = 0;
+{
+ScopedTimer timer(cycles);
+for (uint32_t i = 0; i < iterations; i++) {
+if (fill) v.fill(dst, (uint8_t)i, size);
+else v.copy(dst, src, size);
 }
 }
-if (cursor_line < 20 && cursor_col < 79) {
-term.write_at(cursor_col, cursor_line, "_ ", 0x0E);
+uint64_t ns = Clock::cycles_to_ns(cycles);
+if (ns == 0) ns = 1;
+return (uint32_t)((uint64_t)iterations * size * 100 / ns);
 }
 
-char info[32];
-int_to_str(strlen(code), info);
-term.write_at(2, 21, "Length: ", 0x0F);
-term.write_at(10, 21, info, 0x0F);
-term.write_at(2, 22, "F5:Run F7:Save F8:Load F9:Examples F10:Exit ", 0x70);
+void run_mem_bench() {
+static const uint32_t sizes[4] = {64, 512, 4096, BENCH_MAX_SIZE};
+static const char* size_names[4] = {"64B", "512B", "4KB", "16KB"};
+if (Clock::get_tsc_khz() == 0) {
+term.write("\nTSC not available.\n");
+return;
 }
-
-void load_example(int num) {
-char buffer[2048];
-uint32_t size;
-switch (num) {
-case 1:
-if (fs.load_file("HELLO.BF", buffer, size)) {
-strcpy(code, buffer);
+memset((void*)BENCH_BUFFER, 0x5A, BENCH_MAX_SIZE);
+term.write("\nMemory bench (GB/s)\n");
+write_padded("", 14);
+for (int s = 0; s < 4; s++) write_padded(size_names[s], 10);
+term.write("\n");
+for (int v = 0; v < MemOps::variant_count; v++) {
+for (int op = 0; op < 2; op++) {
+char label[16];
+strcpy(label, v == MemOps::selected ? "*" : " ");
+strcat(label, MemOps::variants[v].name);
+strcat(label, op ? " set" : " cpy");
+write_padded(label, 14);
+for (int s = 0; s < 4; s++) {
+char num[12];
+uint32_t rate = bench_rate(MemOps::variants[v], op == 1, sizes[s]);
+fixed_to_str(rate, 2, num);
+write_padded(num, 10);
+klog(LOG_INFO, "bench mem %s %s %u %s GB/s", MemOps::variants[v].name, op ? "set" : "cpy", sizes[s], num);
 }
-break;
-case 2:
-if (fs.load_file("ECHO.BF", buffer, size)) {
-strcpy(code, buffer);
+term.write("\n");
 }
-break;
 }
-cursor = strlen(code);
-draw_editor();
 }
-public:
-BrainfuckIDE(VGATerminal& t, FileSystem& f) : term(t), fs(f), cursor(0), active(false), running(false), input_mode(false), input_pos(0) {
-code[0] = 0;
+
+void bench_name(char* name, int n) {
+name[0] = 'F';
+for (int d = 5; d >= 1; d--) {
+name[d] = '0' + n % 10;
+n /= 10;
 }
-void open() {
-active = true;
-running = false;
-input_mode = false;
-cursor = 0;
-code[0] = 0;
-draw_editor();
+strcpy(name + 6, ".TXT");
 }
 
-void close() { active = false; }
-bool is_active() { return active; }
-bool is_running() { return running; }
-
-void handle_input(char c) {
-if (!active) return;
-
-if (running) {
-if (input_mode) {
-if (c == '\n') {
-input_buffer[input_pos] = 0;
+void write_lookup(const char* label, uint64_t cycles, int count) {
+char num[24];
+write_padded(label, 16);
+format_ns(Clock::cycles_to_ns(cycles / count), num);
+term.write(num);
 term.write("\n");
-run_program();
-} else if (c == '\b') {
-if (input_pos > 0) {
-input_pos--;
-term.write("\b \b");
+klog(LOG_INFO, "bench fs %s %s", label, num);
 }
-} else if (c >= 32 && c <= 126 && input_pos < 255) {
-input_buffer[input_pos] = c;
-input_pos++;
-term.putchar(c);
-} else if (c == (char)0xFA) {
-running = false;
-input_mode = false;
-term.restore_state(saved_x, saved_y, saved_color);
-draw_editor();
+
+void run_fs_bench() {
+if (Clock::get_tsc_khz() == 0) {
+term.write("\nTSC not available.\n");
+return;
 }
-} else {
-if (c == (char)0xFA) {
-running = false;
-term.restore_state(saved_x, saved_y, saved_color);
-draw_editor();
+FileEntry* entries = (FileEntry*)JOB_BENCH_BASE;
+int16_t* table = (int16_t*)(JOB_BENCH_BASE + FS_BENCH_FILES * sizeof(FileEntry));
+DirNode* nodes = (DirNode*)(table + FS_BENCH_INDEX_SIZE);
+NameIndex bench_index;
+DirIndex bench_tree;
+bench_index.init(table, FS_BENCH_INDEX_SIZE, entries, FS_BENCH_FILES);
+bench_tree.init(nodes, FS_BENCH_NODES, entries, FS_BENCH_FILES);
+memset(entries, 0, FS_BENCH_FILES * sizeof(FileEntry));
+uint64_t insert_cycles = 0;
+uint64_t hit_cycles = 0;
+uint64_t miss_cycles = 0;
+uint64_t tree_insert_cycles = 0;
+uint64_t tree_hit_cycles = 0;
+uint64_t tree_miss_cycles = 0;
+uint64_t scan_cycles = 0;
+uint64_t linear_cycles = 0;
+int found = 0;
+for (int i = 0; i < FS_BENCH_FILES; i++) {
+bench_name(entries[i].name, (i * 7919) % FS_BENCH_FILES);
+entries[i].used = true;
+{
+ScopedTimer timer(insert_cycles);
+bench_index.insert(i);
+}
+ScopedTimer timer(tree_insert_cycles);
+bench_tree.insert(i);
 }
+char name[13];
+for (int i = 0; i < FS_BENCH_FILES; i++) {
+bench_name(name, (i * 7919) % FS_BENCH_FILES);
+ScopedTimer timer(hit_cycles);
+if (bench_index.find(name) >= 0) found++;
+}
+for (int i = 0; i < FS_BENCH_FILES; i++) {
+bench_name(name, FS_BENCH_FILES + i);
+ScopedTimer timer(miss_cycles);
+if (bench_index.find(name) >= 0) found++;
+}
+int tree_found = 0;
+for (int i = 0; i < FS_BENCH_FILES; i++) {
+bench_name(name, (i * 7919) % FS_BENCH_FILES);
+ScopedTimer timer(tree_hit_cycles);
+if (bench_tree.find(0, name) >= 0) tree_found++;
+}
+for (int i = 0; i < FS_BENCH_FILES; i++) {
+bench_name(name, FS_BENCH_FILES + i);
+ScopedTimer timer(tree_miss_cycles);
+if (bench_tree.find(0, name) >= 0) tree_found++;
+}
+int ordered = 0;
+{
+ScopedTimer timer(scan_cycles);
+DirCursor cursor;
+bench_tree.seek(0, cursor);
+int prev = -1;
+int idx;
+while ((idx = bench_tree.next(cursor)) >= 0) {
+if (prev < 0 || strcmp(entries[prev].name, entries[idx].name) < 0) ordered++;
+prev = idx;
+}
+}
+for (int i = 0; i < 100; i++) {
+bench_name(name, (i * 7919) % FS_BENCH_FILES);
+ScopedTimer timer(linear_cycles);
+for (int j = 0; j < FS_BENCH_FILES; j++) {
+if (entries[j].used && strcmp(entries[j].name, name) == 0) {
+found++;
+break;
 }
-return;
 }
-
-if (c == (char)0xFA) {
-close();
-return;
 }
-
-if (c == (char)0xF5) {
-if (code[0] != 0) {
-run_program();
+char num[12];
+int_to_str(FS_BENCH_FILES, num);
+term.write("\nName lookup with ");
+term.write(num);
+term.write(" files (per operation)\n");
+write_lookup("insert", insert_cycles, FS_BENCH_FILES);
+write_lookup("hashed hit", hit_cycles, FS_BENCH_FILES);
+write_lookup("hashed miss", miss_cycles, FS_BENCH_FILES);
+write_lookup("btree insert", tree_insert_cycles, FS_BENCH_FILES);
+write_lookup("btree hit", tree_hit_cycles, FS_BENCH_FILES);
+write_lookup("btree miss", tree_miss_cycles, FS_BENCH_FILES);
+write_lookup("ordered scan", scan_cycles, FS_BENCH_FILES);
+write_lookup("linear scan", linear_cycles, 100);
+if (found != FS_BENCH_FILES + 100 || tree_found != FS_BENCH_FILES || ordered != FS_BENCH_FILES) term.write("Lookup mismatch!\n");
+char nodes_str[12];
+int_to_str(bench_tree.get_nodes(), nodes_str);
+term.write("B-tree nodes: ");
+term.write(nodes_str);
+term.write("\n");
 }
+
+void profile_dump() {
+#ifndef EHDSB_PROFILE
+term.write("\nProfiling disabled (build with PROFILE=1)\n");
 return;
+#endif
+ProfileZone* top[MAX_PROFILE_ZONES];
+int count = Profiler::sorted(top, MAX_PROFILE_ZONES);
+term.write("\n");
+write_padded("Zone", 28);
+write_padded("Calls", 10);
+write_padded("Total", 14);
+term.write("Max cycles\n");
+for (int i = 0; i < count; i++) {
+char num[24];
+write_padded(top[i]->name, 28);
+u64_to_str(top[i]->calls, num);
+write_padded(num, 10);
+format_ns(Clock::cycles_to_ns(top[i]->total_cycles), num);
+write_padded(num, 14);
+u64_to_str(top[i]->max_cycles, num);
+term.write(num);
+term.write("\n");
+}
 }
 
-if (c == (char)0xF7) {
-if (fs.save_file("PROGRAM.BF", code, strlen(code))) {
-term.write_at(2, 21, "Saved! ", 0x0A);
-} else {
-term.write_at(2, 21, "Save failed! ", 0x0C);
+void thread_dump() {
+static const char* states[6] = {"free", "ready", "running", "sleeping", "blocked", "dead"};
+static const char* priorities[3] = {"idle", "normal", "ui"};
+term.write("\n");
+write_padded("Id", 4);
+write_padded("Name", 10);
+write_padded("State", 10);
+write_padded("Prio", 8);
+write_padded("CPU", 14);
+term.write("Switches\n");
+for (int i = 0; i < MAX_THREADS; i++) {
+Thread thread = Scheduler::get_thread(i);
+if (thread.state == THREAD_FREE) continue;
+char num[24];
+int_to_str(i, num);
+write_padded(num, 4);
+write_padded(thread.name, 10);
+write_padded(states[thread.state], 10);
+write_padded(priorities[thread.priority], 8);
+format_ns(Clock::cycles_to_ns(thread.cycles), num);
+write_padded(num, 14);
+u64_to_str(thread.switches, num);
+term.write(num);
+term.write("\n");
 }
-return;
+char num[16];
+int_to_str(Scheduler::get_quantum_ms(), num);
+term.write("Quantum ");
+term.write(num);
+term.write(" ms\n");
 }
 
-if (c == (char)0xF8) {
-char buffer[2048];
-uint32_t size;
-if (fs.load_file("PROGRAM.BF", buffer, size)) {
-strcpy(code, buffer);
-cursor = size;
-term.write_at(2, 21, "Loaded! ", 0x0A);
-} else {
-term.write_at(2, 21, "Load failed! ", 0x0C);
+void jobs_dump() {
+term.write("\n");
+write_padded("CPU", 5);
+write_padded("Executed", 12);
+term.write("Stolen\n");
+for (int i = 0; i < Smp::get_cpu_count(); i++) {
+char num[16];
+int_to_str(i, num);
+write_padded(num, 5);
+u64_to_str(Jobs::get_executed(i), num);
+write_padded(num, 12);
+u64_to_str(Jobs::get_stolen(i), num);
+term.write(num);
+term.write("\n");
 }
-draw_editor();
-return;
+char num[16];
+int_to_str(Jobs::get_workers(), num);
+term.write("Workers: ");
+term.write(num);
+term.write("\n");
 }
 
-if (c == (char)0xF9) {
-term.fill_rect(20, 10, 40, 6, 0x17, ' ');
-term.draw_box(20, 10, 40, 6, 0x5F);
-term.write_at(22, 11, "Examples: ", 0x5F);
-term.write_at(22, 12, "1. Hello World ", 0x0F);
-term.write_at(22, 13, "2. Echo ", 0x0F);
-
-while (true) {
-if (Keyboard::is_key_pressed()) {
-char ch = Keyboard::get_char();
-if (ch == '1' || ch == '2') {
-load_example(ch - '0');
-break;
-} else if (ch == (char)0xFA) {
-break;
+void jobs_crc() {
+static uint32_t parallel[MAX_FILES];
+static FileEntry* files[MAX_FILES];
+uint32_t serial[MAX_FILES];
+int count = fs.list_files(files, MAX_FILES);
+CrcJob job;
+job.fs = &fs;
+job.files = files;
+uint64_t serial_cycles = 0;
+uint64_t parallel_cycles = 0;
+{
+ScopedTimer timer(serial_cycles);
+job.results = serial;
+crc_file_job(&job, 0, count);
+}
+{
+ScopedTimer timer(parallel_cycles);
+job.results = parallel;
+Jobs::parallel_for(0, count, 1, crc_file_job, &job);
+}
+term.write("\n");
+int bad = 0;
+for (int i = 0; i < count; i++) {
+FileEntry* file = files[i];
+char hex[9];
+hex_to_str(parallel[i], hex);
+write_padded(file->name, 14);
+term.write(hex);
+if (parallel[i] != serial[i]) {
+term.write("  MISMATCH");
+bad++;
 }
+term.write("\n");
 }
+char num[24];
+term.write(bad ? "Verification FAILED" : "All files verified");
+term.write(", serial ");
+format_ns(Clock::cycles_to_ns(serial_cycles), num);
+term.write(num);
+term.write(", parallel ");
+format_ns(Clock::cycles_to_ns(parallel_cycles), num);
+term.write(num);
+term.write("\n");
 }
-draw_editor();
+
+void jobs_bf(const char* args) {
+char name[MAX_PATH];
+int len = 0;
+while (*args == ' ') args++;
+while (*args && *args != ' ' && len < MAX_PATH - 1) name[len++] = *args++;
+name[len] = 0;
+int runs = 0;
+while (*args == ' ') args++;
+while (*args >= '0' && *args <= '9') runs = runs * 10 + (*args++ - '0');
+if (runs <= 0) runs = 16;
+if (runs > 64) runs = 64;
+FileView view;
+if (!fs.view(name, view)) {
+term.write("\nFile not found.\n");
 return;
 }
-
-if (c == '\b') {
-if (cursor > 0) {
-cursor--;
-for (int i = cursor; code[i]; i++) {
-code[i] = code[i+1];
+uint32_t lengths[64];
+BfJob job;
+job.code = (const char*)view.data;
+job.code_length = view.size;
+job.outputs = (char*)BENCH_BUFFER;
+job.lengths = lengths;
+uint64_t cycles = 0;
+{
+ScopedTimer timer(cycles);
+Jobs::parallel_for(0, runs, 1, bf_job, &job);
+}
+int mismatched = 0;
+for (int i = 1; i < runs; i++) {
+if (lengths[i] != lengths[0] || strcmp(job.outputs + i * 256, job.outputs) != 0) mismatched++;
+}
+char num[24];
+term.write("\n");
+term.write(job.outputs);
+term.write("\n");
+int_to_str(runs, num);
+term.write(num);
+term.write(" runs in ");
+format_ns(Clock::cycles_to_ns(cycles), num);
+term.write(num);
+term.write(mismatched ? ", outputs differ\n" : ", outputs identical\n");
+if (!fs.is_current(view)) term.write("File changed during the run.\n");
+}
+
+void jobs_bench() {
+static const char* program = "++++++++[>++++++++++[>++++++++++[>++++++++++[>+<-]<-]<-]<-]>>>>.";
+static uint32_t crcs[JOB_BENCH_SIZE / 65536];
+uint32_t lengths[64];
+int saved = Jobs::get_workers();
+int cpus = Smp::get_online_count();
+uint64_t base_crc = 0;
+uint64_t base_bf = 0;
+term.write("\n");
+write_padded("Workers", 10);
+write_padded("CRC 4 MB", 14);
+write_padded("Speedup", 10);
+write_padded("BF x64", 14);
+term.write("Speedup\n");
+for (int workers = 1; workers <= cpus; workers *= 2) {
+Jobs::set_workers(workers);
+CrcJob crc;
+crc.data = (const uint8_t*)JOB_BENCH_BASE;
+crc.chunk = 65536;
+crc.results = crcs;
+BfJob bf;
+bf.code = program;
+bf.code_length = strlen(program);
+bf.outputs = (char*)BENCH_BUFFER;
+bf.lengths = lengths;
+uint64_t crc_cycles = 0;
+uint64_t bf_cycles = 0;
+{
+ScopedTimer timer(crc_cycles);
+Jobs::parallel_for(0, JOB_BENCH_SIZE / 65536, 1, crc_chunk_job, &crc);
+}
+{
+ScopedTimer timer(bf_cycles);
+Jobs::parallel_for(0, 64, 1, bf_job, &bf);
+}
+if (workers == 1) {
+base_crc = crc_cycles;
+base_bf = bf_cycles;
+}
+char num[24];
+int_to_str(workers, num);
+write_padded(num, 10);
+format_ns(Clock::cycles_to_ns(crc_cycles), num);
+write_padded(num, 14);
+fixed_to_str(crc_cycles ? (uint32_t)(base_crc * 100 / crc_cycles) : 0, 2, num);
+strcat(num, "x");
+write_padded(num, 10);
+format_ns(Clock::cycles_to_ns(bf_cycles), num);
+write_padded(num, 14);
+fixed_to_str(bf_cycles ? (uint32_t)(base_bf * 100 / bf_cycles) : 0, 2, num);
+strcat(num, "x");
+term.write(num);
+term.write("\n");
 }
+Jobs::set_workers(saved);
 }
-} else if (c == '\n') {
-if (cursor < 2046) {
-for (int i = strlen(code); i >= cursor; i--) {
-code[i+1] = code[i];
+
+void write_stress_result(const char* name, int producers, QueueStress& stress, uint32_t received, uint32_t errors, uint64_t cycles) {
+char num[24];
+term.write(name);
+int_to_str(producers, num);
+term.write(num);
+term.write(" producers x ");
+u64_to_str(stress.items, num);
+term.write(num);
+term.write(", ");
+u64_to_str(received, num);
+term.write(num);
+term.write(" received, ");
+u64_to_str(errors, num);
+term.write(num);
+term.write(" errors, ");
+u64_to_str(stress.full_retries, num);
+term.write(num);
+term.write(" full spins\n  ");
+uint64_t ns = Clock::cycles_to_ns(cycles);
+format_ns(ns, num);
+term.write(num);
+term.write(", ");
+u64_to_str(ns ? (uint64_t)received * 1000000000ULL / ns : 0, num);
+term.write(num);
+term.write(" items/s\n");
 }
-code[cursor] = '\n';
-cursor++;
+
+void stress_queues() {
+static WaitGroup group;
+if (Jobs::get_workers() < 2) {
+term.write("\nNeeds at least 2 worker CPUs (boot with SMP=2 or more).\n");
+return;
 }
-} else if (c >= 32 && c <= 126 && cursor < 2046) {
-for (int i = strlen(code); i >= cursor; i--) {
-code[i+1] = code[i];
+if (group.pending > 0) {
+term.write("\nPrevious stress run still has producers queued.\n");
+return;
 }
-code[cursor] = c;
-cursor++;
+memset((void*)BENCH_BUFFER, 0, 0x8000);
+QueueStress stress;
+stress.mpsc = (MpscQueue<uint32_t, 1024>*)BENCH_BUFFER;
+stress.spsc = (SpscQueue<uint32_t, 1024>*)(BENCH_BUFFER + 0x4000);
+stress.items = 200000;
+stress.full_retries = 0;
+group.on_done = 0;
+int producers = (Jobs::get_workers() - 1) * 2;
+if (producers > 8) producers = 8;
+uint32_t expected[8];
+uint32_t errors = 0;
+uint64_t cycles = 0;
+uint32_t received;
+term.write("\n");
+memset(expected, 0, sizeof(expected));
+{
+ScopedTimer timer(cycles);
+Jobs::submit(0, producers, 1, mpsc_producer, &stress, group);
+received = drain_stress(stress.mpsc, producers * stress.items, expected, errors);
+}
+if (received != producers * stress.items) {
+term.write("MPSC stress timed out\n");
+return;
 }
-
-draw_editor();
+Jobs::wait(group);
+write_stress_result("MPSC: ", producers, stress, received, errors, cycles);
+stress.full_retries = 0;
+errors = 0;
+cycles = 0;
+memset(expected, 0, sizeof(expected));
+{
+ScopedTimer timer(cycles);
+Jobs::submit(0, 1, 1, spsc_producer, &stress, group);
+received = drain_stress(stress.spsc, stress.items, expected, errors);
+}
+if (received != stress.items) {
+term.write("SPSC stress timed out\n");
+return;
 }
-};
-class TerminalShell {
-private:
-VGATerminal& term;
-FileSystem& fs;
-char input_buffer[MAX_INPUT_LEN];
-int cursor;
-char history[MAX_COMMAND_HISTORY][MAX_INPUT_LEN];
-int history_count;
-int history_pos;
-bool command_mode;
-bool history_browsing;
-char temp_buffer[MAX_INPUT_LEN];
-void add_to_history(const char* cmd) {
-if (!cmd || cmd[0] == 0) return;
-if (history_count > 0 && strcmp(history[history_count - 1], cmd) == 0) return;
-
-if (history_count < MAX_COMMAND_HISTORY) {
-strncpy(history[history_count], cmd, MAX_INPUT_LEN - 1);
-history_count++;
-} else {
-for (int i = 0; i < MAX_COMMAND_HISTORY - 1; i++) {
-strcpy(history[i], history[i + 1]);
+Jobs::wait(group);
+write_stress_result("SPSC: ", 1, stress, received, errors, cycles);
 }
-strncpy(history[MAX_COMMAND_HISTORY - 1], cmd, MAX_INPUT_LEN - 1);
+
+void jobs_crc_async() {
+if (crc_group.pending > 0) {
+term.write("\nCRC job already running.\n");
+return;
 }
-history_pos = history_count;
+int count = fs.list_files(crc_files, MAX_FILES);
+if (count == 0) {
+term.write("\nNo files.\n");
+return;
 }
-
-void list_files() {
-term.write("\n");
-int count = fs.get_file_count();
-
-for (int i = 0; i < count; i++) {
-FileEntry* file = fs.get_file(i);
-if (!file) continue;
-
-char line[80];
-strcpy(line, "       ");
-strcat(line, file->name);
-int name_len = strlen(line);
-for (int j = name_len; j < 20; j++) strcat(line, " ");
-
-char size_str[16];
-int_to_str(file->size, size_str);
-strcat(line, size_str);
-for (int j = strlen(size_str); j < 8; j++) strcat(line, " ");
-
-strcat(line, " bytes ");
-if (file->read_only) strcat(line, " [RO] ");
-term.write(line);
-term.write("\n");
+crc_async.fs = &fs;
+crc_async.files = crc_files;
+crc_async.results = crc_results;
+crc_started = Clock::cycles();
+crc_count = count;
+Jobs::submit(0, count, 1, crc_file_job, &crc_async, crc_group);
+term.write("\nCRC job submitted, results will follow.\n");
+if (Jobs::get_workers() < 2) Jobs::wait(crc_group);
 }
 
-char total[32];
-int_to_str(count, total);
-term.write("\nTotal: ");
-term.write(total);
-term.write(" files\n");
+void write_rate(uint64_t bytes, uint64_t cycles) {
+char num[24];
+uint64_t ns = Clock::cycles_to_ns(cycles);
+u64_to_str(bytes / 1024, num);
+term.write(num);
+term.write(" KB in ");
+format_ns(ns, num);
+term.write(num);
+term.write(", ");
+uint64_t rate = ns ? bytes * 1000000000ULL / ns * 100 / (1024 * 1024) : 0;
+u64_to_str(rate / 100, num);
+term.write(num);
+term.write(rate % 100 < 10 ? ".0" : ".");
+u64_to_str(rate % 100, num);
+term.write(num);
+term.write(" MB/s");
 }
 
-void cat_file(const char* filename) {
-if (!filename || strlen(filename) == 0) {
-term.write("Usage: cat <filename>\n");
+void disk_info() {
+if (!ATA::is_present()) {
+term.write("\nNo ATA disk on the primary channel.\n");
 return;
 }
-
-char content[MAX_FILE_SIZE];
-uint32_t size;
-
-if (fs.load_file(filename, content, size)) {
+char num[24];
+term.write("\nModel:    ");
+term.write(ATA::get_model());
+term.write("\nSectors:  ");
+u64_to_str(ATA::get_sectors(), num);
+term.write(num);
+term.write("\nMultiple: ");
+int_to_str(ATA::get_multiple(), num);
+term.write(num);
+term.write("\nFS:       ");
+term.write(fs.is_disk_backed() ? "LBA " : "RAM only\n");
+if (fs.is_disk_backed()) {
+int_to_str(FS_DISK_LBA, num);
+term.write(num);
 term.write("\n");
-term.write(content);
-if (size > 0 && content[size - 1] != '\n') term.write("\n");
-} else {
-term.write("File '");
-term.write(filename);
-term.write("' not found.\n");
 }
+term.write("Read:     ");
+write_rate(ATA::get_read_bytes(), ATA::get_read_cycles());
+term.write("\nWritten:  ");
+write_rate(ATA::get_write_bytes(), ATA::get_write_cycles());
+int_to_str(ATA::get_errors(), num);
+term.write("\nErrors:   ");
+term.write(num);
+term.write("\nDMA:      ");
+if (!ATA::has_dma()) {
+term.write("not available\n");
+return;
 }
-
-void show_help() {
-term.write("\nCommands:\n");
-term.write("  help/?       - Show this help\n");
-term.write("  ls/dir       - List files\n");
-term.write("  cat <file>   - View file\n");
-term.write("  rm <file>    - Delete file\n");
-term.write("  mv <old> <new> - Rename\n");
-term.write("  time         - Show time\n");
-term.write("  clear/cls    - Clear screen\n");
-term.write("  about        - System info\n");
-term.write("  history      - Command history\n");
-term.write("  reboot       - Reboot system\n");
-term.write("  echo <text>  - Print text\n");
-term.write("  mem          - Memory info\n");
-term.write("  info         - System information\n");
-term.write("  tz <offset>  - Set timezone (-12 to +12)\n\n");
+term.write(ATA::is_dma_enabled() ? "enabled, " : "disabled, ");
+u64_to_str(ATA::get_dma_requests(), num);
+term.write(num);
+term.write(" requests\n");
 }
 
-void show_time() {
-uint8_t hour, minute, second;
-RTC::get_time(hour, minute, second);
-char time_str[16];
-time_str[0] = '0' + (hour / 10);
-time_str[1] = '0' + (hour % 10);
-time_str[2] = ':';
-time_str[3] = '0' + (minute / 10);
-time_str[4] = '0' + (minute % 10);
-time_str[5] = ':';
-time_str[6] = '0' + (second / 10);
-time_str[7] = '0' + (second % 10);
-time_str[8] = 0;
-term.write("\n");
-term.write(time_str);
-term.write("\n");
+uint64_t idle_cycles() {
+uint64_t total = 0;
+for (int i = 0; i < MAX_THREADS; i++) {
+Thread thread = Scheduler::get_thread(i);
+if (thread.state != THREAD_FREE && thread.priority == PRIO_IDLE) total += thread.cycles;
+}
+return total;
+}
 
-char tz_str[8];
-int_to_str(RTC::get_timezone(), tz_str);
-term.write("Timezone: UTC");
-if (RTC::get_timezone() >= 0) term.write("+");
-term.write(tz_str);
+bool bench_pass(const char* label, uint8_t* buffer, uint32_t count) {
+uint64_t read_cycles = 0;
+uint64_t write_cycles = 0;
+uint64_t read_idle = idle_cycles();
+bool ok = true;
+for (int i = 0; i < 4 && ok; i++) {
+ScopedTimer timer(read_cycles);
+ok = ATA::read(FS_DISK_LBA, count, buffer);
+}
+uint64_t write_idle = idle_cycles();
+read_idle = write_idle - read_idle;
+for (int i = 0; i < 4 && ok; i++) {
+ScopedTimer timer(write_cycles);
+ok = ATA::write(ATA_BENCH_LBA, count, buffer);
+}
+write_idle = idle_cycles() - write_idle;
+if (!ok) {
+term.write("\nDisk I/O error.\n");
+return false;
+}
+char num[24];
 term.write("\n");
+term.write(label);
+term.write(" read:  ");
+write_rate((uint64_t)count * 512 * 4, read_cycles);
+term.write("  CPU ");
+int_to_str(read_cycles ? 100 - (int)(read_idle * 100 / read_cycles) : 0, num);
+term.write(num);
+term.write("%\n");
+term.write(label);
+term.write(" write: ");
+write_rate((uint64_t)count * 512 * 4, write_cycles);
+term.write("  CPU ");
+int_to_str(write_cycles ? 100 - (int)(write_idle * 100 / write_cycles) : 0, num);
+term.write(num);
+term.write("%");
+return true;
 }
 
-void show_version() {
-term.write("\nEH-DSB v0.01\n");
-term.write("Public Domain (Unlicense)\n");
-term.write("by quik/QUIK1001\n");
+void disk_bench() {
+if (!ATA::is_present() || ATA::get_sectors() < ATA_BENCH_LBA + FS_TOTAL_SIZE / 512) {
+term.write("\nNo ATA disk large enough for the benchmark.\n");
+return;
+}
+uint8_t* buffer = (uint8_t*)JOB_BENCH_BASE;
+uint32_t count = FS_TOTAL_SIZE / 512;
+bool dma = ATA::is_dma_enabled();
+ATA::set_dma(false);
+bool ok = bench_pass("PIO", buffer, count);
+if (ok && ATA::has_dma()) {
+ATA::set_dma(true);
+bench_pass("DMA", buffer, count);
+}
+ATA::set_dma(dma);
+term.write("\n");
 }
 
-void show_memory_info() {
-char fs_size[16];
-int_to_str(fs.get_fs_size(), fs_size);
-term.write("  FS Used: ");
-term.write(fs_size);
-term.write(" bytes\n");
-char fs_free[16];
-int_to_str(fs.get_free_space(), fs_free);
-term.write("  FS Free: ");
-term.write(fs_free);
-term.write(" bytes\n");
+void cache_info() {
+char num[24];
+term.write("\nHits:       ");
+u64_to_str(BlockCache::get_hits(), num);
+term.write(num);
+term.write(" (");
+int_to_str(BlockCache::get_hit_rate(), num);
+term.write(num);
+term.write("%)\nMisses:     ");
+u64_to_str(BlockCache::get_misses(), num);
+term.write(num);
+term.write("\nRead-ahead: ");
+int_to_str(BlockCache::get_readahead_blocks(), num);
+term.write(num);
+term.write(" blocks\nWritebacks: ");
+int_to_str(BlockCache::get_writebacks(), num);
+term.write(num);
+term.write(" (");
+int_to_str(BlockCache::get_writeback_blocks(), num);
+term.write(num);
+term.write(" blocks)\nDirty:      ");
+int_to_str(BlockCache::get_dirty(), num);
+term.write(num);
+term.write("\nEvictions:  ");
+int_to_str(BlockCache::get_evictions(), num);
+term.write(num);
+term.write("\nDelay:      ");
+int_to_str(BlockCache::get_writeback_delay(), num);
+term.write(num);
+term.write(" ms\nErrors:     ");
+int_to_str(BlockCache::get_errors(), num);
+term.write(num);
+term.write("\n");
 }
 
-void show_system_info() {
-term.write("\nInformation:\n");
-term.write("  EH-DSB v0.01\n");
-term.write("  Public Domain\n");
-term.write("  quik/QUIK1001\n");
-char file_count[8];
-int_to_str(fs.get_file_count(), file_count);
-term.write("  Files: ");
-term.write(file_count);
+void floppy_info() {
+if (!Floppy::is_present()) {
+term.write("\nNo 1.44 MB floppy drive.\n");
+return;
+}
+char num[24];
+term.write("\nMotor:    ");
+term.write(Floppy::is_motor_on() ? "on" : "off");
+term.write("\nFS:       ");
+term.write(fs.get_backend() == FS_FLOPPY ? "on floppy" : "not on floppy");
+term.write("\nTracks:   ");
+int_to_str(Floppy::get_track_reads(), num);
+term.write(num);
+term.write(" read, ");
+int_to_str(Floppy::get_track_writes(), num);
+term.write(num);
+term.write(" written, ");
+int_to_str(Floppy::get_seeks(), num);
+term.write(num);
+term.write(" seeks\nCache:    ");
+int_to_str(Floppy::get_hits(), num);
+term.write(num);
+term.write(" hits, ");
+int_to_str(Floppy::get_misses(), num);
+term.write(num);
+term.write(" misses, ");
+int_to_str(Floppy::get_dirty_count(), num);
+term.write(num);
+term.write(" dirty\nErrors:   ");
+int_to_str(Floppy::get_errors(), num);
+term.write(num);
 term.write("\n");
-uint8_t hour, minute, second;
-RTC::get_time(hour, minute, second);
-char time_str[16];
-time_str[0] = '0' + (hour / 10);
-time_str[1] = '0' + (hour % 10);
-time_str[2] = ':';
-time_str[3] = '0' + (minute / 10);
-time_str[4] = '0' + (minute % 10);
-time_str[5] = ':';
-time_str[6] = '0' + (second / 10);
-time_str[7] = '0' + (second % 10);
-time_str[8] = 0;
-term.write("  Time: ");
-term.write(time_str);
+}
+
+void cpu_dump() {
 term.write("\n");
-char tz_str[8];
-int_to_str(RTC::get_timezone(), tz_str);
-term.write("  Timezone: UTC");
-if (RTC::get_timezone() >= 0) term.write("+");
-term.write(tz_str);
+write_padded("CPU", 5);
+write_padded("APIC", 6);
+write_padded("State", 10);
+term.write("LAPIC ticks\n");
+for (int i = 0; i < Smp::get_cpu_count(); i++) {
+const CpuInfo& cpu = Smp::get_cpu(i);
+char num[16];
+int_to_str(i, num);
+write_padded(num, 5);
+int_to_str(cpu.apic_id, num);
+write_padded(num, 6);
+write_padded(cpu.online ? "online" : "offline", 10);
+u64_to_str(cpu.ticks, num);
+term.write(num);
 term.write("\n");
 }
+term.write(IOAPIC::is_active() ? "IRQs routed through IOAPIC\n" : "IRQs routed through 8259 PIC\n");
+}
 
-void do_reboot() {
-term.write("\nRebooting...\n");
-for (int i = 0; i < 500000; i++);
-outb(0x64, 0xFE);
-while (1) {
-asm volatile("hlt");
+void latency_dump() {
+term.write("\nMain loop dispatch latency:\n");
+for (int i = 0; i < LATENCY_BUCKETS; i++) {
+uint32_t count = LoopLatency::get(i);
+if (count == 0) continue;
+char num[24];
+format_ns(i == 0 ? 0 : (1000ULL << i), num);
+term.write("  >= ");
+write_padded(num, 12);
+u64_to_str(count, num);
+term.write(num);
+term.write("\n");
 }
+char num[24];
+format_ns(LoopLatency::get_max() * 1000, num);
+term.write("  max ");
+term.write(num);
+term.write("\n");
 }
 
-void set_timezone(const char* arg) {
-while (*arg == ' ') arg++;
-int offset = 0;
-bool negative = false;
-if (*arg == '-') {
-negative = true;
-arg++;
+void draw_perf_top(uint32_t* counts) {
+memset(counts, 0, MAX_SYMBOLS * sizeof(uint32_t));
+uint32_t unknown = Sampler::get_outside();
+for (int i = 0; i < SAMPLE_BUCKETS; i++) {
+uint32_t samples = Sampler::get_bucket(i);
+if (!samples) continue;
+int index = Symbols::find(Sampler::bucket_address(i));
+if (index < 0) unknown += samples;
+else counts[index] += samples;
+}
+uint32_t total = Sampler::get_total();
+char line[16];
+term.fill_rect(0, 2, 80, 21, 0x1F, ' ');
+u64_to_str(total, line);
+term.write_at(2, 2, "Samples:", 0x1E);
+term.write_at(11, 2, line, 0x1F);
+u64_to_str(unknown, line);
+term.write_at(24, 2, "Outside kernel text:", 0x1E);
+term.write_at(45, 2, line, 0x1F);
+term.write_at(2, 4, "Overhead  Samples   Function", 0x1E);
+for (int row = 0; row < 18; row++) {
+int best = -1;
+for (int i = 0; i < Symbols::get_count(); i++) {
+if (counts[i] && (best < 0 || counts[i] > counts[best])) best = i;
+}
+if (best < 0) break;
+uint32_t permille = total ? (uint32_t)((uint64_t)counts[best] * 1000 / total) : 0;
+fixed_to_str(permille, 1, line);
+strcat(line, "%");
+term.write_at(4, 5 + row, line, 0x1F);
+u64_to_str(counts[best], line);
+term.write_at(12, 5 + row, line, 0x1F);
+char name[56];
+Symbols::get_name(best, name, sizeof(name));
+term.write_at(22, 5 + row, name, 0x1F);
+counts[best] = 0;
+}
+}
+
+void perf_top() {
+static uint32_t counts[MAX_SYMBOLS];
+term.set_color(0x0F, 0x01);
+term.clear();
+term.write_at(2, 0, "perf top - sampling at 1 kHz, any key to exit", 0x1F);
+EventQueue::clear();
+draw_perf_top(counts);
+static TimerCallback refresh;
+TimerWheel::setup(refresh, 0, 0, TIMER_UI);
+TimerWheel::start(refresh, 1000, 1000);
+Event event;
+while (true) {
+EventQueue::wait(event);
+if (event.type == EVENT_KEY) break;
+if (event.type == EVENT_TIMER && event.data == &refresh) draw_perf_top(counts);
 }
-while (*arg >= '0' && *arg <= '9') {
-offset = offset * 10 + (*arg - '0');
-arg++;
+TimerWheel::cancel(refresh);
+term.set_color(0x0F, 0x01);
+term.clear();
+term.write("EH-DSB v0.01 Terminal\n");
+term.write("==================\n");
 }
-if (negative) offset = -offset;
-if (offset >= -12 && offset <= 12) {
-RTC::set_timezone(offset);
-char tz_str[8];
-int_to_str(offset, tz_str);
-term.write("\nTimezone set to UTC");
-if (offset >= 0) term.write("+");
-term.write(tz_str);
-term.write("\n");
-} else {
-term.write("\nInvalid timezone. Use -12 to +12\n");
+
+void trace_dump() {
+Trace::stop();
+if (!Serial::is_present()) {
+term.write("\nNo COM1 port.\n");
+return;
 }
+uint32_t total = 0;
+for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+uint32_t head = Trace::get_head(cpu);
+total += head < TRACE_EVENTS ? head : TRACE_EVENTS;
+}
+klog(LOG_INFO, "trace dump begin, %u events", total);
+Serial::write_wait("{\"traceEvents\":[\n");
+bool first = true;
+for (int cpu = 0; cpu < MAX_CPUS; cpu++) {
+uint32_t head = Trace::get_head(cpu);
+if (head == 0) continue;
+uint32_t begin = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+char line[160];
+char num[24];
+strcpy(line, first ? "" : ",\n");
+strcat(line, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":");
+int_to_str(cpu, num);
+strcat(line, num);
+strcat(line, ",\"args\":{\"name\":\"CPU ");
+strcat(line, num);
+strcat(line, "\"}}");
+Serial::write_wait(line);
+first = false;
+TraceEvent* ring = Trace::ring(cpu);
+for (uint32_t i = begin; i < head; i++) {
+TraceEvent& event = ring[i % TRACE_EVENTS];
+uint64_t ns = Clock::cycles_to_ns(event.timestamp - Trace::get_start());
+strcpy(line, ",\n{\"name\":\"");
+strcat(line, event.name);
+strcat(line, event.type == TRACE_BEGIN_EVENT ? "\",\"ph\":\"B\"" :
+event.type == TRACE_END_EVENT ? "\",\"ph\":\"E\"" : "\",\"ph\":\"i\",\"s\":\"t\"");
+strcat(line, ",\"pid\":0,\"tid\":");
+int_to_str(event.cpu, num);
+strcat(line, num);
+strcat(line, ",\"ts\":");
+u64_to_str(ns / 1000, num);
+strcat(line, num);
+strcat(line, ".");
+uint32_t frac = (uint32_t)(ns % 1000);
+num[0] = '0' + frac / 100;
+num[1] = '0' + (frac / 10) % 10;
+num[2] = '0' + frac % 10;
+num[3] = 0;
+strcat(line, num);
+strcat(line, "}");
+Serial::write_wait(line);
+}
+}
+Serial::write_wait("\n]}\n");
+klog(LOG_INFO, "trace dump end");
+char count[12];
+int_to_str(total, count);
+term.write("\nStreamed ");
+term.write(count);
+term.write(" events to COM1.\n");
+}
+
+void time_command(char* cmd) {
+while (*cmd == ' ') cmd++;
+uint64_t cycles = 0;
+bool still_open;
+{
+ScopedTimer timer(cycles);
+still_open = run_command(cmd);
+}
+if (!still_open) return;
+char num[24];
+term.write("\nreal ");
+format_ns(Clock::cycles_to_ns(cycles), num);
+term.write(num);
+term.write(", ");
+u64_to_str(cycles, num);
+term.write(num);
+term.write(" cycles\n");
 }
 
 void execute_command() {
@@ -2335,14 +8764,44 @@ add_to_history(input_buffer);
 char* cmd = input_buffer;
 while (*cmd == ' ')  cmd++;
 
+if (!run_command(cmd)) return;
+term.write("\nehdsb> ");
+}
+
+bool run_command(char* cmd) {
 if (strcmp(cmd, "help") == 0 || strcmp(cmd, "?") == 0) {
 show_help();
 } else if (strcmp(cmd, "ls") == 0 || strcmp(cmd, "dir") == 0) {
-list_files();
+list_files("");
+} else if (strncmp(cmd, "ls ", 3) == 0) {
+list_files(cmd + 3);
+} else if (strncmp(cmd, "dir ", 4) == 0) {
+list_files(cmd + 4);
+} else if (strcmp(cmd, "cd") == 0 || strcmp(cmd, "pwd") == 0) {
+char path[MAX_PATH];
+fs.get_cwd(path, sizeof(path));
+term.write("\n");
+term.write(path);
+term.write("\n");
+} else if (strncmp(cmd, "cd ", 3) == 0) {
+const char* path = cmd + 3;
+while (*path == ' ') path++;
+if (!fs.change_dir(path)) term.write("\nNo such directory.\n");
+} else if (strncmp(cmd, "mkdir ", 6) == 0) {
+const char* path = cmd + 6;
+while (*path == ' ') path++;
+term.write(fs.make_dir(path) ? "\nDirectory created.\n" : "\nMkdir failed.\n");
+} else if (strncmp(cmd, "rmdir ", 6) == 0) {
+const char* path = cmd + 6;
+while (*path == ' ') path++;
+term.write(fs.remove_dir(path) ? "\nDirectory removed.\n" : "\nRmdir failed (not empty or in use?).\n");
 } else if (strncmp(cmd, "cat ", 4) == 0) {
 cat_file(cmd + 4);
 } else if (strcmp(cmd, "time") == 0) {
 show_time();
+} else if (strncmp(cmd, "time ", 5) == 0) {
+time_command(cmd + 5);
+if (!command_mode) return false;
 } else if (strcmp(cmd, "clear") == 0 || strcmp(cmd, "cls") == 0) {
 term.clear();
 term.write("EH-DSB v0.01 Terminal\n");
@@ -2370,18 +8829,21 @@ term.write("\nFile deleted.\n");
 } else {
 term.write("\nDelete failed.\n");
 }
+} else if (strncmp(cmd, "append ", 7) == 0) {
+append_line(cmd + 7);
 } else if (strncmp(cmd, "mv ", 3) == 0) {
 const char* arg = cmd + 3;
 while (*arg == ' ') arg++;
 const char* space = strstr(arg, " ");
 if (space) {
-char old_name[13], new_name[13];
+char old_name[MAX_PATH], new_name[MAX_PATH];
 int i;
-for (i = 0; i < 12 && arg + i < space; i++) old_name[i] = arg[i];
+for (i = 0; i < MAX_PATH - 1 && arg + i < space; i++) old_name[i] = arg[i];
 old_name[i] = 0;
 const char* new_part = space + 1;
 while (*new_part == ' ') new_part++;
-strncpy(new_name, new_part, 12);
+strncpy(new_name, new_part, MAX_PATH - 1);
+new_name[MAX_PATH - 1] = 0;
 if (fs.rename_file(old_name, new_name)) {
 term.write("\nFile renamed.\n");
 } else {
@@ -2398,18 +8860,121 @@ term.write(cmd + 5);
 term.write("\n");
 } else if (strcmp(cmd, "mem") == 0) {
 show_memory_info();
+} else if (strcmp(cmd, "compact") == 0) {
+fs.compact();
+term.write("\n");
+show_memory_info();
+} else if (strcmp(cmd, "bench mem") == 0) {
+run_mem_bench();
+} else if (strcmp(cmd, "bench fs") == 0) {
+run_fs_bench();
+} else if (strcmp(cmd, "perf top") == 0) {
+perf_top();
+} else if (strcmp(cmd, "jobs") == 0) {
+jobs_dump();
+} else if (strcmp(cmd, "jobs crc") == 0) {
+jobs_crc();
+} else if (strcmp(cmd, "jobs crc async") == 0) {
+jobs_crc_async();
+} else if (strcmp(cmd, "stress queues") == 0) {
+stress_queues();
+} else if (strncmp(cmd, "jobs bf ", 8) == 0) {
+jobs_bf(cmd + 8);
+} else if (strcmp(cmd, "jobs bench") == 0) {
+jobs_bench();
+} else if (strcmp(cmd, "disk") == 0) {
+disk_info();
+} else if (strcmp(cmd, "disk bench") == 0) {
+disk_bench();
+} else if (strcmp(cmd, "floppy") == 0) {
+floppy_info();
+} else if (strcmp(cmd, "sync") == 0) {
+uint32_t written = BlockCache::get_writeback_blocks();
+if (!fs.sync()) {
+term.write("\nDisk I/O error.\n");
+} else {
+char num[12];
+int_to_str(BlockCache::get_writeback_blocks() - written, num);
+term.write("\n");
+term.write(num);
+term.write(" blocks written back.\n");
+}
+} else if (strcmp(cmd, "cache") == 0) {
+cache_info();
+} else if (strcmp(cmd, "cache test") == 0) {
+if (!fs.is_disk_backed()) {
+term.write("\nNo disk, cache not in use.\n");
+} else {
+term.write(BlockCache::self_test() ? "\nWrite ordering OK.\n" : "\nWrite ordering FAILED.\n");
+}
+} else if (strncmp(cmd, "cache delay ", 12) == 0) {
+int ms = 0;
+const char* p = cmd + 12;
+while (*p == ' ') p++;
+const char* digits = p;
+for (; *p >= '0' && *p <= '9'; p++) {
+if (ms <= 60000) ms = ms * 10 + (*p - '0');
+}
+while (*p == ' ') p++;
+if (p == digits || *p) {
+term.write("\nUsage: cache delay <ms>\n");
+} else if (ms > 60000) {
+term.write("\nDelay must be 0-60000 ms.\n");
+} else {
+BlockCache::set_writeback_delay(ms);
+term.write(ms ? "\nWrite-back delay set.\n" : "\nWrite-through enabled.\n");
+}
+} else if (strcmp(cmd, "cpus") == 0) {
+cpu_dump();
+} else if (strcmp(cmd, "ps") == 0) {
+thread_dump();
+} else if (strncmp(cmd, "quantum ", 8) == 0) {
+int ms = 0;
+for (const char* p = cmd + 8; *p >= '0' && *p <= '9'; p++) ms = ms * 10 + (*p - '0');
+if (ms < 1 || ms > 1000) {
+term.write("\nQuantum must be 1-1000 ms.\n");
+} else {
+Scheduler::set_quantum(ms);
+term.write("\nQuantum set.\n");
+}
+} else if (strcmp(cmd, "latency") == 0) {
+latency_dump();
+} else if (strcmp(cmd, "latency reset") == 0) {
+LoopLatency::reset();
+term.write("\nLatency histogram cleared.\n");
+} else if (strcmp(cmd, "perf reset") == 0) {
+Sampler::reset();
+term.write("\nSamples cleared.\n");
+} else if (strcmp(cmd, "serial on") == 0 || strcmp(cmd, "serial off") == 0) {
+serial_mirror = strcmp(cmd, "serial on") == 0;
+term.set_serial_mirror(serial_mirror);
+term.write(Serial::is_present() ? "\nSerial mirror " : "\nNo COM1 port, mirror ");
+term.write(serial_mirror ? "on.\n" : "off.\n");
+} else if (strcmp(cmd, "trace start") == 0) {
+Trace::start();
+term.write("\nTracing started.\n");
+} else if (strcmp(cmd, "trace stop") == 0) {
+Trace::stop();
+term.write("\nTracing stopped.\n");
+} else if (strcmp(cmd, "trace dump") == 0) {
+trace_dump();
+} else if (strcmp(cmd, "prof dump") == 0) {
+profile_dump();
+} else if (strcmp(cmd, "prof reset") == 0) {
+Profiler::reset();
+term.write("\nProfile counters reset.\n");
 } else if (strcmp(cmd, "info") == 0) {
 show_system_info();
 } else if (strncmp(cmd, "tz ", 3) == 0) {
 set_timezone(cmd + 3);
 } else if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "quit") == 0) {
 command_mode = false;
-return;
+term.set_serial_mirror(false);
+return false;
 } else if (cmd[0] != 0) {
 term.write("\nUnknown command. Type 'help'\n");
 }
-
-term.write("\nehdsb> ");
+return true;
 }
 
 void clear_input_line() {
@@ -2424,7 +8989,10 @@ term.write(input_buffer);
 public:
 TerminalShell(VGATerminal& t, FileSystem& f)
 : term(t), fs(f), cursor(0), history_count(0), history_pos(0), command_mode(false),
-history_browsing(false) {
+history_browsing(false), serial_mirror(false), crc_started(0), crc_count(0), crc_ready(false), running_command(false) {
+crc_group.pending = 0;
+crc_group.on_done = on_crc_done;
+crc_group.owner = this;
 input_buffer[0] = 0;
 temp_buffer[0] = 0;
 }
@@ -2439,22 +9007,22 @@ term.set_color(0x0F, 0x01);
 term.clear();
 term.write("EH-DSB v0.01 Terminal\n");
 term.write("==================\n");
+term.set_serial_mirror(serial_mirror);
 term.write("Type 'help' for commands. F4 to exit.\n\nehdsb> ");
 term.set_mouse_visible(false);
+if (crc_ready) report_crc();
 }
 
 bool is_active() { return command_mode; }
 
-bool handle_input() {
-if (!command_mode) return false;
-
-if (Keyboard::is_key_pressed()) {
-char c = Keyboard::get_char();
-if (c == 0) return true;
+void on_key(char c) {
+if (!command_mode) return;
+TRACE_SCOPE("TerminalShell::on_key");
 
 if (c == (char)0xF4) {
 command_mode = false;
-return false;
+term.set_serial_mirror(false);
+return;
 }
 
 if (c == (char)0x10) {
@@ -2469,7 +9037,7 @@ strcpy(input_buffer, history[history_pos]);
 cursor = strlen(input_buffer);
 restore_input_line();
 }
-return true;
+return;
 }
 
 if (c == (char)0x11) {
@@ -2491,7 +9059,7 @@ strcpy(input_buffer, temp_buffer);
 cursor = strlen(input_buffer);
 restore_input_line();
 }
-return true;
+return;
 }
 
 if (c == '\n') {
@@ -2500,10 +9068,13 @@ history_browsing = false;
 history_pos = history_count;
 }
 term.write("\n");
+running_command = true;
 execute_command();
+running_command = false;
 cursor = 0;
 input_buffer[0] = 0;
 temp_buffer[0] = 0;
+if (crc_ready && command_mode) report_crc();
 } else if (c == '\b') {
 if (cursor > 0) {
 cursor--;
@@ -2517,26 +9088,52 @@ input_buffer[cursor] = 0;
 term.putchar(c);
 }
 }
-return true;
+
+static void on_crc_done(WaitGroup* group) {
+TerminalShell* shell = (TerminalShell*)group->owner;
+shell->crc_ready = true;
+if (shell->command_mode && !shell->running_command) shell->report_crc();
 }
 
-void update() {
-if (!command_mode) return;
+void report_crc() {
+crc_ready = false;
+char num[24];
+uint32_t combined = 0;
+for (int i = 0; i < crc_count; i++) combined ^= crc_results[i];
+clear_input_line();
+term.write("\n[jobs] CRC32 of ");
+int_to_str(crc_count, num);
+term.write(num);
+term.write(" files done in ");
+format_ns(Clock::cycles_to_ns(Clock::cycles() - crc_started), num);
+term.write(num);
+term.write(", xor ");
+hex_to_str(combined, num);
+term.write(num);
+term.write("\nehdsb> ");
+restore_input_line();
 }
+
+void on_paint() {}
 };
 class ClockDisplay {
 private:
 VGATerminal& term;
 uint8_t last_hour, last_minute;
 char time_str[6];
+TimerCallback timer;
+static void on_timer(void* arg) { ((ClockDisplay*)arg)->update(); }
 public:
 ClockDisplay(VGATerminal& t) : term(t), last_hour(0), last_minute(0) {
 time_str[0] = '0'; time_str[1] = '0'; time_str[2] = ':';
 time_str[3] = '0'; time_str[4] = '0'; time_str[5] = 0;
+TimerWheel::setup(timer, on_timer, this, TIMER_UI);
+}
+void start() {
+TimerWheel::start(timer, 1000, 1000);
 }
-void update() {
-if (!RTC::should_update()) return;
 
+void update() {
 uint8_t hour, minute, second;
 RTC::get_time(hour, minute, second);
 
@@ -2568,7 +9165,7 @@ FileManager fileman;
 BrainfuckIDE brainfuck;
 SystemMonitor monitor;
 TerminalShell terminal;
-enum App { NONE, EDITOR, CALC, FILEMAN, BF, TERMINAL, MONITOR } current_app;
+App* focused;
 void draw_desktop() {
 term.set_color(0x0F, 0x01);
 term.clear();
@@ -2604,135 +9201,124 @@ term.write_at(2, 19, "Press F1-F6 for apps  ", 0x07);
 term.write_at(2, 20, "by quik/QUIK1001 - Public Domain  ", 0x08);
 term.set_mouse_visible(true);
 }
-public:
-Desktop() : fs(), clock(term), editor(term, fs), calculator(term), fileman(term, fs, &editor),
-brainfuck(term, fs), monitor(term, fs), terminal(term, fs), current_app(NONE) {
-RTC::init();
+void launch(int index) {
+if (index == 0) {
+focused = &editor;
+editor.open();
+} else if (index == 1) {
+focused = &calculator;
+calculator.open();
+} else if (index == 2) {
+focused = &fileman;
+fileman.open();
+} else if (index == 3) {
+focused = &terminal;
+terminal.open();
+} else if (index == 4) {
+focused = &brainfuck;
+brainfuck.open();
+} else if (index == 5) {
+focused = &monitor;
+monitor.open();
+}
 }
-void run() {
-Mouse::init();
-draw_desktop();
-
-while (true) {
-Mouse::update();
-clock.update();
-RTC::tick();
 
-if (current_app == EDITOR) {
-editor.update();
-if (Keyboard::is_key_pressed()) {
-char c = Keyboard::get_char();
-if (c != 0) editor.handle_input(c);
+void desktop_event(const Event& event) {
+if (event.type == EVENT_KEY && event.key >= (char)0xF1 && event.key <= (char)0xF6) {
+launch((uint8_t)event.key - 0xF1);
+return;
 }
-if (!editor.is_active()) {
-if (fileman.is_edit_mode()) {
-current_app = FILEMAN;
-fileman.set_edit_mode(false);
-fileman.open();
-} else {
-current_app = NONE;
-draw_desktop();
+static const int widths[6] = {18, 18, 20, 16, 20, 22};
+for (int i = 0; i < 6; i++) {
+if (event.clicked(2, 11 + i, widths[i], 1)) {
+launch(i);
+return;
 }
 }
-} else if (current_app == CALC) {
-calculator.update();
-if (Keyboard::is_key_pressed()) {
-char c = Keyboard::get_char();
-if (c != 0) calculator.handle_input(c);
 }
-if (!calculator.is_active()) {
-current_app = NONE;
-draw_desktop();
+
+static void on_mouse(void* arg) {
+((VGATerminal*)arg)->update_mouse();
 }
-} else if (current_app == FILEMAN) {
-fileman.update();
-if (Keyboard::is_key_pressed()) {
-char c = Keyboard::get_char();
-if (c != 0) fileman.handle_input(c);
+
+void dispatch(const Event& event) {
+if (!focused) {
+desktop_event(event);
+return;
 }
+
+if (event.type == EVENT_KEY) focused->on_key(event.key);
+else if (event.type == EVENT_MOUSE) focused->on_mouse(event);
+else if (event.type == EVENT_PAINT) focused->on_paint();
+
+if (focused == &editor) {
+if (!editor.is_active()) {
 if (fileman.is_edit_mode()) {
-current_app = EDITOR;
-} else if (!fileman.is_active()) {
-current_app = NONE;
+focused = &fileman;
+fileman.set_edit_mode(false);
+fileman.open();
+} else {
+focused = 0;
 draw_desktop();
 }
-} else if (current_app == BF) {
-if (Keyboard::is_key_pressed()) {
-char c = Keyboard::get_char();
-if (c != 0) brainfuck.handle_input(c);
 }
-if (!brainfuck.is_active() && !brainfuck.is_running()) {
-current_app = NONE;
+} else if (focused == &fileman && fileman.is_edit_mode()) {
+focused = &editor;
+} else if (!focused->is_active()) {
+focused = 0;
 draw_desktop();
 }
-} else if (current_app == MONITOR) {
-monitor.update();
-if (Keyboard::is_key_pressed()) {
-char c = Keyboard::get_char();
-if (c != 0) monitor.handle_input(c);
-}
-if (!monitor.is_active()) {
-current_app = NONE;
-draw_desktop();
 }
-} else if (current_app == TERMINAL) {
-terminal.update();
-if (!terminal.handle_input()) {
-current_app = NONE;
+public:
+Desktop() : fs(), clock(term), editor(term, fs), calculator(term), fileman(term, fs, &editor),
+brainfuck(term, fs), monitor(term, fs), terminal(term, fs), focused(0) {}
+void run() {
+Mouse::init();
+Keyboard::init();
 draw_desktop();
-}
-} else {
-term.update_mouse();
-if (Keyboard::is_key_pressed()) {
-char c = Keyboard::get_char();
-if (c != 0) {
-if (c == (char)0xF1) {
-current_app = EDITOR;
-editor.open();
-} else if (c == (char)0xF2) {
-current_app = CALC;
-calculator.open();
-} else if (c == (char)0xF3) {
-current_app = FILEMAN;
-fileman.open();
-} else if (c == (char)0xF4) {
-current_app = TERMINAL;
-terminal.open();
-} else if (c == (char)0xF5) {
-current_app = BF;
-brainfuck.open();
-} else if (c == (char)0xF6) {
-current_app = MONITOR;
-monitor.open();
-}
-}
-}
-if (term.is_mouse_clicked(2, 11, 18, 1)) {
-current_app = EDITOR;
-editor.open();
-} else if (term.is_mouse_clicked(2, 12, 18, 1)) {
-current_app = CALC;
-calculator.open();
-} else if (term.is_mouse_clicked(2, 13, 20, 1)) {
-current_app = FILEMAN;
-fileman.open();
-} else if (term.is_mouse_clicked(2, 14, 16, 1)) {
-current_app = TERMINAL;
-terminal.open();
-} else if (term.is_mouse_clicked(2, 15, 20, 1)) {
-current_app = BF;
-brainfuck.open();
-} else if (term.is_mouse_clicked(2, 16, 22, 1)) {
-current_app = MONITOR;
-monitor.open();
-}
-}
+clock.start();
+EventQueue::set_mouse_hook(on_mouse, &term);
 
-for (int i = 0; i < 10000; i++);
+Event events[8];
+while (true) {
+EventQueue::wait(events[0]);
+int count = 1 + EventQueue::pop_batch(events + 1, 7);
+PROFILE_ZONE("Desktop::run");
+TRACE_SCOPE("Desktop::run");
+uint64_t start = Clock::cycles();
+for (int i = 0; i < count; i++) dispatch(events[i]);
+LoopLatency::record(Clock::cycles() - start);
 }
 }
 };
 extern "C" void kernel_main() {
+CPU::init();
+GDT::init(0, 0x90000);
+MemOps::init();
+CRC32::init();
+Clock::init();
+Symbols::init();
+Sampler::init();
+Interrupts::init();
+Smp::init();
+Scheduler::init();
+Timer::init();
+Serial::init();
+RTC::init();
+EventQueue::init();
+Jobs::set_completion_hook(EventQueue::post_job);
+Interrupts::enable();
+Jobs::init();
+Smp::start_aps();
+Jobs::set_workers(Smp::get_online_count());
+ATA::init();
+Floppy::init();
+klog(LOG_INFO, "EH-DSB v0.01 booting");
+klog(LOG_INFO, "%d of %d CPUs online, %s", Smp::get_online_count(), Smp::get_cpu_count(), IOAPIC::is_active() ? "IOAPIC" : "PIC");
+klog(LOG_INFO, "CPU %s, TSC %u kHz, mem ops %s", CPU::vendor, Clock::get_tsc_khz(), MemOps::variants[MemOps::selected].name);
+klog(LOG_INFO, "%d kernel symbols loaded", Symbols::get_count());
+if (ATA::is_present()) klog(LOG_INFO, "ATA %s, %u sectors, multiple %d", ATA::get_model(), ATA::get_sectors(), ATA::get_multiple());
+if (Floppy::is_present()) klog(LOG_INFO, "Floppy 1.44 MB, %d track cache", FDC_CACHE_TRACKS);
 Desktop desktop;
 desktop.run();
 }
@@ -2754,3 +9340,33 @@ while (1) {}
 extern "C" void __stack_chk_fail() {
 while (1) {}
 }
+extern "C" uint64_t __udivmoddi4(uint64_t num, uint64_t den, uint64_t* rem) {
+uint64_t quot = 0;
+uint64_t bit = 1;
+if (den == 0) {
+if (rem) *rem = num;
+return 0;
+}
+while (den < num && !(den & (1ULL << 63))) {
+den <<= 1;
+bit <<= 1;
+}
+while (bit) {
+if (num >= den) {
+num -= den;
+quot |= bit;
+}
+den >>= 1;
+bit >>= 1;
+}
+if (rem) *rem = num;
+return quot;
+}
+extern "C" uint64_t __udivdi3(uint64_t num, uint64_t den) {
+return __udivmoddi4(num, den, 0);
+}
+extern "C" uint64_t __umoddi3(uint64_t num, uint64_t den) {
+uint64_t rem;
+__udivmoddi4(num, den, &rem);
+return rem;
+}